@@ -1,5 +1,5 @@
 -module(memcached).
--export([start/0, start/1, put/3, del/2, get/2, take/2, stats/1]).
+-export([start/0, start/1, put/3, put/4, del/2, get/2, take/2, stats/1]).
 
 -define(BINARY_PORT, 889).
 
@@ -8,6 +8,7 @@
 -define(BT_DEL, 12).
 -define(BT_GET, 13).
 -define(BT_TAKE, 14).
+-define(BT_PUT_TTL, 15).
 -define(BT_STATS, 21).
 
 % memcached response codes.
@@ -70,6 +71,13 @@ send_put_request(Socket, Key, Value) ->
     Payload = build_request_payload(?BT_PUT, Key, Value),
     gen_tcp:send(Socket, Payload).
 
+% Sends the PUT_TTL request with Erlang terms: the TTL goes before the arguments of a PUT.
+send_put_request(Socket, Key, Value, Ttl) ->
+    BinKey = build_arg_payload(Key),
+    BinValue = build_arg_payload(Value),
+    Payload = <<?BT_PUT_TTL, Ttl:32/unsigned, BinKey/binary, BinValue/binary>>,
+    gen_tcp:send(Socket, Payload).
+
 % Receives the response to the PUT request.
 receive_put_response(Socket) ->
     case gen_tcp:recv(Socket, 1) of
@@ -86,6 +94,13 @@ put(Socket, Key, Value) ->
         Error -> Error
     end.
 
+% Sends a PUT request of a key that expires after Ttl seconds and waits for the response.
+put(Socket, Key, Value, Ttl) ->
+    case send_put_request(Socket, Key, Value, Ttl) of
+        ok -> receive_put_response(Socket);
+        Error -> Error
+    end.
+
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 %%% GET
 %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
@@ -11,10 +11,18 @@ char *binary_type_str(enum BinaryType binary_type) {
     return "GET";
   case BT_TAKE:
     return "TAKE";
+  case BT_PUT_TTL:
+    return "PUT_TTL";
   case BT_STATS:
     return "STATS";
+  case BT_SNAPSHOT:
+    return "SNAPSHOT";
+  case BT_ACCEPT_COMPRESSED:
+    return "ACCEPT_COMPRESSED";
   case BT_OK:
     return "OK";
+  case BT_OK_COMPRESSED:
+    return "OK_COMPRESSED";
   case BT_EINVAL:
     return "EINVAL";
   case BT_ENOTFOUND:
@@ -6,8 +6,12 @@ enum BinaryType {
   BT_DEL = 12,
   BT_GET = 13,
   BT_TAKE = 14,
+  BT_PUT_TTL = 15,
   BT_STATS = 21,
+  BT_SNAPSHOT = 22,
+  BT_ACCEPT_COMPRESSED = 23,
   BT_OK = 101,
+  BT_OK_COMPRESSED = 102,
   BT_EINVAL = 111,
   BT_ENOTFOUND = 112,
   BT_EBINARY = 113,
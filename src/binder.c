@@ -1,19 +1,51 @@
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/sysinfo.h>
 #include <unistd.h>
 
 #include "sockets.h"
 
+// Option of the cache executable that makes each worker run its own event loop
+// with its own listen sockets.
+#define PER_WORKER_OPTION "--event-loops=per-worker"
+
+// Closes the given listen sockets.
+static void close_sockets(int *fds, int num_fds) {
+  for (int i = 0; i < num_fds; i++) {
+    close(fds[i]);
+  }
+}
+
+// Returns a newly allocated string with the given file descriptors separated by
+// commas, or NULL if there's not enough memory for it.
+static char *fd_list_arg(int *fds, int num_fds) {
+  // Each file descriptor takes at most 10 digits, plus the separator.
+  size_t size = (size_t)num_fds * 11 + 1;
+  char *arg = malloc(size);
+  if (arg == NULL) {
+    return NULL;
+  }
+  size_t length = 0;
+  arg[0] = '\0';
+  for (int i = 0; i < num_fds; i++) {
+    length += snprintf(arg + length, size - length, "%s%d", i == 0 ? "" : ",",
+                       fds[i]);
+  }
+  return arg;
+}
+
 int main(int argc, char *argv[]) {
 
-  if (argc != 6) {
+  if (argc < 6) {
     fprintf(stderr,
-            "USAGE: %s MEMCACHED_BINARY TEXT_PORT BINARY_PORT GID UID\n",
+            "USAGE: %s MEMCACHED_BINARY TEXT_PORT BINARY_PORT GID UID "
+            "[MEMCACHED_OPTIONS]\n",
             argv[0]);
     return 1;
   }
 
-  int rv;
   char *memcached_binary = argv[1];
   char *text_port = argv[2];
   char *binary_port = argv[3];
@@ -31,48 +63,80 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
+  // With per-worker event loops each worker of the cache (there's one per
+  // processor) listens on sockets of its own, bound to the same ports with
+  // SO_REUSEPORT so that the kernel spreads the connections among them.
+  bool per_worker = false;
+  for (int i = 6; i < argc; i++) {
+    if (strcmp(argv[i], PER_WORKER_OPTION) == 0) {
+      per_worker = true;
+    }
+  }
+  int num_listeners = per_worker ? get_nprocs() : 1;
+  int *text_fds = malloc(sizeof(int) * num_listeners);
+  int *binary_fds = malloc(sizeof(int) * num_listeners);
+  if (text_fds == NULL || binary_fds == NULL) {
+    perror("ERROR during malloc for the listen sockets");
+    return 1;
+  }
+
   // Bind sockets while we have root privileges.
-  int text_fd = create_listen_socket(text_port);
-  int binary_fd = create_listen_socket(binary_port);
+  for (int i = 0; i < num_listeners; i++) {
+    text_fds[i] = create_listen_socket(text_port, per_worker);
+    binary_fds[i] = create_listen_socket(binary_port, per_worker);
+  }
 
   // Drop root privileges now that we binded the sockets.
   if (setgid(gid) == -1) {
     fprintf(stderr, "ERROR: couldn't drop group privileges.\n");
-    close(text_fd);
-    close(binary_fd);
+    close_sockets(text_fds, num_listeners);
+    close_sockets(binary_fds, num_listeners);
     return 1;
   }
   if (setuid(uid) == -1) {
     fprintf(stderr, "ERROR: couldn't drop user privileges.\n");
-    close(text_fd);
-    close(binary_fd);
+    close_sockets(text_fds, num_listeners);
+    close_sockets(binary_fds, num_listeners);
     return 1;
   }
 
   // Run the cache by passing the file descriptors to the cache executable.
-  char text_fd_arg[32];
-  rv = snprintf(text_fd_arg, 32, "%d", text_fd);
-  if (rv < 0) {
+  char *text_fd_arg = fd_list_arg(text_fds, num_listeners);
+  if (text_fd_arg == NULL) {
     fprintf(
         stderr,
         "ERROR: failed to create text protocol file descriptor argument.\n");
     return 1;
   }
-  char binary_fd_arg[32];
-  rv = snprintf(binary_fd_arg, 32, "%d", binary_fd);
-  if (rv < 0) {
+  char *binary_fd_arg = fd_list_arg(binary_fds, num_listeners);
+  if (binary_fd_arg == NULL) {
     fprintf(
         stderr,
         "ERROR: failed to create binary protocol file descriptor argument.\n");
     return 1;
   }
 
-  char *args[] = {memcached_binary, text_fd_arg, binary_fd_arg, NULL};
+  // The options after the uid are passed as they are to the cache executable.
+  int num_options = argc - 6;
+  char **args = malloc(sizeof(char *) * (num_options + 4));
+  if (args == NULL) {
+    perror("ERROR during malloc for cache arguments");
+    close_sockets(text_fds, num_listeners);
+    close_sockets(binary_fds, num_listeners);
+    return 1;
+  }
+  args[0] = memcached_binary;
+  args[1] = text_fd_arg;
+  args[2] = binary_fd_arg;
+  for (int i = 0; i < num_options; i++) {
+    args[3 + i] = argv[6 + i];
+  }
+  args[3 + num_options] = NULL;
 
   execv(memcached_binary, args);
 
   perror("ERROR during execv for cache executable");
-  close(text_fd);
-  close(binary_fd);
+  close_sockets(text_fds, num_listeners);
+  close_sockets(binary_fds, num_listeners);
   return 1;
 }
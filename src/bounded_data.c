@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "bounded_data.h"
+#include "hash.h"
 #include "utils.h"
 
 // True if the given BoundedData instances are equal byte-by-byte, false
@@ -29,16 +30,8 @@ void bounded_data_print(struct BoundedData *bounded_data) {
   printf("%s", bounded_data->data);
 }
 
-#define FNV_OFFSET 14695981039346656037UL
-#define FNV_PRIME 1099511628211UL
-
-// Returns the 64-bit FNV-1a hash for the given data.
-// More information: https://en.wikipedia.org/wiki/Fowler–Noll–Vo_hash_function
+// Returns the 64-bit hash for the given data, computed with the hash function
+// selected at build time (see hash.h).
 uint64_t bounded_data_hash(struct BoundedData *bounded_data) {
-  uint64_t hash = FNV_OFFSET;
-  for (int i = 0; i < bounded_data->size; i++) {
-    hash ^= (uint64_t)(unsigned char)bounded_data->data[i];
-    hash *= FNV_PRIME;
-  }
-  return hash;
+  return hash_bytes(bounded_data->data, bounded_data->size);
 }
\ No newline at end of file
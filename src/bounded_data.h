@@ -20,8 +20,8 @@ void bounded_data_destroy(struct BoundedData *bounded_data);
 // Prints the given BoundedData instance to standard output, no newline.
 void bounded_data_print(struct BoundedData *bounded_data);
 
-// Returns the 64-bit FNV-1a hash for the given data.
-// More information: https://en.wikipedia.org/wiki/Fowler–Noll–Vo_hash_function
+// Returns the 64-bit hash for the given data, computed with the hash function
+// selected at build time (see hash.h).
 uint64_t bounded_data_hash(struct BoundedData *bounded_data);
 
 #endif
\ No newline at end of file
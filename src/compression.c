@@ -0,0 +1,261 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "compression.h"
+
+// Shortest match the LZ4 block format can encode.
+#define COMPRESSION_MIN_MATCH 4
+
+// Farthest back a match can start, since offsets take two bytes.
+#define COMPRESSION_MAX_OFFSET 65535
+
+// The last bytes of a block are always literals, and the last match has to
+// start at least this many bytes before the end of the block, so that
+// decompressors can copy whole words without checking every byte.
+#define COMPRESSION_LAST_LITERALS 5
+#define COMPRESSION_MATCH_FIND_LIMIT 12
+
+// log2 of the number of positions in the hash table of the compressor.
+#define COMPRESSION_HASH_BITS 12
+
+// Positions the compressor skips after failing to find a match grow by one
+// every 2^COMPRESSION_SKIP_SHIFT positions without matches, so that data that
+// doesn't compress goes by quickly.
+#define COMPRESSION_SKIP_SHIFT 6
+
+// Largest length that fits in a nibble of the token of a sequence. Longer ones
+// continue in the bytes that follow it.
+#define COMPRESSION_NIBBLE_MAX 15
+
+// Returns the four bytes at the given position.
+static uint32_t read_sequence(const char *position) {
+  uint32_t sequence;
+  memcpy(&sequence, position, sizeof(sequence));
+  return sequence;
+}
+
+// Returns the slot of the hash table of the compressor for the given four
+// bytes.
+static uint32_t hash_sequence(uint32_t sequence) {
+  return (sequence * 2654435761U) >> (32 - COMPRESSION_HASH_BITS);
+}
+
+// Returns the number of bytes that a length takes after the token of a
+// sequence, given that its nibble holds up to COMPRESSION_NIBBLE_MAX of it.
+static size_t extra_length_bytes(size_t length) {
+  if (length < COMPRESSION_NIBBLE_MAX) {
+    return 0;
+  }
+  return (length - COMPRESSION_NIBBLE_MAX) / 255 + 1;
+}
+
+// Writes the part of the given length that doesn't fit in its nibble, as
+// bytes of 255 followed by the remainder.
+static uint8_t *write_extra_length(uint8_t *output, size_t length) {
+  if (length < COMPRESSION_NIBBLE_MAX) {
+    return output;
+  }
+  length -= COMPRESSION_NIBBLE_MAX;
+  while (length >= 255) {
+    *output++ = 255;
+    length -= 255;
+  }
+  *output++ = length;
+  return output;
+}
+
+// Writes a sequence of the given literals followed by a match of the given
+// offset and length, or only the literals if the length is 0, which is how a
+// block ends. Returns the end of the sequence, or NULL if it doesn't fit
+// before the given end of the output.
+static uint8_t *write_sequence(uint8_t *output, uint8_t *output_end,
+                               const char *literals, size_t literal_length,
+                               size_t offset, size_t match_length) {
+  size_t match_code = match_length == 0 ? 0 : match_length - 4;
+  size_t size = 1 + extra_length_bytes(literal_length) + literal_length;
+  if (match_length != 0) {
+    size += 2 + extra_length_bytes(match_code);
+  }
+  if (size > (size_t)(output_end - output)) {
+    return NULL;
+  }
+
+  uint8_t literal_nibble = literal_length < COMPRESSION_NIBBLE_MAX
+                               ? literal_length
+                               : COMPRESSION_NIBBLE_MAX;
+  uint8_t match_nibble =
+      match_code < COMPRESSION_NIBBLE_MAX ? match_code : COMPRESSION_NIBBLE_MAX;
+  *output++ = literal_nibble << 4 | match_nibble;
+  output = write_extra_length(output, literal_length);
+  memcpy(output, literals, literal_length);
+  output += literal_length;
+
+  if (match_length != 0) {
+    *output++ = offset & 0xFF;
+    *output++ = offset >> 8;
+    output = write_extra_length(output, match_code);
+  }
+  return output;
+}
+
+// Compresses the given buffer in the LZ4 block format into the given
+// destination buffer, which has room for the given number of bytes. Returns
+// the number of bytes of the compressed data, or 0 if it doesn't fit in the
+// destination buffer.
+size_t compression_compress(const char *source, size_t source_size,
+                            char *destination, size_t capacity) {
+  uint8_t *output = (uint8_t *)destination;
+  uint8_t *output_end = output + capacity;
+  size_t anchor = 0; // Start of the literals that weren't written yet.
+
+  if (source_size > COMPRESSION_MATCH_FIND_LIMIT) {
+    // Last position a match can start at, and last one it can extend to.
+    size_t find_limit = source_size - COMPRESSION_MATCH_FIND_LIMIT;
+    size_t match_limit = source_size - COMPRESSION_LAST_LITERALS;
+    // Most recent position of each hash of four bytes. Stale or colliding
+    // positions are told apart by comparing their bytes.
+    uint32_t table[1 << COMPRESSION_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t position = 0;
+    while (position < find_limit) {
+      uint32_t sequence = read_sequence(source + position);
+      uint32_t slot = hash_sequence(sequence);
+      size_t candidate = table[slot];
+      table[slot] = position;
+      if (candidate >= position ||
+          position - candidate > COMPRESSION_MAX_OFFSET ||
+          read_sequence(source + candidate) != sequence) {
+        position += 1 + ((position - anchor) >> COMPRESSION_SKIP_SHIFT);
+        continue;
+      }
+
+      // Extend the match forwards and then backwards over the literals.
+      size_t length = COMPRESSION_MIN_MATCH;
+      while (position + length < match_limit &&
+             source[candidate + length] == source[position + length]) {
+        length++;
+      }
+      while (position > anchor && candidate > 0 &&
+             source[position - 1] == source[candidate - 1]) {
+        position--;
+        candidate--;
+        length++;
+      }
+
+      output = write_sequence(output, output_end, source + anchor,
+                              position - anchor, position - candidate, length);
+      if (output == NULL) {
+        return 0;
+      }
+      position += length;
+      anchor = position;
+    }
+  }
+
+  output = write_sequence(output, output_end, source + anchor,
+                          source_size - anchor, 0, 0);
+  if (output == NULL) {
+    return 0;
+  }
+  return output - (uint8_t *)destination;
+}
+
+// Reads the part of a length that didn't fit in its nibble from the given
+// input, adding it to the given length. Returns false if the input ends before
+// the length does.
+static bool read_extra_length(const uint8_t **input, const uint8_t *input_end,
+                              size_t *length) {
+  uint8_t byte;
+  do {
+    if (*input == input_end) {
+      return false;
+    }
+    byte = *(*input)++;
+    *length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+// Decodes the given LZ4 block into the given destination buffer, which must be
+// exactly the size of the original data, or only checks the block if the
+// destination is NULL. Returns true if the block decodes to that size, false
+// if it's corrupt or decodes to a different size.
+static bool decode(const char *source, size_t source_size, char *destination,
+                   size_t destination_size) {
+  const uint8_t *input = (const uint8_t *)source;
+  const uint8_t *input_end = input + source_size;
+  size_t written = 0;
+
+  while (input < input_end) {
+    uint8_t token = *input++;
+
+    size_t literal_length = token >> 4;
+    if (literal_length == COMPRESSION_NIBBLE_MAX &&
+        !read_extra_length(&input, input_end, &literal_length)) {
+      return false;
+    }
+    if (literal_length > (size_t)(input_end - input) ||
+        literal_length > destination_size - written) {
+      return false;
+    }
+    if (destination != NULL) {
+      memcpy(destination + written, input, literal_length);
+    }
+    input += literal_length;
+    written += literal_length;
+
+    if (input == input_end) {
+      // The last sequence only has literals.
+      return written == destination_size;
+    }
+
+    if (input_end - input < 2) {
+      return false;
+    }
+    size_t offset = input[0] | (size_t)input[1] << 8;
+    input += 2;
+    if (offset == 0 || offset > written) {
+      return false;
+    }
+    size_t match_length = token & COMPRESSION_NIBBLE_MAX;
+    if (match_length == COMPRESSION_NIBBLE_MAX &&
+        !read_extra_length(&input, input_end, &match_length)) {
+      return false;
+    }
+    match_length += COMPRESSION_MIN_MATCH;
+    if (match_length > destination_size - written) {
+      return false;
+    }
+
+    if (destination != NULL) {
+      char *match = destination + written - offset;
+      if (offset >= match_length) {
+        memcpy(destination + written, match, match_length);
+      } else {
+        // The match overlaps the bytes it produces, which repeats them.
+        for (size_t i = 0; i < match_length; i++) {
+          destination[written + i] = match[i];
+        }
+      }
+    }
+    written += match_length;
+  }
+
+  return false;
+}
+
+// Decompresses the given LZ4 block into the given destination buffer, which
+// must be exactly the size of the original data. Returns true if successful,
+// false if the block is corrupt or doesn't decompress to that size.
+bool compression_decompress(const char *source, size_t source_size,
+                            char *destination, size_t destination_size) {
+  return decode(source, source_size, destination, destination_size);
+}
+
+// Returns true if the given LZ4 block decompresses to exactly the given number
+// of bytes, without decompressing it.
+bool compression_check(const char *source, size_t source_size,
+                       size_t original_size) {
+  return decode(source, source_size, NULL, original_size);
+}
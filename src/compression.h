@@ -0,0 +1,42 @@
+#ifndef __COMPRESSION_H__
+#define __COMPRESSION_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Largest ratio between the sizes of the original and the compressed data in
+// the LZ4 block format: every byte of a block produces up to 255 bytes.
+#define COMPRESSION_MAX_RATIO 255
+
+// Algorithms that values can be compressed with.
+enum CompressionAlgorithm {
+  COMPRESSION_NONE, // Values are stored as they come.
+  // Values above COMPRESSION_MIN_VALUE_SIZE are compressed in the LZ4 block
+  // format when that saves at least COMPRESSION_MIN_SAVINGS_PERCENT of them.
+  COMPRESSION_LZ,
+};
+
+// Compresses the given buffer in the LZ4 block format into the given
+// destination buffer, which has room for the given number of bytes. Returns
+// the number of bytes of the compressed data, or 0 if it doesn't fit in the
+// destination buffer.
+// The compressor looks for matches with a single hash table of recent
+// positions and takes the first one it finds, favouring speed over ratio:
+// values are compressed while their PUT is being handled.
+size_t compression_compress(const char *source, size_t source_size,
+                            char *destination, size_t capacity);
+
+// Decompresses the given LZ4 block into the given destination buffer, which
+// must be exactly the size of the original data. Returns true if successful,
+// false if the block is corrupt or doesn't decompress to that size. It never
+// reads or writes outside of the given buffers.
+bool compression_decompress(const char *source, size_t source_size,
+                            char *destination, size_t destination_size);
+
+// Returns true if the given LZ4 block decompresses to exactly the given number
+// of bytes, without decompressing it. Used to check compressed data that comes
+// from a file before trusting it.
+bool compression_check(const char *source, size_t source_size,
+                       size_t original_size);
+
+#endif
@@ -0,0 +1,230 @@
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "epoch.h"
+#include "parameters.h"
+
+// The global epoch only moves forward when every thread inside a critical
+// section has seen its current value. Memory retired during epoch E can't be
+// referenced by anyone once the global epoch reaches E + 2: every reader that
+// was around when it was retired has left its critical section by then.
+
+#define CACHE_LINE_SIZE 64
+
+struct RetiredPointer {
+  void (*destroy)(void *ptr);
+  void *ptr;
+  uint64_t epoch; // Global epoch when the pointer was retired.
+};
+
+// State of a thread. Padded to a cache line so that threads announcing their
+// epoch don't invalidate each other's caches.
+struct EpochThread {
+  // Epoch seen when entering the current critical section shifted one bit to
+  // the left, with the lowest bit set while inside of it.
+  uint64_t state;
+
+  struct RetiredPointer *retired;
+  uint64_t num_retired;
+  uint64_t retired_capacity;
+  uint64_t retired_since_reclaim;
+
+  // The thread that had the slot unregistered, so another one can take it.
+  bool free;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static uint64_t global_epoch = 0;
+
+static struct EpochThread epoch_threads[EPOCH_MAX_THREADS];
+static uint64_t num_epoch_threads = 0;
+
+static __thread struct EpochThread *current_thread = NULL;
+
+// Registers the calling thread. Threads are registered on their first use of
+// epochs anyway, but registering them at startup allocates their memory before
+// the cache fills up.
+void epoch_register() {
+  if (current_thread != NULL) {
+    return;
+  }
+
+  // Take the slot of a thread that unregistered if there's any, which keeps
+  // its memory for the retired pointers.
+  uint64_t num_threads =
+      __atomic_load_n(&num_epoch_threads, __ATOMIC_SEQ_CST);
+  if (num_threads > EPOCH_MAX_THREADS) {
+    num_threads = EPOCH_MAX_THREADS;
+  }
+  for (uint64_t i = 0; i < num_threads; i++) {
+    bool expected = true;
+    if (__atomic_compare_exchange_n(&epoch_threads[i].free, &expected, false,
+                                    false, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+      current_thread = &epoch_threads[i];
+      return;
+    }
+  }
+
+  uint64_t slot = __atomic_fetch_add(&num_epoch_threads, 1, __ATOMIC_SEQ_CST);
+  if (slot >= EPOCH_MAX_THREADS) {
+    fprintf(stderr, "epoch_register: more than %d threads use epochs\n",
+            EPOCH_MAX_THREADS);
+    abort();
+  }
+
+  struct EpochThread *thread = &epoch_threads[slot];
+  thread->retired =
+      malloc(sizeof(struct RetiredPointer) * EPOCH_RETIRE_CAPACITY);
+  if (thread->retired == NULL) {
+    perror("epoch_register malloc");
+    abort();
+  }
+  thread->retired_capacity = EPOCH_RETIRE_CAPACITY;
+  current_thread = thread;
+}
+
+// Frees the memory retired by the calling thread, waiting for the readers that
+// could still be holding it, and gives up the slot of the thread so that
+// another one can take it. Threads that used epochs must call it before they
+// exit, outside of a critical section, or their retired memory is never freed
+// and their slot is never reused.
+void epoch_unregister() {
+  struct EpochThread *thread = current_thread;
+  if (thread == NULL) {
+    return;
+  }
+
+  epoch_reclaim();
+  while (thread->num_retired > 0) {
+    sched_yield();
+    epoch_reclaim();
+  }
+  thread->retired_since_reclaim = 0;
+  current_thread = NULL;
+  __atomic_store_n(&thread->free, true, __ATOMIC_RELEASE);
+}
+
+// Returns the state of the calling thread, registering it on its first call.
+static struct EpochThread *epoch_thread() {
+  if (current_thread == NULL) {
+    epoch_register();
+  }
+  return current_thread;
+}
+
+// Marks the calling thread as being inside a read critical section. Critical
+// sections must not be nested.
+void epoch_enter() {
+  struct EpochThread *thread = epoch_thread();
+  uint64_t epoch;
+
+  // The announced epoch must still be the global one after the announcement is
+  // visible, otherwise the global epoch could move two steps ahead without
+  // waiting for this thread.
+  do {
+    epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&thread->state, (epoch << 1) | 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  } while (__atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST) != epoch);
+}
+
+// Marks the calling thread as being outside a read critical section.
+void epoch_exit() {
+  __atomic_store_n(&epoch_thread()->state, 0, __ATOMIC_RELEASE);
+}
+
+// Moves the global epoch one step forward if every thread inside a critical
+// section has seen the current one.
+static void epoch_try_advance() {
+  uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+  uint64_t num_threads =
+      __atomic_load_n(&num_epoch_threads, __ATOMIC_SEQ_CST);
+  if (num_threads > EPOCH_MAX_THREADS) {
+    num_threads = EPOCH_MAX_THREADS;
+  }
+
+  for (uint64_t i = 0; i < num_threads; i++) {
+    uint64_t state = __atomic_load_n(&epoch_threads[i].state, __ATOMIC_SEQ_CST);
+    if ((state & 1) && (state >> 1) != epoch) {
+      return;
+    }
+  }
+
+  // Somebody else might have moved it already, which is just as good.
+  __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, false,
+                              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+// Tries to free the memory retired by the calling thread. Threads that retire
+// memory only once in a while should call this periodically.
+void epoch_reclaim() {
+  struct EpochThread *thread = epoch_thread();
+  if (thread->num_retired == 0) {
+    return;
+  }
+
+  // Memory is freed two epochs after being retired, so when no reader lags
+  // behind everything retired so far is freed right away.
+  epoch_try_advance();
+  epoch_try_advance();
+  uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+
+  // Free what is old enough and compact the rest at the start of the list.
+  uint64_t kept = 0;
+  for (uint64_t i = 0; i < thread->num_retired; i++) {
+    struct RetiredPointer *retired = &thread->retired[i];
+    if (retired->epoch + 2 <= epoch) {
+      retired->destroy(retired->ptr);
+    } else {
+      thread->retired[kept++] = *retired;
+    }
+  }
+  thread->num_retired = kept;
+  thread->retired_since_reclaim = 0;
+}
+
+// Defers the call of the given function with the given pointer until no reader
+// can be holding a reference to the pointer.
+void epoch_retire(void (*destroy)(void *ptr), void *ptr) {
+  struct EpochThread *thread = epoch_thread();
+
+  if (thread->num_retired == thread->retired_capacity) {
+    // The list is usually full because the memory is exhausted and a reader is
+    // lagging behind, so don't count on growing it. Outside of a critical
+    // section the calling thread doesn't hold anything back, so it can wait for
+    // the other readers to move on.
+    epoch_reclaim();
+    while (thread->num_retired == thread->retired_capacity &&
+           (thread->state & 1) == 0) {
+      sched_yield();
+      epoch_reclaim();
+    }
+  }
+
+  if (thread->num_retired == thread->retired_capacity) {
+    // Inside of a critical section the memory retired during it can't be freed
+    // until it ends, so growing the list is the only way out.
+    uint64_t capacity = thread->retired_capacity * 2;
+    struct RetiredPointer *retired =
+        realloc(thread->retired, sizeof(struct RetiredPointer) * capacity);
+    if (retired == NULL) {
+      perror("epoch_retire realloc");
+      abort();
+    }
+    thread->retired = retired;
+    thread->retired_capacity = capacity;
+  }
+
+  struct RetiredPointer *retired = &thread->retired[thread->num_retired++];
+  retired->destroy = destroy;
+  retired->ptr = ptr;
+  retired->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+
+  thread->retired_since_reclaim++;
+  if (thread->retired_since_reclaim >= EPOCH_RECLAIM_THRESHOLD) {
+    epoch_reclaim();
+  }
+}
@@ -0,0 +1,39 @@
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+// Epoch-based memory reclamation.
+//////////////////////////////////////
+// Threads that read shared data without taking its locks do so between
+// epoch_enter and epoch_exit. Memory that is unlinked from shared data while
+// such readers might still be looking at it is handed to epoch_retire instead
+// of being freed right away, and it's only freed once every thread that was
+// inside a critical section at that moment has left it.
+
+// Registers the calling thread. Threads are registered on their first use of
+// epochs anyway, but registering them at startup allocates their memory before
+// the cache fills up.
+void epoch_register();
+
+// Frees the memory retired by the calling thread, waiting for the readers that
+// could still be holding it, and gives up the slot of the thread so that
+// another one can take it. Threads that used epochs must call it before they
+// exit, outside of a critical section, or their retired memory is never freed
+// and their slot is never reused.
+void epoch_unregister();
+
+// Marks the calling thread as being inside a read critical section. Critical
+// sections must not be nested.
+void epoch_enter();
+
+// Marks the calling thread as being outside a read critical section.
+void epoch_exit();
+
+// Defers the call of the given function with the given pointer until no reader
+// can be holding a reference to the pointer.
+void epoch_retire(void (*destroy)(void *ptr), void *ptr);
+
+// Tries to free the memory retired by the calling thread. Threads that retire
+// memory only once in a while should call this periodically.
+void epoch_reclaim();
+
+#endif
@@ -9,16 +9,34 @@
 #include "sockets.h"
 
 // Frees and clears the pointer to the response content of the EventData
-// instance.
+// instance. If the content is the value of an item, the reference to the item
+// is released instead.
 void event_data_clear_response_content(struct EventData *event_data) {
+  if (event_data->response_item != NULL) {
+    item_release(event_data->response_item);
+    event_data->response_item = NULL;
+    event_data->response_content = NULL;
+  }
   if (event_data->response_content != NULL) {
     bounded_data_destroy(event_data->response_content);
     event_data->response_content = NULL;
   }
 }
 
-// Resets the state of the client to handle a new request. This frees the read
-// and write buffers should the be different from NULL.
+// Sets the value of the given item as the response content of the EventData
+// instance, which takes over the reference of the caller to the item.
+void event_data_set_response_item(struct EventData *event_data,
+                                  struct Item *item) {
+  event_data->response_item = item;
+  event_data->response_value.size = item->value_size;
+  event_data->response_value.data = item_value(item);
+  event_data->response_content = &event_data->response_value;
+}
+
+// Resets the state of the client to handle a new request. This frees the
+// arguments and the response content should they be different from NULL, but
+// keeps the bytes received after the request and the request buffer of a text
+// client for the next requests.
 void event_data_reset(struct EventData *event_data) {
   if (event_data->connection_type == TEXT) {
     // Initial state for a text client.
@@ -27,23 +45,31 @@ void event_data_reset(struct EventData *event_data) {
     // Initial state for a binary client.
     event_data->client_state = BINARY_READY;
   }
-  if (event_data->read_buffer != NULL) {
-    bounded_data_destroy(event_data->read_buffer);
-    event_data->read_buffer = NULL;
-  }
   event_data->total_bytes_read = 0;
   event_data->response_type = BT_EINVAL;
   event_data_clear_response_content(event_data);
   event_data->total_bytes_written = 0;
   event_data->command_type = BT_EINVAL;
   event_data->arg_size = 0;
+  event_data->ttl = 0;
   if (event_data->arg1 != NULL) {
     bounded_data_destroy(event_data->arg1);
     event_data->arg1 = NULL;
   }
-  if (event_data->arg2 != NULL) {
-    bounded_data_destroy(event_data->arg2);
-    event_data->arg2 = NULL;
+  if (event_data->item != NULL) {
+    item_release(event_data->item);
+    event_data->item = NULL;
+  }
+}
+
+// True if the client is writing a response, false if it's reading a request.
+bool event_data_writing(struct EventData *event_data) {
+  switch (event_data->client_state) {
+  case TEXT_WRITING_RESPONSE:
+  case BINARY_WRITING_RESPONSE:
+    return true;
+  default:
+    return false;
   }
 }
 
@@ -54,11 +80,16 @@ void event_data_initialize(struct EventData *event_data, int fd,
   event_data->connection_type = connection_type;
   strncpy(event_data->host, "UNINITIALIZED", NI_MAXHOST);
   strncpy(event_data->port, "UNINITIALIZED", NI_MAXSERV);
+  event_data->input = NULL;
   event_data->read_buffer = NULL;
+  event_data->skipping_line = false;
+  event_data->accepts_compressed = false;
   event_data->response_content = NULL;
+  event_data->response_item = NULL;
+  event_data->pending_read = NULL;
   event_data->command_type = BT_EINVAL;
   event_data->arg1 = NULL;
-  event_data->arg2 = NULL;
+  event_data->item = NULL;
   event_data_reset(event_data);
 }
 
@@ -80,6 +111,12 @@ struct EventData *event_data_create(int fd,
 // Frees the allocated memory for an EventData struct and performs any required
 // frees of the contained data.
 static void event_data_destroy(struct EventData *event_data) {
+  if (event_data->input != NULL) {
+    ring_buffer_destroy(event_data->input);
+  }
+  if (event_data->read_buffer != NULL) {
+    bounded_data_destroy(event_data->read_buffer);
+  }
   free(event_data);
 }
 
@@ -151,16 +188,14 @@ char *client_state_str(enum ClientState client_state) {
     return "TEXT_READY";
   case TEXT_READING_INPUT:
     return "TEXT_READING_INPUT";
-  case TEXT_WRITING_COMMAND:
-    return "TEXT_WRITING_COMMAND";
-  case TEXT_WRITING_CONTENT:
-    return "TEXT_WRITING_CONTENT";
-  case TEXT_WRITING_NEWLINE:
-    return "TEXT_WRITING_NEWLINE";
+  case TEXT_WRITING_RESPONSE:
+    return "TEXT_WRITING_RESPONSE";
   case BINARY_READY:
     return "BINARY_READY";
   case BINARY_READING_COMMAND:
     return "BINARY_READING_COMMAND";
+  case BINARY_READING_TTL:
+    return "BINARY_READING_TTL";
   case BINARY_READING_ARG1_SIZE:
     return "BINARY_READING_ARG1_SIZE";
   case BINARY_READING_ARG1_DATA:
@@ -169,12 +204,8 @@ char *client_state_str(enum ClientState client_state) {
     return "BINARY_READING_ARG2_SIZE";
   case BINARY_READING_ARG2_DATA:
     return "BINARY_READING_ARG2_DATA";
-  case BINARY_WRITING_COMMAND:
-    return "BINARY_WRITING_COMMAND";
-  case BINARY_WRITING_CONTENT_SIZE:
-    return "BINARY_WRITING_CONTENT_SIZE";
-  case BINARY_WRITING_CONTENT_DATA:
-    return "BINARY_WRITING_CONTENT_DATA";
+  case BINARY_WRITING_RESPONSE:
+    return "BINARY_WRITING_RESPONSE";
   default:
     return "UNKNOWN_CLIENT_STATE";
   }
@@ -8,45 +8,62 @@
 
 #include "binary_type.h"  // for struct BinaryType
 #include "bounded_data.h" // for struct BoundedData
+#include "item.h"         // for struct Item
+#include "ring_buffer.h"  // for struct RingBuffer
 
 enum ClientState {
   // Text client states, in order:
   TEXT_READY,
   TEXT_READING_INPUT,
-  TEXT_WRITING_COMMAND,
-  TEXT_WRITING_CONTENT,
-  TEXT_WRITING_NEWLINE,
+  TEXT_WRITING_RESPONSE,
   // Binary client states, in order:
   BINARY_READY,
   BINARY_READING_COMMAND,
+  BINARY_READING_TTL,
   BINARY_READING_ARG1_SIZE,
   BINARY_READING_ARG1_DATA,
   BINARY_READING_ARG2_SIZE,
   BINARY_READING_ARG2_DATA,
-  BINARY_WRITING_COMMAND,
-  BINARY_WRITING_CONTENT_SIZE,
-  BINARY_WRITING_CONTENT_DATA,
+  BINARY_WRITING_RESPONSE,
 };
 
 enum ConnectionType { BINARY, TEXT };
 
+struct PendingRead;
+
 struct EventData {
   // Connection data:
   int fd;                              // File descriptor of the client socket.
   enum ConnectionType connection_type; // Connection type of the client.
   char host[NI_MAXHOST];               // IP address.
   char port[NI_MAXSERV];               // Port.
+  // Bytes received from the client that weren't parsed yet, which are kept
+  // from one request to the next so that pipelined requests aren't lost.
+  struct RingBuffer *input;
   // Client state:
   enum ClientState client_state;        // State of the client.
-  struct BoundedData *read_buffer;      // Current read buffer of the client.
+  struct BoundedData *read_buffer;      // Request buffer of a text client.
+  // Dropping the rest of a text request that went over the size limit.
+  bool skipping_line;
+  // The binary client sent ACCEPT_COMPRESSED, so compressed values are sent to
+  // it as they're stored, see handle_accept_compressed.
+  bool accepts_compressed;
   size_t total_bytes_read;              // Total bytes read into the buffer.
   char response_type;                   // Response command.
   struct BoundedData *response_content; // Current write buffer of the client.
+  // Item whose value is the response content, if any. The response is written
+  // straight from the item, which is pinned until the response is cleared.
+  struct Item *response_item;
+  struct BoundedData response_value; // Response content of response_item.
+  // Read of the response content from the extension store that starts once
+  // the request is handled, see submit_pending_read.
+  struct PendingRead *pending_read;
   size_t total_bytes_written; // Total bytes written for the current state.
   char command_type;          // Command type of the request
   uint32_t arg_size;          // Buffer for the size being read.
+  uint32_t ttl;               // TTL of a PUT_TTL command, 0 for a PUT.
   struct BoundedData *arg1;   // First argument with its size.
-  struct BoundedData *arg2;   // Second argument with its size.
+  struct Item *item;          // Item being read for a PUT command.
 };
 
 #define MAX_EPOLL_EVENTS 128
@@ -78,8 +95,17 @@ char *client_state_str(enum ClientState client_state);
 // Resets the state of the client to handle a new request.
 void event_data_reset(struct EventData *event_data);
 
+// True if the client is writing a response, false if it's reading a request.
+bool event_data_writing(struct EventData *event_data);
+
 // Frees and clears the pointer to the response content of the EventData
-// instance.
+// instance. If the content is the value of an item, the reference to the item
+// is released instead.
 void event_data_clear_response_content(struct EventData *event_data);
 
+// Sets the value of the given item as the response content of the EventData
+// instance, which takes over the reference of the caller to the item.
+void event_data_set_response_item(struct EventData *event_data,
+                                  struct Item *item);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,339 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "epoch.h"
+#include "extstore.h"
+#include "parameters.h"
+
+// Header of a record in the file, followed by the key and the value.
+struct ExtStoreRecordHeader {
+  uint32_t key_size;
+  uint32_t value_size;
+  uint32_t compressed;
+};
+
+// Returns the number of bytes of the record of a key and a value of the given
+// sizes.
+static uint64_t extstore_record_size(uint32_t key_size, uint32_t value_size) {
+  return sizeof(struct ExtStoreRecordHeader) + (uint64_t)key_size + value_size;
+}
+
+// Writes all the bytes described by the given vector at the given offset of the
+// file of the store. Returns true if successful, false otherwise.
+static bool extstore_pwritev(struct ExtStore *store, struct iovec *iov,
+                             int iovcnt, uint64_t offset) {
+  while (iovcnt > 0) {
+    ssize_t nwritten = pwritev(store->fd, iov, iovcnt, offset);
+    if (nwritten == -1) {
+      perror("extstore_pwritev pwritev");
+      return false;
+    }
+    offset += nwritten;
+    // Skip the parts that were written, in case it was a short write.
+    while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+      nwritten -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + nwritten;
+      iov->iov_len -= nwritten;
+    }
+  }
+  return true;
+}
+
+// Returns the current generation of the given segment of the store.
+static uint32_t extstore_generation(struct ExtStore *store, uint64_t segment) {
+  return __atomic_load_n(&store->segments[segment].generation,
+                         __ATOMIC_SEQ_CST);
+}
+
+// True if the given location still points to the value it was set to, false
+// if its segment was reused since then.
+bool extstore_location_valid(struct ExtStore *store,
+                             struct ExtStoreLocation *location) {
+  uint64_t segment = location->offset / EXTSTORE_SEGMENT_SIZE;
+  return extstore_generation(store, segment) == location->generation;
+}
+
+// Reads the value of the given request into its destination buffer from the
+// calling thread, without calling its done function. Returns true if the value
+// was read and its segment wasn't reused in the meantime, false otherwise.
+bool extstore_read(struct ExtStore *store, struct ExtStoreRead *read) {
+  if (!extstore_location_valid(store, &read->location)) {
+    return false;
+  }
+
+  struct ExtStoreRecordHeader header;
+  char *key = malloc(read->key_size);
+  if (key == NULL) {
+    return false;
+  }
+  struct iovec iov[] = {
+      {&header, sizeof(header)},
+      {key, read->key_size},
+      {read->destination, read->location.value_size},
+  };
+  ssize_t expected = sizeof(header) + (ssize_t)read->key_size +
+                     read->location.value_size;
+  ssize_t nread = preadv(store->fd, iov, 3, read->location.offset);
+  if (nread == -1) {
+    perror("extstore_read preadv");
+  }
+  bool success = nread == expected && header.key_size == read->key_size &&
+                 header.value_size == read->location.value_size &&
+                 memcmp(key, read->key, read->key_size) == 0;
+  free(key);
+
+  // The segment might have been reused while we were reading it.
+  return success && extstore_location_valid(store, &read->location);
+}
+
+// Body of the reader threads of the given store, which serve the queued read
+// requests in order.
+static void *extstore_reader(void *arg) {
+  struct ExtStore *store = arg;
+
+  // The requests are completed from this thread, and completing them might
+  // allocate memory, which can evict entries of the hash table.
+  epoch_register();
+
+  pthread_mutex_lock(&store->read_mutex);
+  while (true) {
+    while (store->first_read == NULL) {
+      pthread_cond_wait(&store->read_cond, &store->read_mutex);
+    }
+    struct ExtStoreRead *read = store->first_read;
+    store->first_read = read->next;
+    if (store->first_read == NULL) {
+      store->last_read = NULL;
+    }
+    pthread_mutex_unlock(&store->read_mutex);
+
+    read->success = extstore_read(store, read);
+    read->done(read);
+    epoch_reclaim();
+
+    pthread_mutex_lock(&store->read_mutex);
+  }
+  return NULL;
+}
+
+// Creates an extension store of EXTSTORE_SIZE bytes in the file at the given
+// path, which is truncated, and starts its reader threads. Returns NULL if the
+// file can't be opened.
+struct ExtStore *extstore_open(const char *path) {
+  struct ExtStore *store = malloc(sizeof(struct ExtStore));
+  if (store == NULL) {
+    perror("extstore_open malloc 1");
+    abort();
+  }
+  store->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (store->fd == -1) {
+    perror("extstore_open open");
+    free(store);
+    return NULL;
+  }
+
+  store->num_segments = EXTSTORE_SIZE / EXTSTORE_SEGMENT_SIZE;
+  if (store->num_segments < EXTSTORE_MIN_FREE_SEGMENTS + 1) {
+    store->num_segments = EXTSTORE_MIN_FREE_SEGMENTS + 1;
+  }
+  store->segments =
+      malloc(sizeof(struct ExtStoreSegment) * store->num_segments);
+  store->fill_order = malloc(sizeof(uint64_t) * store->num_segments);
+  store->reader_threads = malloc(sizeof(pthread_t) * EXTSTORE_READER_THREADS);
+  if (store->segments == NULL || store->fill_order == NULL ||
+      store->reader_threads == NULL) {
+    perror("extstore_open malloc 2");
+    abort();
+  }
+  for (uint64_t i = 0; i < store->num_segments; i++) {
+    store->segments[i].generation = 0;
+    store->segments[i].used = 0;
+    store->segments[i].writers = 0;
+    store->segments[i].free = i != 0;
+  }
+  store->write_segment = 0;
+  store->num_full = 0;
+  store->num_free = store->num_segments - 1;
+  pthread_mutex_init(&store->mutex, NULL);
+
+  pthread_mutex_init(&store->read_mutex, NULL);
+  pthread_cond_init(&store->read_cond, NULL);
+  store->first_read = NULL;
+  store->last_read = NULL;
+  for (int i = 0; i < EXTSTORE_READER_THREADS; i++) {
+    int rv = pthread_create(&store->reader_threads[i], NULL, extstore_reader,
+                            store);
+    if (rv != 0) {
+      perror("extstore_open pthread_create");
+      abort();
+    }
+  }
+
+  return store;
+}
+
+// Makes a free segment of the store the one being filled, once the current one
+// doesn't have room for the next record. Returns false if there is no free
+// segment. Assumes that the mutex of the store is acquired.
+static bool extstore_next_segment(struct ExtStore *store) {
+  if (store->num_free == 0) {
+    return false;
+  }
+  store->fill_order[store->num_full++] = store->write_segment;
+  for (uint64_t i = 0; i < store->num_segments; i++) {
+    if (store->segments[i].free) {
+      store->segments[i].free = false;
+      store->segments[i].used = 0;
+      store->num_free--;
+      store->write_segment = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Appends a record with the given key and value to the store, and sets the
+// given location to it. Returns false if no segment has room for it.
+bool extstore_write(struct ExtStore *store, const char *key, uint32_t key_size,
+                    const char *value, uint32_t value_size, bool compressed,
+                    struct ExtStoreLocation *location) {
+  uint64_t size = extstore_record_size(key_size, value_size);
+  if (size > EXTSTORE_SEGMENT_SIZE) {
+    return false;
+  }
+
+  // Reserve room for the record in the segment being filled, and write it
+  // without holding the mutex.
+  pthread_mutex_lock(&store->mutex);
+  struct ExtStoreSegment *segment = &store->segments[store->write_segment];
+  if (segment->used + size > EXTSTORE_SEGMENT_SIZE) {
+    if (!extstore_next_segment(store)) {
+      pthread_mutex_unlock(&store->mutex);
+      return false;
+    }
+    segment = &store->segments[store->write_segment];
+  }
+  location->offset =
+      store->write_segment * EXTSTORE_SEGMENT_SIZE + segment->used;
+  location->generation = segment->generation;
+  location->value_size = value_size;
+  location->compressed = compressed;
+  segment->used += size;
+  segment->writers++;
+  pthread_mutex_unlock(&store->mutex);
+
+  struct ExtStoreRecordHeader header = {key_size, value_size, compressed};
+  struct iovec iov[] = {
+      {&header, sizeof(header)},
+      {(char *)key, key_size},
+      {(char *)value, value_size},
+  };
+  bool success = extstore_pwritev(store, iov, 3, location->offset);
+
+  pthread_mutex_lock(&store->mutex);
+  segment->writers--;
+  pthread_mutex_unlock(&store->mutex);
+
+  return success;
+}
+
+// Queues the given read request. One of the reader threads reads the value
+// into its destination buffer, sets its success flag and calls its done
+// function. Reading fails if the segment of the value was reused meanwhile.
+void extstore_read_async(struct ExtStore *store, struct ExtStoreRead *read) {
+  read->next = NULL;
+  pthread_mutex_lock(&store->read_mutex);
+  if (store->last_read != NULL) {
+    store->last_read->next = read;
+  } else {
+    store->first_read = read;
+  }
+  store->last_read = read;
+  pthread_cond_signal(&store->read_cond);
+  pthread_mutex_unlock(&store->read_mutex);
+}
+
+// Compacts the oldest full segment of the store if fewer than
+// EXTSTORE_MIN_FREE_SEGMENTS segments are free. The given function is called
+// with every record of the segment and the given argument, and it returns true
+// if it wrote the record again (see extstore_write). The records written again
+// can take up to EXTSTORE_COMPACTION_MAX_LIVE_PERCENT of the segment: the
+// function is told whether the record still fits through the given flag, and
+// it drops the records that don't. Returns true if a segment was compacted.
+bool extstore_compact(struct ExtStore *store,
+                      bool (*rescue)(void *arg, struct ExtStoreRecord *record,
+                                     bool keep),
+                      void *arg) {
+  pthread_mutex_lock(&store->mutex);
+  if (store->num_free >= EXTSTORE_MIN_FREE_SEGMENTS || store->num_full == 0 ||
+      store->segments[store->fill_order[0]].writers > 0) {
+    pthread_mutex_unlock(&store->mutex);
+    return false;
+  }
+  uint64_t segment = store->fill_order[0];
+  uint64_t used = store->segments[segment].used;
+  uint32_t generation = store->segments[segment].generation;
+  pthread_mutex_unlock(&store->mutex);
+
+  // Only this thread reuses segments, and the segment is full, so its records
+  // don't change while they're read.
+  uint64_t base = segment * EXTSTORE_SEGMENT_SIZE;
+  char *buffer = malloc(used);
+  if (buffer != NULL) {
+    ssize_t nread = pread(store->fd, buffer, used, base);
+    if (nread != (ssize_t)used) {
+      // The records can't be kept, and the locations that point to them will
+      // find out that the segment was reused.
+      perror("extstore_compact pread");
+      nread = 0;
+    }
+
+    uint64_t budget =
+        EXTSTORE_SEGMENT_SIZE * EXTSTORE_COMPACTION_MAX_LIVE_PERCENT / 100;
+    uint64_t kept = 0;
+    uint64_t position = 0;
+    while (position + sizeof(struct ExtStoreRecordHeader) <= (uint64_t)nread) {
+      struct ExtStoreRecordHeader header;
+      memcpy(&header, buffer + position, sizeof(header));
+      uint64_t size = extstore_record_size(header.key_size, header.value_size);
+      if (position + size > (uint64_t)nread) {
+        break;
+      }
+      struct ExtStoreRecord record = {
+          .key = buffer + position + sizeof(header),
+          .key_size = header.key_size,
+          .value = buffer + position + sizeof(header) + header.key_size,
+          .location = {base + position, generation, header.value_size,
+                       header.compressed},
+      };
+      if (rescue(arg, &record, kept + size <= budget)) {
+        kept += size;
+      }
+      position += size;
+    }
+    free(buffer);
+  }
+
+  pthread_mutex_lock(&store->mutex);
+  store->num_full--;
+  memmove(store->fill_order, store->fill_order + 1,
+          sizeof(uint64_t) * store->num_full);
+  __atomic_store_n(&store->segments[segment].generation, generation + 1,
+                   __ATOMIC_SEQ_CST);
+  store->segments[segment].used = 0;
+  store->segments[segment].free = true;
+  store->num_free++;
+  pthread_mutex_unlock(&store->mutex);
+
+  return true;
+}
@@ -0,0 +1,114 @@
+#ifndef __EXTSTORE_H__
+#define __EXTSTORE_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Extension store: values evicted from memory are appended to a local file,
+// and the hash table only keeps a small entry with their location in it.
+//////////////////////////////////////
+// The file is split into segments of EXTSTORE_SEGMENT_SIZE bytes that are
+// filled one after the other. Once few segments are left free, the oldest one
+// is compacted: the values that are still in use are appended again to the
+// segment being filled, up to a share of the segment, and the segment is
+// reused. Every reuse bumps the generation of the segment, so that locations
+// that point to the values it held before can tell that they're gone.
+
+// Location of a value in an extension store.
+struct ExtStoreLocation {
+  uint64_t offset;     // Offset of the record of the value in the file.
+  uint32_t generation; // Generation of the segment when it was written.
+  uint32_t value_size;
+  bool compressed; // The value was compressed, see Item.
+};
+
+// A segment of the file of an extension store.
+struct ExtStoreSegment {
+  uint32_t generation; // Bumped every time the segment is reused.
+  uint64_t used;       // Bytes taken by records, while not free.
+  uint32_t writers;    // Records being written into the segment.
+  bool free;
+};
+
+// A request to read a value back from an extension store, see
+// extstore_read_async.
+struct ExtStoreRead {
+  struct ExtStoreLocation location;
+  const char *key; // Key the value belongs to, checked against the record.
+  uint32_t key_size;
+  char *destination; // Buffer for the value, of location.value_size bytes.
+  bool success;      // Set before the request is done.
+  // Called from a reader thread once the request is done.
+  void (*done)(struct ExtStoreRead *read);
+  void *data; // For the caller.
+  struct ExtStoreRead *next;
+};
+
+struct ExtStore {
+  int fd;
+  uint64_t num_segments;
+  struct ExtStoreSegment *segments;
+  // Protects the segments and the write position, but not the file itself:
+  // records are written and read without holding it.
+  pthread_mutex_t mutex;
+  uint64_t write_segment; // Segment being filled.
+  uint64_t *fill_order;   // Full segments, from the oldest to the newest.
+  uint64_t num_full;
+  uint64_t num_free;
+
+  // Queue of read requests and the threads that serve them.
+  pthread_mutex_t read_mutex;
+  pthread_cond_t read_cond;
+  struct ExtStoreRead *first_read;
+  struct ExtStoreRead *last_read;
+  pthread_t *reader_threads; // EXTSTORE_READER_THREADS of them.
+};
+
+// Creates an extension store of EXTSTORE_SIZE bytes in the file at the given
+// path, which is truncated, and starts its reader threads. Returns NULL if the
+// file can't be opened.
+struct ExtStore *extstore_open(const char *path);
+
+// Appends a record with the given key and value to the store, and sets the
+// given location to it. Returns false if no segment has room for it.
+bool extstore_write(struct ExtStore *store, const char *key, uint32_t key_size,
+                    const char *value, uint32_t value_size, bool compressed,
+                    struct ExtStoreLocation *location);
+
+// Queues the given read request. One of the reader threads reads the value
+// into its destination buffer, sets its success flag and calls its done
+// function. Reading fails if the segment of the value was reused meanwhile.
+void extstore_read_async(struct ExtStore *store, struct ExtStoreRead *read);
+
+// Reads the value of the given request into its destination buffer from the
+// calling thread, without calling its done function. Returns true if the value
+// was read and its segment wasn't reused in the meantime, false otherwise.
+bool extstore_read(struct ExtStore *store, struct ExtStoreRead *read);
+
+// A record found while compacting a segment, see extstore_compact.
+struct ExtStoreRecord {
+  const char *key;
+  uint32_t key_size;
+  const char *value;
+  struct ExtStoreLocation location;
+};
+
+// Compacts the oldest full segment of the store if fewer than
+// EXTSTORE_MIN_FREE_SEGMENTS segments are free. The given function is called
+// with every record of the segment and the given argument, and it returns true
+// if it wrote the record again (see extstore_write). The records written again
+// can take up to EXTSTORE_COMPACTION_MAX_LIVE_PERCENT of the segment: the
+// function is told whether the record still fits through the given flag, and
+// it drops the records that don't. Returns true if a segment was compacted.
+bool extstore_compact(struct ExtStore *store,
+                      bool (*rescue)(void *arg, struct ExtStoreRecord *record,
+                                     bool keep),
+                      void *arg);
+
+// True if the given location still points to the value it was set to, false
+// if its segment was reused since then.
+bool extstore_location_valid(struct ExtStore *store,
+                             struct ExtStoreLocation *location);
+
+#endif
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "frequency_sketch.h"
+#include "utils.h"
+
+// Number of hash functions (counters per key) of the sketch.
+#define FREQUENCY_SKETCH_DEPTH 4
+
+// Accesses a thread records before adding them to the count of the sketch, so
+// that threads don't contend on it on every access.
+#define FREQUENCY_SKETCH_ACCESS_BATCH 64
+
+// Odd multipliers that turn the hash of a key into the index of one of its
+// counters, one per hash function.
+static const uint64_t frequency_sketch_seeds[FREQUENCY_SKETCH_DEPTH] = {
+    0x9E3779B97F4A7C15UL, 0xC2B2AE3D27D4EB4FUL, 0x165667B19E3779F9UL,
+    0xD6E8FEB86659FD93UL};
+
+// Accesses recorded by the calling thread that aren't part of the count of the
+// sketch yet.
+static __thread uint64_t pending_accesses = 0;
+
+// Allocates the counters of the given sketch, at least the given number of
+// them.
+void frequency_sketch_initialize(struct FrequencySketch *sketch,
+                                 uint64_t num_counters) {
+  // At least a word, so that halving can go a word at a time.
+  num_counters = next_power_of_two(num_counters < 8 ? 8 : num_counters);
+  sketch->words = calloc(num_counters / 8, sizeof(uint64_t));
+  if (sketch->words == NULL) {
+    perror("frequency_sketch_initialize calloc");
+    abort();
+  }
+  sketch->counter_mask = num_counters - 1;
+  sketch->sample_size = num_counters;
+  sketch->accesses = 0;
+}
+
+// Frees the counters of the given sketch.
+void frequency_sketch_destroy(struct FrequencySketch *sketch) {
+  free(sketch->words);
+}
+
+// Returns the counter of the key with the given hash for the given hash
+// function.
+static uint8_t *frequency_sketch_counter(struct FrequencySketch *sketch,
+                                         uint64_t hash, int function) {
+  // The highest bits of the product are the best mixed ones.
+  uint64_t index = ((hash * frequency_sketch_seeds[function]) >> 32) &
+                   sketch->counter_mask;
+  return (uint8_t *)sketch->words + index;
+}
+
+// Halves every counter of the given sketch. The counters of a word are halved
+// at once, dropping the bit that each one shifts into its neighbour.
+static void frequency_sketch_halve(struct FrequencySketch *sketch) {
+  uint64_t num_words = (sketch->counter_mask + 1) / 8;
+  for (uint64_t i = 0; i < num_words; i++) {
+    uint64_t word = __atomic_load_n(&sketch->words[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&sketch->words[i], (word >> 1) & 0x7F7F7F7F7F7F7F7FUL,
+                     __ATOMIC_RELAXED);
+  }
+}
+
+// Records an access to the key with the given hash.
+void frequency_sketch_increment(struct FrequencySketch *sketch,
+                                uint64_t hash) {
+  for (int function = 0; function < FREQUENCY_SKETCH_DEPTH; function++) {
+    uint8_t *counter = frequency_sketch_counter(sketch, hash, function);
+    uint8_t value = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    if (value < FREQUENCY_SKETCH_MAX) {
+      __atomic_store_n(counter, value + 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  if (++pending_accesses < FREQUENCY_SKETCH_ACCESS_BATCH) {
+    return;
+  }
+  uint64_t accesses = __atomic_add_fetch(&sketch->accesses, pending_accesses,
+                                         __ATOMIC_RELAXED);
+  // Only the thread whose batch reaches the sample size halves the counters.
+  if (accesses >= sketch->sample_size &&
+      accesses - pending_accesses < sketch->sample_size) {
+    frequency_sketch_halve(sketch);
+    __atomic_sub_fetch(&sketch->accesses, sketch->sample_size,
+                       __ATOMIC_RELAXED);
+  }
+  pending_accesses = 0;
+}
+
+// Returns the estimated number of recent accesses to the key with the given
+// hash, up to FREQUENCY_SKETCH_MAX.
+uint8_t frequency_sketch_estimate(struct FrequencySketch *sketch,
+                                  uint64_t hash) {
+  uint8_t estimate = FREQUENCY_SKETCH_MAX;
+  for (int function = 0; function < FREQUENCY_SKETCH_DEPTH; function++) {
+    uint8_t value = __atomic_load_n(
+        frequency_sketch_counter(sketch, hash, function), __ATOMIC_RELAXED);
+    if (value < estimate) {
+      estimate = value;
+    }
+  }
+  return estimate;
+}
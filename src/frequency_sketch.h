@@ -0,0 +1,41 @@
+#ifndef __FREQUENCY_SKETCH_H__
+#define __FREQUENCY_SKETCH_H__
+
+#include <stdint.h>
+
+// Largest frequency a counter of the sketch holds.
+#define FREQUENCY_SKETCH_MAX 15
+
+// Count-min sketch of how often keys are accessed, for the TinyLFU admission
+// policy. Every access increments one counter per hash function, and the
+// estimate is the smallest of them, so collisions can only make keys look
+// more popular than they are. Once the sketch has seen as many accesses as it
+// has counters, every counter is halved, so that keys that were popular a
+// while ago make room for the ones that are popular now.
+// Counters are updated without locks: concurrent increments can get lost,
+// which only makes the estimates a bit lower.
+struct FrequencySketch {
+  uint64_t *words; // Counters of one byte, eight per word.
+  uint64_t counter_mask;
+  uint64_t sample_size; // Accesses between halvings.
+  uint64_t accesses;    // Accesses since the last halving.
+};
+
+// Allocates the counters of the given sketch, at least the given number of
+// them.
+void frequency_sketch_initialize(struct FrequencySketch *sketch,
+                                 uint64_t num_counters);
+
+// Frees the counters of the given sketch.
+void frequency_sketch_destroy(struct FrequencySketch *sketch);
+
+// Records an access to the key with the given hash.
+void frequency_sketch_increment(struct FrequencySketch *sketch,
+                                uint64_t hash);
+
+// Returns the estimated number of recent accesses to the key with the given
+// hash, up to FREQUENCY_SKETCH_MAX.
+uint8_t frequency_sketch_estimate(struct FrequencySketch *sketch,
+                                  uint64_t hash);
+
+#endif
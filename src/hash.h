@@ -0,0 +1,20 @@
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <stdint.h>
+
+// Hash function for the keys of the hash table. There are two implementations
+// of it, selected at build time through the HASH_FUNCTION variable of the
+// Makefile:
+// - hash_wyhash.c: reads the key 8 bytes at a time and mixes them with 64-bit
+//   multiplications that keep the full 128-bit product, in the style of
+//   wyhash.
+// - hash_fnv1a.c: 64-bit FNV-1a, one byte at a time.
+// The bits of the hash are used for different things (the lowest ones pick the
+// segment and the shard of the usage queue, the rest are used by the index), so
+// every bit of it has to be well distributed.
+
+// Returns the 64-bit hash of the given bytes.
+uint64_t hash_bytes(const char *data, uint64_t size);
+
+#endif
@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+// Benchmark for the hash function of the keys. Measures the time it takes to
+// hash keys of 8 to 250 bytes, and checks how well the hashes of a few sets of
+// keys like the ones we store are spread: the lowest bits pick the segment and
+// the shard of the usage queue, the middle ones the position in the index and
+// the highest ones the tag of the Swiss index. Build it with `make bench`,
+// which produces one executable per hash function.
+
+#define MAX_KEY_SIZE 250
+#define KEY_BUFFER_SIZE 64
+
+// Number of buckets of the distribution checks, and bits of the hash per check.
+#define DISTRIBUTION_BITS 16
+#define DISTRIBUTION_BUCKETS (1UL << DISTRIBUTION_BITS)
+
+// Returns the current time in seconds.
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns the next number of the xorshift generator with the given state.
+static uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+// Keeps the compiler from dropping the hashes of the benchmark.
+static volatile uint64_t hash_sink;
+
+// Measures the time it takes to hash the given number of keys of the given
+// size, taken at different offsets of the given buffer so that the compiler
+// can't hoist the hash out of the loop.
+static void bench_key_size(char *buffer, uint64_t key_size,
+                           uint64_t num_hashes) {
+  uint64_t sink = 0;
+  double start = now();
+  for (uint64_t i = 0; i < num_hashes; i++) {
+    sink += hash_bytes(buffer + (i & 63), key_size);
+  }
+  double elapsed = now() - start;
+  hash_sink = sink;
+
+  printf("  %3lu bytes: %6.1f ns/hash %6.2f GB/s\n", key_size,
+         elapsed * 1e9 / num_hashes, key_size * num_hashes / elapsed / 1e9);
+}
+
+// Writes the i-th key of the given key set into the given buffer and returns
+// its size:
+// - uuid: 32 random hexadecimal digits, like the keys of resources/siege.py.
+// - counter: a prefix followed by a sequential number.
+// - binary: the sequential number itself, 8 raw bytes.
+static size_t make_key(char *buffer, const char *key_set, uint64_t i,
+                       uint64_t *state) {
+  if (strcmp(key_set, "uuid") == 0) {
+    return snprintf(buffer, KEY_BUFFER_SIZE, "%016lx%016lx",
+                    next_random(state), next_random(state));
+  }
+  if (strcmp(key_set, "counter") == 0) {
+    return snprintf(buffer, KEY_BUFFER_SIZE, "key:%lu", i);
+  }
+  memcpy(buffer, &i, sizeof(i));
+  return sizeof(i);
+}
+
+// Returns the chi-squared statistic of the given bucket counts divided by its
+// degrees of freedom, which is close to 1.0 when the keys are uniformly spread.
+static double chi_squared_ratio(uint64_t *counts, uint64_t num_keys) {
+  double expected = (double)num_keys / DISTRIBUTION_BUCKETS;
+  double chi_squared = 0;
+  for (uint64_t i = 0; i < DISTRIBUTION_BUCKETS; i++) {
+    double difference = counts[i] - expected;
+    chi_squared += difference * difference / expected;
+  }
+  return chi_squared / (DISTRIBUTION_BUCKETS - 1);
+}
+
+// Compares two hashes for qsort.
+static int compare_hashes(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Hashes the given number of keys of the given key set and prints how evenly
+// the lowest, middle and highest bits of the hashes are spread, and how many
+// keys share the full 64-bit hash of a previous one.
+static void check_key_set(const char *key_set, uint64_t num_keys) {
+  uint64_t *hashes = malloc(sizeof(uint64_t) * num_keys);
+  uint64_t *low = calloc(DISTRIBUTION_BUCKETS, sizeof(uint64_t));
+  uint64_t *middle = calloc(DISTRIBUTION_BUCKETS, sizeof(uint64_t));
+  uint64_t *high = calloc(DISTRIBUTION_BUCKETS, sizeof(uint64_t));
+  if (hashes == NULL || low == NULL || middle == NULL || high == NULL) {
+    perror("check_key_set malloc");
+    abort();
+  }
+
+  char key_buffer[KEY_BUFFER_SIZE];
+  uint64_t state = 88172645463325252UL;
+  for (uint64_t i = 0; i < num_keys; i++) {
+    size_t key_size = make_key(key_buffer, key_set, i, &state);
+    uint64_t hash = hash_bytes(key_buffer, key_size);
+    hashes[i] = hash;
+    low[hash & (DISTRIBUTION_BUCKETS - 1)]++;
+    middle[(hash >> 24) & (DISTRIBUTION_BUCKETS - 1)]++;
+    high[hash >> (64 - DISTRIBUTION_BITS)]++;
+  }
+
+  qsort(hashes, num_keys, sizeof(uint64_t), compare_hashes);
+  uint64_t collisions = 0;
+  for (uint64_t i = 1; i < num_keys; i++) {
+    if (hashes[i] == hashes[i - 1]) {
+      collisions++;
+    }
+  }
+
+  printf("  %-8s chi2/df low %.3f middle %.3f high %.3f, %lu collisions\n",
+         key_set, chi_squared_ratio(low, num_keys),
+         chi_squared_ratio(middle, num_keys), chi_squared_ratio(high, num_keys),
+         collisions);
+
+  free(hashes);
+  free(low);
+  free(middle);
+  free(high);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 3) {
+    fprintf(stderr, "USAGE: %s [NUM_HASHES] [NUM_KEYS]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  uint64_t num_hashes = argc >= 2 ? strtoul(argv[1], NULL, 10) : 10000000;
+  uint64_t num_keys = argc == 3 ? strtoul(argv[2], NULL, 10) : 1000000;
+
+  char buffer[MAX_KEY_SIZE + 64];
+  uint64_t state = 88172645463325252UL;
+  for (size_t i = 0; i < sizeof(buffer); i++) {
+    buffer[i] = (char)next_random(&state);
+  }
+
+  printf("%s: %lu hashes per key size\n", argv[0], num_hashes);
+  uint64_t key_sizes[] = {8, 16, 32, 64, 128, MAX_KEY_SIZE};
+  for (size_t i = 0; i < sizeof(key_sizes) / sizeof(key_sizes[0]); i++) {
+    bench_key_size(buffer, key_sizes[i], num_hashes);
+  }
+
+  printf("%s: %lu keys per key set\n", argv[0], num_keys);
+  check_key_set("uuid", num_keys);
+  check_key_set("counter", num_keys);
+  check_key_set("binary", num_keys);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,15 @@
+#include "hash.h"
+
+#define FNV_OFFSET 14695981039346656037UL
+#define FNV_PRIME 1099511628211UL
+
+// Returns the 64-bit FNV-1a hash of the given bytes.
+// More information: https://en.wikipedia.org/wiki/Fowler–Noll–Vo_hash_function
+uint64_t hash_bytes(const char *data, uint64_t size) {
+  uint64_t hash = FNV_OFFSET;
+  for (uint64_t i = 0; i < size; i++) {
+    hash ^= (uint64_t)(unsigned char)data[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
@@ -0,0 +1,77 @@
+#ifndef __HASH_INDEX_H__
+#define __HASH_INDEX_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bounded_data.h"
+
+struct Item;
+struct HashTable;
+
+// Index that maps keys to the items of a hash table segment. There are
+// two implementations of it, selected at build time through the HASH_INDEX
+// variable of the Makefile:
+// - hash_index_chained.c: an array of buckets with a linked list of items in
+//   each one (separate chaining).
+// - hash_index_swiss.c: open addressing with a byte of metadata per slot that
+//   is probed 16 slots at a time with SSE2 (Swiss tables).
+// The index is not synchronized, the caller must hold the segment mutex. The
+// only exception is hash_index_find, which may run while a writer modifies the
+// index as long as removed items and replaced indexes are freed through
+// epoch_retire: it never reads freed memory, but it might miss keys that are
+// being moved or removed. The given hashes must be the same for the same keys,
+// and every bit of them is used by the index. They are the hashes cached in the
+// items without the bits that picked the segment (see
+// hashtable_get_index_hash), so the index compares them with the cached hash of
+// an item before comparing its key.
+struct HashIndex;
+
+// Allocates an empty index with room for at least the given number of keys.
+// Returns NULL if there is not enough memory.
+struct HashIndex *hash_index_create(struct HashTable *hashtable,
+                                    uint64_t capacity);
+
+// De-allocates the memory of the index, but not the memory of the items in it.
+void hash_index_destroy(struct HashIndex *index);
+
+// Returns the item that holds the given key or NULL if the key is not in the
+// index.
+struct Item *hash_index_find(struct HashIndex *index, struct BoundedData *key,
+                             uint64_t hash);
+
+// Adds the given item to the index. Assumes that the key of the item is not
+// already in the index.
+void hash_index_insert(struct HashIndex *index, struct Item *item,
+                       uint64_t hash);
+
+// Removes the given item from the index. Returns true if the item was in the
+// index, false otherwise.
+bool hash_index_remove(struct HashIndex *index, struct Item *item,
+                       uint64_t hash);
+
+// Puts the given new item in place of the given old one, which must have the
+// same key. Lookups see either of them, never neither. Returns true if the old
+// item was in the index, false otherwise.
+bool hash_index_replace(struct HashIndex *index, struct Item *old_item,
+                        struct Item *new_item, uint64_t hash);
+
+// Returns the number of positions (buckets or groups of slots) of the index,
+// which are the units in which the index is migrated when it grows.
+uint64_t hash_index_num_positions(struct HashIndex *index);
+
+// Removes and returns one of the items stored at the given position of the
+// index, or NULL if there are no items left there.
+struct Item *hash_index_pop(struct HashIndex *index, uint64_t position);
+
+// Returns the capacity that the index should be rebuilt with because it's too
+// loaded, or 0 if the index doesn't need to be rebuilt.
+uint64_t hash_index_resize_capacity(struct HashIndex *index);
+
+// Calls the given function for every item in the index. The function may free
+// the item, but it must not modify the index.
+void hash_index_visit(struct HashIndex *index,
+                      void (*visitor)(struct Item *item, void *arg),
+                      void *arg);
+
+#endif
@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hash_index.h"
+#include "hashtable.h"
+#include "item.h"
+#include "parameters.h"
+
+// The buckets and the next fields of the items hold links to items instead of
+// plain pointers. A link is the address of the item with a 16-bit fingerprint
+// of its hash in the highest bits, which user space addresses don't use, and a
+// flag in the lowest bit, which is always 0 in the 8-byte aligned addresses of
+// the items, that tells whether the item is the last of its bucket. Lookups
+// only compare the keys of the items whose fingerprint matches, and a lookup
+// that misses in a bucket with a single item never reads the item at all.
+// This assumes that user space addresses fit in 48 bits, as they do on x86-64
+// and AArch64 Linux: with 5-level paging, addresses above that are only handed
+// out to mmap calls that ask for them, and the items live in the memory of the
+// slab allocator. Platforms that tag the top bits of pointers break it, so
+// link_create checks every address it's given.
+#define LINK_FINGERPRINT_SHIFT 48
+#define LINK_LAST 1UL
+#define LINK_ADDRESS_MASK (((1UL << LINK_FINGERPRINT_SHIFT) - 1) & ~LINK_LAST)
+
+struct HashIndex {
+  uint64_t num_buckets; // Always a power of two.
+  uint64_t num_keys;
+  uintptr_t *buckets; // Link to the first item of each bucket, 0 if empty.
+};
+
+// Returns the fingerprint of the given hash. The lowest bits of the hash pick
+// the bucket, so the fingerprint is taken from higher ones.
+static uintptr_t hash_fingerprint(uint64_t hash) {
+  return (hash >> 32) & 0xFFFF;
+}
+
+// Returns a link to the given item, which has the given hash and is the last
+// of its bucket if `last` is true. Aborts if the address of the item doesn't
+// leave room for the fingerprint.
+static uintptr_t link_create(struct Item *item, uint64_t hash, bool last) {
+  if ((uintptr_t)item >> LINK_FINGERPRINT_SHIFT != 0) {
+    fprintf(stderr, "link_create: the address %p uses the bits of the "
+                    "fingerprint\n",
+            (void *)item);
+    abort();
+  }
+  return (uintptr_t)item | (hash_fingerprint(hash) << LINK_FINGERPRINT_SHIFT) |
+         (last ? LINK_LAST : 0);
+}
+
+// Returns the item the given link points to, NULL for an empty link.
+static struct Item *link_item(uintptr_t link) {
+  return (struct Item *)(link & LINK_ADDRESS_MASK);
+}
+
+// Returns the fingerprint of the item the given link points to.
+static uintptr_t link_fingerprint(uintptr_t link) {
+  return link >> LINK_FINGERPRINT_SHIFT;
+}
+
+// True if the item the given link points to is the last of its bucket.
+static bool link_is_last(uintptr_t link) { return (link & LINK_LAST) != 0; }
+
+// Returns the bucket of the index for the given hash.
+static uintptr_t *hash_index_bucket(struct HashIndex *index, uint64_t hash) {
+  return &index->buckets[hash & (index->num_buckets - 1)];
+}
+
+// Allocates an empty index with room for at least the given number of keys.
+// Returns NULL if there is not enough memory.
+struct HashIndex *hash_index_create(struct HashTable *hashtable,
+                                    uint64_t capacity) {
+  uint64_t num_buckets = 1;
+  while (num_buckets * HASH_TABLE_MAX_LOAD_FACTOR < capacity) {
+    num_buckets <<= 1;
+  }
+
+  struct HashIndex *index =
+      hashtable_malloc_evict(hashtable, sizeof(struct HashIndex));
+  if (index == NULL) {
+    return NULL;
+  }
+  index->buckets = hashtable_malloc_evict(
+      hashtable, sizeof(uintptr_t) * num_buckets);
+  if (index->buckets == NULL) {
+    free(index);
+    return NULL;
+  }
+  for (uint64_t i = 0; i < num_buckets; i++) {
+    index->buckets[i] = 0;
+  }
+  index->num_buckets = num_buckets;
+  index->num_keys = 0;
+
+  return index;
+}
+
+// De-allocates the memory of the index, but not the memory of the items in it.
+void hash_index_destroy(struct HashIndex *index) {
+  free(index->buckets);
+  free(index);
+}
+
+// Returns the item that holds the given key or NULL if the key is not in the
+// index.
+struct Item *hash_index_find(struct HashIndex *index, struct BoundedData *key,
+                             uint64_t hash) {
+  uintptr_t fingerprint = hash_fingerprint(hash);
+  uintptr_t link =
+      __atomic_load_n(hash_index_bucket(index, hash), __ATOMIC_ACQUIRE);
+  while (link != 0) {
+    struct Item *current_item = link_item(link);
+    if (link_fingerprint(link) == fingerprint &&
+        item_key_equals(current_item, key)) {
+      return current_item;
+    }
+    if (link_is_last(link)) {
+      return NULL;
+    }
+    link = __atomic_load_n(&current_item->next, __ATOMIC_ACQUIRE);
+  }
+  return NULL;
+}
+
+// Adds the given item to the index. Assumes that the key of the item is not
+// already in the index.
+void hash_index_insert(struct HashIndex *index, struct Item *item,
+                       uint64_t hash) {
+  uintptr_t *bucket = hash_index_bucket(index, hash);
+  item->next = *bucket;
+  __atomic_store_n(bucket, link_create(item, hash, item->next == 0),
+                   __ATOMIC_RELEASE);
+  index->num_keys++;
+}
+
+// Removes the given item from the index. Returns true if the item was in the
+// index, false otherwise.
+bool hash_index_remove(struct HashIndex *index, struct Item *item,
+                       uint64_t hash) {
+  uintptr_t *previous_link = NULL; // Link to the item before the current one.
+  uintptr_t *link = hash_index_bucket(index, hash);
+  while (*link != 0) {
+    if (link_item(*link) == item) {
+      // The next link of the item is kept so that lookups that are looking at
+      // it can go on.
+      __atomic_store_n(link, item->next, __ATOMIC_RELEASE);
+      if (item->next == 0 && previous_link != NULL) {
+        // The item before it is now the last one of the bucket.
+        __atomic_store_n(previous_link, *previous_link | LINK_LAST,
+                         __ATOMIC_RELEASE);
+      }
+      index->num_keys--;
+      return true;
+    }
+    previous_link = link;
+    link = &link_item(*link)->next;
+  }
+  return false;
+}
+
+// Puts the given new item in place of the given old one, which must have the
+// same key. Lookups see either of them, never neither. Returns true if the old
+// item was in the index, false otherwise.
+bool hash_index_replace(struct HashIndex *index, struct Item *old_item,
+                        struct Item *new_item, uint64_t hash) {
+  uintptr_t *link = hash_index_bucket(index, hash);
+  while (*link != 0) {
+    if (link_item(*link) == old_item) {
+      // As with removals, the next link of the old item is kept so that
+      // lookups that are looking at it can go on. Both items have the same
+      // fingerprint and position in the bucket.
+      new_item->next = old_item->next;
+      __atomic_store_n(link, link_create(new_item, hash, link_is_last(*link)),
+                       __ATOMIC_RELEASE);
+      return true;
+    }
+    link = &link_item(*link)->next;
+  }
+  return false;
+}
+
+// Returns the number of positions (buckets or groups of slots) of the index,
+// which are the units in which the index is migrated when it grows.
+uint64_t hash_index_num_positions(struct HashIndex *index) {
+  return index->num_buckets;
+}
+
+// Removes and returns one of the items stored at the given position of the
+// index, or NULL if there are no items left there.
+struct Item *hash_index_pop(struct HashIndex *index, uint64_t position) {
+  struct Item *item = link_item(index->buckets[position]);
+  if (item != NULL) {
+    __atomic_store_n(&index->buckets[position], item->next, __ATOMIC_RELEASE);
+    index->num_keys--;
+  }
+  return item;
+}
+
+// Returns the capacity that the index should be rebuilt with because it's too
+// loaded, or 0 if the index doesn't need to be rebuilt.
+uint64_t hash_index_resize_capacity(struct HashIndex *index) {
+  if (index->num_keys <= index->num_buckets * HASH_TABLE_MAX_LOAD_FACTOR) {
+    return 0;
+  }
+  return index->num_buckets * 2 * HASH_TABLE_MAX_LOAD_FACTOR;
+}
+
+// Calls the given function for every item in the index. The function may free
+// the item, but it must not modify the index.
+void hash_index_visit(struct HashIndex *index,
+                      void (*visitor)(struct Item *item, void *arg),
+                      void *arg) {
+  for (uint64_t i = 0; i < index->num_buckets; i++) {
+    struct Item *current_item = link_item(index->buckets[i]);
+    while (current_item != NULL) {
+      // Fetch the next item first, the visitor might free the current one.
+      struct Item *next_item = link_item(current_item->next);
+      visitor(current_item, arg);
+      current_item = next_item;
+    }
+  }
+}
@@ -0,0 +1,306 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "hash_index.h"
+#include "hashtable.h"
+#include "item.h"
+
+// Number of slots probed at once. Each group of slots has its metadata bytes in
+// a single 16-byte vector.
+#define GROUP_SIZE 16
+
+// Values of the metadata byte of a slot. A full slot holds the 7-bit tag of the
+// hash of its key, so its metadata byte never has the highest bit set.
+#define CONTROL_EMPTY ((int8_t)-128)
+#define CONTROL_DELETED ((int8_t)-2)
+
+// Keep the load of the index (including deleted slots) under 7/8.
+#define MAX_LOAD_NUMERATOR 7
+#define MAX_LOAD_DENOMINATOR 8
+
+struct HashIndex {
+  uint64_t num_groups;      // Always a power of two.
+  uint64_t num_keys;        // Slots holding an item.
+  uint64_t num_deleted;     // Slots with a CONTROL_DELETED marker.
+  uint64_t hash_shift;      // Bits of the hash of an item that picked the
+                            // segment.
+  int8_t *control;          // One metadata byte per slot.
+  struct Item **slots;      // One item per slot.
+  void *control_allocation; // Unaligned pointer to free `control`.
+};
+
+// Returns the 7-bit tag of the given hash that is stored in the metadata.
+static int8_t hash_tag(uint64_t hash) { return (int8_t)(hash & 0x7F); }
+
+// Returns the group where probing starts for the given hash.
+static uint64_t hash_group(struct HashIndex *index, uint64_t hash) {
+  return (hash >> 7) & (index->num_groups - 1);
+}
+
+// Returns a bit mask with the bit i set if the i-th metadata byte of the group
+// that starts at the given pointer is equal to the given value.
+static uint32_t group_match(int8_t *group, int8_t value) {
+#ifdef __SSE2__
+  __m128i control = _mm_load_si128((__m128i *)group);
+  __m128i match = _mm_cmpeq_epi8(control, _mm_set1_epi8(value));
+  return (uint32_t)_mm_movemask_epi8(match);
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP_SIZE; i++) {
+    if (group[i] == value) {
+      mask |= 1U << i;
+    }
+  }
+  return mask;
+#endif
+}
+
+// Returns a bit mask with the bit i set if the i-th slot of the group that
+// starts at the given pointer is either empty or deleted.
+static uint32_t group_match_available(int8_t *group) {
+#ifdef __SSE2__
+  // Both CONTROL_EMPTY and CONTROL_DELETED have the highest bit set.
+  __m128i control = _mm_load_si128((__m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(control);
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < GROUP_SIZE; i++) {
+    if (group[i] < 0) {
+      mask |= 1U << i;
+    }
+  }
+  return mask;
+#endif
+}
+
+// Allocates an empty index with room for at least the given number of keys.
+// Returns NULL if there is not enough memory.
+struct HashIndex *hash_index_create(struct HashTable *hashtable,
+                                    uint64_t capacity) {
+  uint64_t num_groups = 1;
+  while (num_groups * GROUP_SIZE * MAX_LOAD_NUMERATOR <
+         capacity * MAX_LOAD_DENOMINATOR) {
+    num_groups <<= 1;
+  }
+  uint64_t num_slots = num_groups * GROUP_SIZE;
+
+  struct HashIndex *index =
+      hashtable_malloc_evict(hashtable, sizeof(struct HashIndex));
+  if (index == NULL) {
+    return NULL;
+  }
+
+  // The metadata bytes of each group are loaded with aligned SSE2 loads, so
+  // allocate extra room to align the array to the group size.
+  index->control_allocation =
+      hashtable_malloc_evict(hashtable, num_slots + GROUP_SIZE);
+  if (index->control_allocation == NULL) {
+    free(index);
+    return NULL;
+  }
+  uintptr_t control_address = (uintptr_t)index->control_allocation;
+  control_address = (control_address + GROUP_SIZE - 1) &
+                    ~(uintptr_t)(GROUP_SIZE - 1);
+  index->control = (int8_t *)control_address;
+  memset(index->control, CONTROL_EMPTY, num_slots);
+
+  index->slots = hashtable_malloc_evict(
+      hashtable, sizeof(struct Item *) * num_slots);
+  if (index->slots == NULL) {
+    free(index->control_allocation);
+    free(index);
+    return NULL;
+  }
+
+  index->num_groups = num_groups;
+  index->num_keys = 0;
+  index->num_deleted = 0;
+  index->hash_shift = hashtable->segment_bits;
+
+  return index;
+}
+
+// De-allocates the memory of the index, but not the memory of the items in it.
+void hash_index_destroy(struct HashIndex *index) {
+  free(index->slots);
+  free(index->control_allocation);
+  free(index);
+}
+
+// Returns the slot that holds the item with the given key (when `item` is
+// NULL) or the given item (when `item` is not NULL), or -1 if there's no such
+// slot. The item found in the slot is stored in `found`, since lock-free
+// lookups can't read the slot again.
+static int64_t hash_index_find_slot(struct HashIndex *index,
+                                    struct BoundedData *key,
+                                    struct Item *item, uint64_t hash,
+                                    struct Item **found) {
+  int8_t tag = hash_tag(hash);
+  uint64_t group = hash_group(index, hash);
+
+  // Triangular probing visits every group once when the number of groups is
+  // a power of two.
+  for (uint64_t probe = 1; probe <= index->num_groups; probe++) {
+    int8_t *control = index->control + group * GROUP_SIZE;
+
+    // Only compare the keys of the slots whose tag matches.
+    uint32_t matches = group_match(control, tag);
+    while (matches != 0) {
+      uint64_t slot = group * GROUP_SIZE + __builtin_ctz(matches);
+      struct Item *candidate =
+          __atomic_load_n(&index->slots[slot], __ATOMIC_ACQUIRE);
+      // Lock-free lookups might see the tag of a slot that is being cleared.
+      // The tag only has 7 bits of the hash, so compare the whole hash cached
+      // in the item before comparing the key.
+      if (candidate != NULL &&
+          (item != NULL ? candidate == item
+                        : (candidate->hash >> index->hash_shift) == hash &&
+                              item_key_equals(candidate, key))) {
+        *found = candidate;
+        return slot;
+      }
+      matches &= matches - 1;
+    }
+
+    // An empty slot in the group means that the probe sequence of the key
+    // never went further.
+    if (group_match(control, CONTROL_EMPTY) != 0) {
+      return -1;
+    }
+
+    group = (group + probe) & (index->num_groups - 1);
+  }
+
+  return -1;
+}
+
+// Returns the item that holds the given key or NULL if the key is not in the
+// index.
+struct Item *hash_index_find(struct HashIndex *index, struct BoundedData *key,
+                             uint64_t hash) {
+  struct Item *found = NULL;
+  hash_index_find_slot(index, key, NULL, hash, &found);
+  return found;
+}
+
+// Adds the given item to the index. Assumes that the key of the item is not
+// already in the index.
+void hash_index_insert(struct HashIndex *index, struct Item *item,
+                       uint64_t hash) {
+  uint64_t group = hash_group(index, hash);
+
+  // The load of the index is kept under 7/8, so there's always an available
+  // slot in the probe sequence.
+  for (uint64_t probe = 1;; probe++) {
+    int8_t *control = index->control + group * GROUP_SIZE;
+    uint32_t available = group_match_available(control);
+    if (available != 0) {
+      uint64_t slot = group * GROUP_SIZE + __builtin_ctz(available);
+      if (index->control[slot] == CONTROL_DELETED) {
+        index->num_deleted--;
+      }
+      // Publish the item before its tag, lock-free lookups go the other way.
+      __atomic_store_n(&index->slots[slot], item, __ATOMIC_RELEASE);
+      __atomic_store_n(&index->control[slot], hash_tag(hash), __ATOMIC_RELEASE);
+      index->num_keys++;
+      return;
+    }
+    group = (group + probe) & (index->num_groups - 1);
+  }
+}
+
+// Marks the given slot as available. If its group still has an empty slot, no
+// probe sequence goes through it, so the slot can be marked as empty instead of
+// deleted.
+static void hash_index_clear_slot(struct HashIndex *index, uint64_t slot) {
+  int8_t *control = index->control + (slot / GROUP_SIZE) * GROUP_SIZE;
+  if (group_match(control, CONTROL_EMPTY) != 0) {
+    index->control[slot] = CONTROL_EMPTY;
+  } else {
+    index->control[slot] = CONTROL_DELETED;
+    index->num_deleted++;
+  }
+  __atomic_store_n(&index->slots[slot], NULL, __ATOMIC_RELEASE);
+  index->num_keys--;
+}
+
+// Removes the given item from the index. Returns true if the item was in the
+// index, false otherwise.
+bool hash_index_remove(struct HashIndex *index, struct Item *item,
+                       uint64_t hash) {
+  struct Item *found;
+  int64_t slot = hash_index_find_slot(index, NULL, item, hash, &found);
+  if (slot == -1) {
+    return false;
+  }
+  hash_index_clear_slot(index, slot);
+  return true;
+}
+
+// Puts the given new item in place of the given old one, which must have the
+// same key. Lookups see either of them, never neither. Returns true if the old
+// item was in the index, false otherwise.
+bool hash_index_replace(struct HashIndex *index, struct Item *old_item,
+                        struct Item *new_item, uint64_t hash) {
+  struct Item *found;
+  int64_t slot = hash_index_find_slot(index, NULL, old_item, hash, &found);
+  if (slot == -1) {
+    return false;
+  }
+  // Both items have the same key, so the tag of the slot stays the same.
+  __atomic_store_n(&index->slots[slot], new_item, __ATOMIC_RELEASE);
+  return true;
+}
+
+// Returns the number of positions (buckets or groups of slots) of the index,
+// which are the units in which the index is migrated when it grows.
+uint64_t hash_index_num_positions(struct HashIndex *index) {
+  return index->num_groups;
+}
+
+// Removes and returns one of the items stored at the given position of the
+// index, or NULL if there are no items left there.
+struct Item *hash_index_pop(struct HashIndex *index, uint64_t position) {
+  int8_t *control = index->control + position * GROUP_SIZE;
+  uint32_t full = ~group_match_available(control) & 0xFFFF;
+  if (full == 0) {
+    return NULL;
+  }
+  uint64_t slot = position * GROUP_SIZE + __builtin_ctz(full);
+  struct Item *item = index->slots[slot];
+  hash_index_clear_slot(index, slot);
+  return item;
+}
+
+// Returns the capacity that the index should be rebuilt with because it's too
+// loaded, or 0 if the index doesn't need to be rebuilt.
+uint64_t hash_index_resize_capacity(struct HashIndex *index) {
+  uint64_t num_slots = index->num_groups * GROUP_SIZE;
+  if ((index->num_keys + index->num_deleted) * MAX_LOAD_DENOMINATOR <
+      num_slots * MAX_LOAD_NUMERATOR) {
+    return 0;
+  }
+  // When most of the load comes from deleted slots, rebuilding the index with
+  // the same size is enough to get rid of them.
+  if (index->num_keys * 2 < num_slots) {
+    return num_slots * MAX_LOAD_NUMERATOR / MAX_LOAD_DENOMINATOR;
+  }
+  return num_slots * 2 * MAX_LOAD_NUMERATOR / MAX_LOAD_DENOMINATOR;
+}
+
+// Calls the given function for every item in the index. The function may free
+// the item, but it must not modify the index.
+void hash_index_visit(struct HashIndex *index,
+                      void (*visitor)(struct Item *item, void *arg),
+                      void *arg) {
+  uint64_t num_slots = index->num_groups * GROUP_SIZE;
+  for (uint64_t slot = 0; slot < num_slots; slot++) {
+    if (index->control[slot] >= 0) {
+      visitor(index->slots[slot], arg);
+    }
+  }
+}
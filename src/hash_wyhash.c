@@ -0,0 +1,103 @@
+#include <string.h>
+
+#include "hash.h"
+
+// 128-bit integers are a GCC extension.
+__extension__ typedef unsigned __int128 uint128_t;
+
+// Seed and secret constants of wyhash.
+#define WYHASH_SEED 0xa0761d6478bd642fUL
+static const uint64_t wyhash_secret[4] = {
+    0x2d358dccaa6c78a5UL, 0x8bb84b93962eacc9UL, 0x4b33a62ed433d4a3UL,
+    0x4d5a2da51de1aa47UL};
+
+// Multiplies the given numbers, leaving the low half of the 128-bit product in
+// `a` and the high half in `b`.
+static inline void wyhash_multiply(uint64_t *a, uint64_t *b) {
+  uint128_t product = (uint128_t)*a * *b;
+  *a = (uint64_t)product;
+  *b = (uint64_t)(product >> 64);
+}
+
+// Mixes the given numbers into one by folding their 128-bit product.
+static inline uint64_t wyhash_mix(uint64_t a, uint64_t b) {
+  wyhash_multiply(&a, &b);
+  return a ^ b;
+}
+
+// Reads 8 bytes, which might not be aligned. The compiler turns the memcpy
+// into a single load.
+static inline uint64_t wyhash_read8(const unsigned char *p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+// Reads 4 bytes, which might not be aligned.
+static inline uint64_t wyhash_read4(const unsigned char *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+// Reads the first, middle and last bytes of a key of 1 to 3 bytes.
+static inline uint64_t wyhash_read3(const unsigned char *p, uint64_t size) {
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[size >> 1] << 8) | p[size - 1];
+}
+
+// Returns the 64-bit hash of the given bytes. Keys of up to 16 bytes are read
+// with at most four (overlapping) loads, longer ones 16 or 48 bytes per round
+// with one multiplication per 16 bytes, and the last 16 bytes (which might
+// overlap with the last round) are always mixed in.
+uint64_t hash_bytes(const char *data, uint64_t size) {
+  const unsigned char *p = (const unsigned char *)data;
+  uint64_t seed = WYHASH_SEED ^ wyhash_mix(WYHASH_SEED ^ wyhash_secret[0],
+                                          wyhash_secret[1]);
+  uint64_t a, b;
+
+  if (size <= 16) {
+    if (size >= 4) {
+      uint64_t middle = (size >> 3) << 2;
+      a = (wyhash_read4(p) << 32) | wyhash_read4(p + middle);
+      b = (wyhash_read4(p + size - 4) << 32) |
+          wyhash_read4(p + size - 4 - middle);
+    } else if (size > 0) {
+      a = wyhash_read3(p, size);
+      b = 0;
+    } else {
+      a = 0;
+      b = 0;
+    }
+  } else {
+    uint64_t remaining = size;
+    if (remaining > 48) {
+      // Three independent lanes, so that the multiplications overlap.
+      uint64_t seed1 = seed;
+      uint64_t seed2 = seed;
+      do {
+        seed = wyhash_mix(wyhash_read8(p) ^ wyhash_secret[1],
+                          wyhash_read8(p + 8) ^ seed);
+        seed1 = wyhash_mix(wyhash_read8(p + 16) ^ wyhash_secret[2],
+                           wyhash_read8(p + 24) ^ seed1);
+        seed2 = wyhash_mix(wyhash_read8(p + 32) ^ wyhash_secret[3],
+                           wyhash_read8(p + 40) ^ seed2);
+        p += 48;
+        remaining -= 48;
+      } while (remaining > 48);
+      seed ^= seed1 ^ seed2;
+    }
+    while (remaining > 16) {
+      seed = wyhash_mix(wyhash_read8(p) ^ wyhash_secret[1],
+                        wyhash_read8(p + 8) ^ seed);
+      p += 16;
+      remaining -= 16;
+    }
+    a = wyhash_read8(p + remaining - 16);
+    b = wyhash_read8(p + remaining - 8);
+  }
+
+  a ^= wyhash_secret[1];
+  b ^= seed;
+  wyhash_multiply(&a, &b);
+  return wyhash_mix(a ^ wyhash_secret[0] ^ size, b ^ wyhash_secret[1]);
+}
@@ -1,52 +1,170 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "epoch.h"
+#include "hash_index.h"
 #include "hashtable.h"
 #include "parameters.h"
+#include "slab.h"
+#include "timer_wheel.h"
+#include "utils.h"
 
-// Acquires the mutex of the given bucket of the hash table.
-static void hashtable_bucket_acquire(struct HashTable *hashtable,
-                                     uint64_t bucket_index) {
-  pthread_mutex_lock(hashtable->bucket_mutexes + bucket_index);
+// Acquires the mutex of the given segment of the hash table.
+static void hashtable_segment_acquire(struct HashTableSegment *segment) {
+  pthread_mutex_lock(&segment->mutex);
 }
 
-// Tries to acquire the mutex of the given bucket of the hash table. Returns
+// Tries to acquire the mutex of the given segment of the hash table. Returns
 // true if successfully acquires the mutex, false otherwise.
-static bool hashtable_bucket_try_acquire(struct HashTable *hashtable,
-                                         uint64_t bucket_index) {
-  return pthread_mutex_trylock(hashtable->bucket_mutexes + bucket_index) == 0;
+static bool hashtable_segment_try_acquire(struct HashTableSegment *segment) {
+  return pthread_mutex_trylock(&segment->mutex) == 0;
 }
 
-// Releases the mutex of the given bucket of the hash table.
-static void hashtable_bucket_release(struct HashTable *hashtable,
-                                     uint64_t bucket_index) {
-  pthread_mutex_unlock(hashtable->bucket_mutexes + bucket_index);
+// Releases the mutex of the given segment of the hash table.
+static void hashtable_segment_release(struct HashTableSegment *segment) {
+  pthread_mutex_unlock(&segment->mutex);
 }
 
-// Acquires the mutex of the key count of the hash table.
-static void hashtable_key_count_acquire(struct HashTable *hashtable) {
-  pthread_mutex_lock(hashtable->key_count_mutex);
+// Marks the start of a modification of the given segment that might make
+// lock-free lookups miss keys that are in it. Assumes that the segment mutex is
+// acquired.
+static void hashtable_segment_write_begin(struct HashTableSegment *segment) {
+  __atomic_store_n(&segment->sequence, segment->sequence + 1,
+                   __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
 }
 
-// Releases the mutex of the key count of the hash table.
-static void hashtable_key_count_release(struct HashTable *hashtable) {
-  pthread_mutex_unlock(hashtable->key_count_mutex);
+// Marks the end of a modification of the given segment started with
+// hashtable_segment_write_begin.
+static void hashtable_segment_write_end(struct HashTableSegment *segment) {
+  __atomic_store_n(&segment->sequence, segment->sequence + 1,
+                   __ATOMIC_RELEASE);
 }
 
-// Acquires the mutex of the usage queue of the hash table.
-static void hashtable_usage_acquire(struct HashTable *hashtable) {
-  pthread_mutex_lock(hashtable->usage_mutex);
+// Returns the sequence number of the given segment before a lock-free lookup.
+static uint64_t hashtable_segment_read_begin(struct HashTableSegment *segment) {
+  return __atomic_load_n(&segment->sequence, __ATOMIC_ACQUIRE);
 }
 
-// Releases the mutex of the usage queue of the hash table.
-static void hashtable_usage_release(struct HashTable *hashtable) {
-  pthread_mutex_unlock(hashtable->usage_mutex);
+// Returns true if no writer moved or removed nodes of the given segment since
+// hashtable_segment_read_begin returned the given sequence number.
+static bool hashtable_segment_read_validate(struct HashTableSegment *segment,
+                                            uint64_t sequence) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return (sequence & 1) == 0 &&
+         __atomic_load_n(&segment->sequence, __ATOMIC_RELAXED) == sequence;
 }
 
-// Allocates memory for a hash table (including all its buckets, the mutex and
-// the usage queue) and stores the callback for the hash function.
-struct HashTable *hashtable_create(uint64_t num_buckets) {
+// Number of threads that took a slot of the counters of the hash tables, and
+// slot of the calling thread plus one (zero until it takes one).
+static uint64_t num_counter_threads = 0;
+static __thread uint64_t counter_thread_slot = 0;
+
+// Returns the counters of the hash table updated by the calling thread. Threads
+// take a slot on their first update, and share it with other threads only if
+// there are more threads than slots.
+static struct HashTableCounters *
+hashtable_thread_counters(struct HashTable *hashtable) {
+  if (counter_thread_slot == 0) {
+    counter_thread_slot =
+        __atomic_fetch_add(&num_counter_threads, 1, __ATOMIC_RELAXED) + 1;
+  }
+  return &hashtable->counters[(counter_thread_slot - 1) &
+                              (hashtable->num_counters - 1)];
+}
+
+// Returns the number of slots of the counters of the hash table that have been
+// taken by some thread, which are the only ones worth adding up.
+static uint64_t hashtable_num_used_counters(struct HashTable *hashtable) {
+  uint64_t num_threads =
+      __atomic_load_n(&num_counter_threads, __ATOMIC_RELAXED);
+  return num_threads < hashtable->num_counters ? num_threads
+                                               : hashtable->num_counters;
+}
+
+// Adds the given number of keys (which might be negative) to the counters of
+// the calling thread.
+static void hashtable_key_count_add(struct HashTable *hashtable,
+                                    int64_t keys) {
+  struct HashTableCounters *counters = hashtable_thread_counters(hashtable);
+  __atomic_add_fetch(&counters->key_count, keys, __ATOMIC_RELAXED);
+}
+
+// Adds an expired key to the counters of the calling thread.
+static void hashtable_expired_count_add(struct HashTable *hashtable) {
+  struct HashTableCounters *counters = hashtable_thread_counters(hashtable);
+  __atomic_add_fetch(&counters->expired_count, 1, __ATOMIC_RELAXED);
+}
+
+// Adds an evicted key to the counters of the calling thread, either as a
+// background eviction or as a foreground one.
+static void hashtable_eviction_count_add(struct HashTable *hashtable,
+                                         bool background) {
+  struct HashTableCounters *counters = hashtable_thread_counters(hashtable);
+  __atomic_add_fetch(background ? &counters->background_evictions
+                                : &counters->foreground_evictions,
+                     1, __ATOMIC_RELAXED);
+}
+
+// Adds a key whose value went to the extension store to the counters of the
+// calling thread.
+static void hashtable_spilled_count_add(struct HashTable *hashtable) {
+  struct HashTableCounters *counters = hashtable_thread_counters(hashtable);
+  __atomic_add_fetch(&counters->spilled_count, 1, __ATOMIC_RELAXED);
+}
+
+// Adds the given number of bytes (which might be negative) to the memory taken
+// by the items of the hash table. The bytes pile up in the counters of the
+// calling thread, and are only moved to the shared total of the table once
+// they reach HASH_TABLE_COUNTER_FLUSH_BYTES either way.
+static void hashtable_stored_bytes_add(struct HashTable *hashtable,
+                                       int64_t bytes) {
+  struct HashTableCounters *counters = hashtable_thread_counters(hashtable);
+  int64_t pending =
+      __atomic_add_fetch(&counters->pending_bytes, bytes, __ATOMIC_RELAXED);
+  if (pending >= (int64_t)HASH_TABLE_COUNTER_FLUSH_BYTES ||
+      pending <= -(int64_t)HASH_TABLE_COUNTER_FLUSH_BYTES) {
+    pending = __atomic_exchange_n(&counters->pending_bytes, 0,
+                                  __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hashtable->stored_bytes, pending, __ATOMIC_RELAXED);
+  }
+}
+
+// Returns an estimate of the memory taken by the items of the hash table that
+// is cheap enough for every insertion: the shared total plus the bytes pending
+// in the counters of the calling thread, so that its own evictions count right
+// away. It's off by less than HASH_TABLE_COUNTER_FLUSH_BYTES per thread.
+static uint64_t hashtable_stored_bytes_estimate(struct HashTable *hashtable) {
+  struct HashTableCounters *counters = hashtable_thread_counters(hashtable);
+  int64_t bytes =
+      __atomic_load_n(&hashtable->stored_bytes, __ATOMIC_RELAXED) +
+      __atomic_load_n(&counters->pending_bytes, __ATOMIC_RELAXED);
+  return bytes > 0 ? bytes : 0;
+}
+
+// Acquires the mutex of the given shard of the usage queue.
+static void hashtable_usage_acquire(struct UsageShard *shard) {
+  pthread_mutex_lock(&shard->mutex);
+}
+
+// Releases the mutex of the given shard of the usage queue.
+static void hashtable_usage_release(struct UsageShard *shard) {
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+// Allocates memory for a hash table (including its segments, the mutexes and
+// the usage queue shards). The given capacity is the number of keys the table
+// can hold before it starts growing, which it does on its own as keys are
+// inserted. The items stored in the table can take up to the given memory
+// budget, in bytes, and entries are evicted following the given policies to
+// stay under it.
+struct HashTable *hashtable_create(uint64_t capacity,
+                                   enum EvictionPolicy eviction_policy,
+                                   enum AdmissionPolicy admission_policy,
+                                   uint64_t memory_budget) {
   // Allocate memory for the hash table.
   struct HashTable *hashtable = malloc(sizeof(struct HashTable));
   if (hashtable == NULL) {
@@ -54,567 +172,1866 @@ struct HashTable *hashtable_create(uint64_t num_buckets) {
     abort();
   }
 
-  // Allocate memory for the buckets of the hash table and initialize each to
-  // NULL.
-  hashtable->num_buckets = num_buckets;
-  hashtable->buckets = malloc(sizeof(struct BucketNode *) * num_buckets);
-  if (hashtable->buckets == NULL) {
-    perror("hashtable_create malloc2");
-    abort();
-  }
-  for (int i = 0; i < num_buckets; i++) {
-    hashtable->buckets[i] = NULL;
+  // The segment of a key is determined by the lowest bits of its hash, so the
+  // number of segments has to be a power of two.
+  hashtable->num_segments = next_power_of_two(HASH_TABLE_SEGMENTS);
+  hashtable->segment_bits = 0;
+  while ((1UL << hashtable->segment_bits) < hashtable->num_segments) {
+    hashtable->segment_bits++;
   }
 
-  // Allocate memory for the mutexes of each bucket of the hash table and
-  // initialize them
-  hashtable->bucket_mutexes = malloc(sizeof(pthread_mutex_t) * num_buckets);
-  if (hashtable->bucket_mutexes == NULL) {
-    perror("hashtable_create malloc3");
+  // Allocate memory for the segments of the hash table and initialize them,
+  // splitting the initial capacity between them.
+  hashtable->segments =
+      malloc(sizeof(struct HashTableSegment) * hashtable->num_segments);
+  if (hashtable->segments == NULL) {
+    perror("hashtable_create malloc2");
     abort();
   }
-  for (int i = 0; i < num_buckets; i++) {
-    pthread_mutex_init(hashtable->bucket_mutexes + i, NULL);
+  for (uint64_t i = 0; i < hashtable->num_segments; i++) {
+    struct HashTableSegment *segment = &hashtable->segments[i];
+    pthread_mutex_init(&segment->mutex, NULL);
+    segment->sequence = 0;
+    segment->index =
+        hash_index_create(hashtable, capacity / hashtable->num_segments);
+    if (segment->index == NULL) {
+      perror("hashtable_create malloc3");
+      abort();
+    }
+    segment->old_index = NULL;
+    segment->rehash_position = 0;
+    segment->key_count = 0;
   }
 
-  hashtable->key_count = 0;
-  hashtable->key_count_mutex = malloc(sizeof(pthread_mutex_t));
-  if (hashtable->key_count_mutex == NULL) {
+  // Every thread updates the counters of its own slot, each on its own cache
+  // line, and they are only added up when the totals are requested.
+  hashtable->num_counters = next_power_of_two(HASH_TABLE_COUNTER_SLOTS);
+  hashtable->counters =
+      aligned_alloc(CACHE_LINE_SIZE,
+                    sizeof(struct HashTableCounters) * hashtable->num_counters);
+  if (hashtable->counters == NULL) {
     perror("hashtable_create malloc4");
     abort();
   }
-  pthread_mutex_init(hashtable->key_count_mutex, NULL);
-
-  hashtable->most_used = NULL;
-  hashtable->least_used = NULL;
-
-  hashtable->usage_mutex = malloc(sizeof(pthread_mutex_t) * num_buckets);
-  if (hashtable->usage_mutex == NULL) {
+  memset(hashtable->counters, 0,
+         sizeof(struct HashTableCounters) * hashtable->num_counters);
+
+  hashtable->memory_budget = memory_budget;
+  hashtable->high_watermark =
+      memory_budget / 100 * ITEM_MEMORY_HIGH_WATERMARK_PERCENT;
+  hashtable->low_watermark =
+      memory_budget / 100 * ITEM_MEMORY_LOW_WATERMARK_PERCENT;
+  hashtable->stored_bytes = 0;
+
+  // Every size class of the slab allocator has its own usage queue, so that
+  // entries can be evicted from the class that needs room. The shard of a key
+  // in the queue of its class is also determined by the lowest bits of its
+  // hash, so every key of a segment and class is in the same shard.
+  hashtable->eviction_policy = eviction_policy;
+  hashtable->admission_policy = admission_policy;
+  if (admission_policy == ADMISSION_TINYLFU) {
+    frequency_sketch_initialize(&hashtable->sketch, ADMISSION_SKETCH_COUNTERS);
+  }
+  hashtable->num_slab_classes = slab_num_classes();
+  hashtable->num_usage_shards = next_power_of_two(HASH_TABLE_USAGE_SHARDS);
+  hashtable->usage_shards =
+      malloc(sizeof(struct UsageShard) * hashtable->num_slab_classes *
+             hashtable->num_usage_shards);
+  if (hashtable->usage_shards == NULL) {
     perror("hashtable_create malloc5");
     abort();
   }
-  pthread_mutex_init(hashtable->usage_mutex, NULL);
+  for (uint64_t i = 0;
+       i < hashtable->num_slab_classes * hashtable->num_usage_shards; i++) {
+    struct UsageShard *shard = &hashtable->usage_shards[i];
+    pthread_mutex_init(&shard->mutex, NULL);
+    shard->main.most_used = NULL;
+    shard->main.least_used = NULL;
+    shard->main.size = 0;
+    shard->window.most_used = NULL;
+    shard->window.least_used = NULL;
+    shard->window.size = 0;
+  }
+  hashtable->eviction_shard = 0;
+
+  // Items that expire are also in a timer wheel, picked by the same bits of
+  // the hash as the shard of their usage queue.
+  hashtable->timer_wheels =
+      malloc(sizeof(struct TimerWheel) * hashtable->num_usage_shards);
+  if (hashtable->timer_wheels == NULL) {
+    perror("hashtable_create malloc6");
+    abort();
+  }
+  for (uint64_t i = 0; i < hashtable->num_usage_shards; i++) {
+    timer_wheel_initialize(&hashtable->timer_wheels[i]);
+  }
+  hashtable->expiration_wheel = 0;
+
+  // The eviction and compaction threads are only started on request, the
+  // condition variables wait on the monotonic clock so that their timeouts
+  // survive clock changes.
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&hashtable->evictor_mutex, NULL);
+  pthread_cond_init(&hashtable->evictor_cond, &cond_attr);
+  hashtable->evictor_running = false;
+  hashtable->evictor_idle = false;
+  pthread_mutex_init(&hashtable->compactor_mutex, NULL);
+  pthread_cond_init(&hashtable->compactor_cond, &cond_attr);
+  hashtable->compactor_running = false;
+  pthread_condattr_destroy(&cond_attr);
+  hashtable->extstore = NULL;
 
   return hashtable;
 }
 
-// Returns the bucket index in the hash table for the given key.
-static uint64_t hashtable_get_bucket_index(struct HashTable *hashtable,
-                                           struct BoundedData *key) {
-  uint64_t key_hash = bounded_data_hash(key);
-  return key_hash % hashtable->num_buckets;
-}
-
-// Given a usage node that is not in the usage queue, add it as the most used
-// node. Assumes that the usage queue mutex is acquired.
-static void
-hashtable_insert_as_most_used_usage_node(struct HashTable *hashtable,
-                                         struct UsageNode *usage_node) {
-  usage_node->more_used = NULL;
-  usage_node->less_used = hashtable->most_used;
-  if (hashtable->most_used == NULL) {
-    hashtable->least_used = usage_node;
+// Returns the segment of the hash table that holds the key with the given hash.
+static struct HashTableSegment *
+hashtable_get_segment(struct HashTable *hashtable, uint64_t key_hash) {
+  return &hashtable->segments[key_hash & (hashtable->num_segments - 1)];
+}
+
+// Returns the given shard of the usage queue of the given size class.
+static struct UsageShard *hashtable_usage_shard(struct HashTable *hashtable,
+                                                uint64_t slab_class,
+                                                uint64_t shard) {
+  return &hashtable->usage_shards[slab_class * hashtable->num_usage_shards +
+                                  shard];
+}
+
+// Returns the shard of the usage queue that holds the given item.
+static struct UsageShard *hashtable_get_usage_shard(struct HashTable *hashtable,
+                                                    struct Item *item) {
+  return hashtable_usage_shard(
+      hashtable, item->slab_class,
+      item->hash & (hashtable->num_usage_shards - 1));
+}
+
+// Returns the timer wheel of the hash table that holds the given item if it
+// expires.
+static struct TimerWheel *hashtable_get_timer_wheel(struct HashTable *hashtable,
+                                                    struct Item *item) {
+  return &hashtable->timer_wheels[item->hash &
+                                  (hashtable->num_usage_shards - 1)];
+}
+
+// Adds the given item to its timer wheel if it expires. Assumes that the
+// segment mutex of the item is acquired.
+static void hashtable_timer_add(struct HashTable *hashtable,
+                                struct Item *item) {
+  if (!item->expires) {
+    return;
+  }
+  struct TimerWheel *wheel = hashtable_get_timer_wheel(hashtable, item);
+  pthread_mutex_lock(&wheel->mutex);
+  timer_wheel_add(wheel, item);
+  pthread_mutex_unlock(&wheel->mutex);
+}
+
+// Removes the given item from its timer wheel if it's in it. Assumes that the
+// segment mutex of the item is acquired.
+static void hashtable_timer_remove(struct HashTable *hashtable,
+                                   struct Item *item) {
+  if (!item->expires) {
+    return;
+  }
+  struct TimerWheel *wheel = hashtable_get_timer_wheel(hashtable, item);
+  pthread_mutex_lock(&wheel->mutex);
+  timer_wheel_remove(wheel, item);
+  pthread_mutex_unlock(&wheel->mutex);
+}
+
+// Returns the hash that the index of a segment uses for the key with the given
+// hash. The lowest bits of the hash are skipped because they were already used
+// to pick the segment.
+static uint64_t hashtable_get_index_hash(struct HashTable *hashtable,
+                                         uint64_t key_hash) {
+  return key_hash >> hashtable->segment_bits;
+}
+
+// Looks for the given key in the given segment, both in the current index and
+// in the old one if the segment is growing. Returns the item holding the key or
+// NULL if the key is not in the segment. Assumes that the segment mutex is
+// acquired.
+static struct Item *hashtable_segment_find(struct HashTable *hashtable,
+                                           struct HashTableSegment *segment,
+                                           struct BoundedData *key,
+                                           uint64_t key_hash) {
+  uint64_t index_hash = hashtable_get_index_hash(hashtable, key_hash);
+  struct Item *item = hash_index_find(segment->index, key, index_hash);
+  if (item == NULL && segment->old_index != NULL) {
+    item = hash_index_find(segment->old_index, key, index_hash);
+  }
+  return item;
+}
+
+// Same as hashtable_segment_find, but without the segment mutex. The result is
+// only reliable when the item is found or when the sequence number of the
+// segment validates the lookup. Assumes that the caller is inside an epoch
+// critical section.
+static struct Item *hashtable_segment_find_lock_free(
+    struct HashTable *hashtable, struct HashTableSegment *segment,
+    struct BoundedData *key, uint64_t key_hash) {
+  uint64_t index_hash = hashtable_get_index_hash(hashtable, key_hash);
+  struct HashIndex *index = __atomic_load_n(&segment->index, __ATOMIC_ACQUIRE);
+  struct Item *item = hash_index_find(index, key, index_hash);
+  if (item == NULL) {
+    struct HashIndex *old_index =
+        __atomic_load_n(&segment->old_index, __ATOMIC_ACQUIRE);
+    if (old_index != NULL) {
+      item = hash_index_find(old_index, key, index_hash);
+    }
+  }
+  return item;
+}
+
+// Removes the given item from the given segment, looking for it both in the
+// current index and in the old one if the segment is growing. Returns true if
+// the item was in the segment. Assumes that the segment mutex is acquired.
+static bool hashtable_segment_remove(struct HashTable *hashtable,
+                                     struct HashTableSegment *segment,
+                                     struct Item *item) {
+  uint64_t index_hash = hashtable_get_index_hash(hashtable, item->hash);
+  bool removed;
+
+  hashtable_segment_write_begin(segment);
+  removed = hash_index_remove(segment->index, item, index_hash) ||
+            (segment->old_index != NULL &&
+             hash_index_remove(segment->old_index, item, index_hash));
+  hashtable_segment_write_end(segment);
+
+  if (removed) {
+    segment->key_count--;
+  }
+  return removed;
+}
+
+// Puts the given new item in place of the given old one in the given segment,
+// in whichever index holds the old one. Both items have the same key, so
+// lock-free lookups find one of them and the sequence number is left alone.
+// Assumes that the segment mutex is acquired.
+static void hashtable_segment_replace(struct HashTable *hashtable,
+                                      struct HashTableSegment *segment,
+                                      struct Item *old_item,
+                                      struct Item *new_item) {
+  uint64_t index_hash = hashtable_get_index_hash(hashtable, old_item->hash);
+  if (!hash_index_replace(segment->index, old_item, new_item, index_hash) &&
+      segment->old_index != NULL) {
+    hash_index_replace(segment->old_index, old_item, new_item, index_hash);
+  }
+}
+
+// Frees an index once no lock-free lookup can be reading it.
+static void hashtable_free_index(void *index) { hash_index_destroy(index); }
+
+// Releases the reference of the hash table to an item once no lock-free lookup
+// can be reading it. The item is freed unless a response still holds it.
+static void hashtable_release_item(void *item) { item_release(item); }
+
+// Moves a few positions of the old index of the given segment into the current
+// one, if the segment is growing. Once every old position is moved, the old
+// index is released. Assumes that the segment mutex is acquired.
+static void hashtable_segment_rehash_step(struct HashTable *hashtable,
+                                          struct HashTableSegment *segment) {
+  if (segment->old_index == NULL) {
+    return;
+  }
+
+  uint64_t num_positions = hash_index_num_positions(segment->old_index);
+  for (int step = 0; step < HASH_TABLE_REHASH_STEPS; step++) {
+    if (segment->rehash_position == num_positions) {
+      // Every position was moved, so the old index is no longer needed.
+      struct HashIndex *old_index = segment->old_index;
+      __atomic_store_n(&segment->old_index, NULL, __ATOMIC_RELEASE);
+      segment->rehash_position = 0;
+      epoch_retire(hashtable_free_index, old_index);
+      return;
+    }
+
+    // Move every item of the old position to the current index. The hash of
+    // the key is stored in the item, so keys aren't hashed again.
+    struct Item *item;
+    hashtable_segment_write_begin(segment);
+    while ((item = hash_index_pop(segment->old_index,
+                                  segment->rehash_position)) != NULL) {
+      hash_index_insert(segment->index, item,
+                        hashtable_get_index_hash(hashtable, item->hash));
+    }
+    hashtable_segment_write_end(segment);
+    segment->rehash_position++;
+  }
+}
+
+// Starts growing the given segment if its index is too loaded and it's not
+// already growing: the current index becomes the old one and a new, larger,
+// index takes its place. The keys are moved afterwards, a few positions at a
+// time. Assumes that the segment mutex is acquired.
+static void hashtable_segment_maybe_grow(struct HashTable *hashtable,
+                                         struct HashTableSegment *segment) {
+  if (segment->old_index != NULL) {
+    return;
+  }
+
+  uint64_t capacity = hash_index_resize_capacity(segment->index);
+  if (capacity == 0) {
+    return;
+  }
+
+  struct HashIndex *index = hash_index_create(hashtable, capacity);
+  if (index == NULL) {
+    // Not growing is not an error: lookups just get slower. We'll try again
+    // on the next insertion.
+    return;
+  }
+
+  // Lock-free lookups look in the current index before the old one, so the
+  // swap can make them miss keys.
+  hashtable_segment_write_begin(segment);
+  __atomic_store_n(&segment->old_index, segment->index, __ATOMIC_RELEASE);
+  segment->rehash_position = 0;
+  __atomic_store_n(&segment->index, index, __ATOMIC_RELEASE);
+  hashtable_segment_write_end(segment);
+}
+
+// Given an item that is not in the given usage queue, add it as the most used
+// item. Assumes that the mutex of the shard of the queue is acquired.
+static void hashtable_insert_as_most_used(struct UsageQueue *queue,
+                                          struct Item *item) {
+  item->more_used = NULL;
+  item->less_used = queue->most_used;
+  if (queue->most_used == NULL) {
+    queue->least_used = item;
   } else {
-    hashtable->most_used->more_used = usage_node;
+    queue->most_used->more_used = item;
   }
-  hashtable->most_used = usage_node;
+  queue->most_used = item;
+  queue->size++;
 }
 
-// Given a usage node that is in the usage queue, unlink it from the queue.
-// Assumes that the usage queue mutex is acquired.
-static void hashtable_remove_usage_node(struct HashTable *hashtable,
-                                        struct UsageNode *usage_node) {
-  struct UsageNode *less = usage_node->less_used;
-  struct UsageNode *more = usage_node->more_used;
+// Given an item that is not in the given usage queue, add it as the least used
+// item. Assumes that the mutex of the shard of the queue is acquired.
+static void hashtable_insert_as_least_used(struct UsageQueue *queue,
+                                           struct Item *item) {
+  item->less_used = NULL;
+  item->more_used = queue->least_used;
+  if (queue->least_used == NULL) {
+    queue->most_used = item;
+  } else {
+    queue->least_used->less_used = item;
+  }
+  queue->least_used = item;
+  queue->size++;
+}
+
+// Given an item that is in the given usage queue, unlink it from the queue.
+// Assumes that the mutex of the shard of the queue is acquired.
+static void hashtable_remove_from_usage(struct UsageQueue *queue,
+                                        struct Item *item) {
+  struct Item *less = item->less_used;
+  struct Item *more = item->more_used;
 
   if (less != NULL) {
     less->more_used = more;
-    usage_node->less_used = NULL;
+    item->less_used = NULL;
   }
 
   if (more != NULL) {
     more->less_used = less;
-    usage_node->more_used = NULL;
+    item->more_used = NULL;
   }
 
   if (less == NULL) {
     // we removed the least used element.
-    hashtable->least_used = more;
+    queue->least_used = more;
   }
 
   if (more == NULL) {
     // we removed the most used element.
-    hashtable->most_used = less;
+    queue->most_used = less;
   }
+
+  queue->size--;
 }
 
-// Inserts the given key and value into the hash table.
-//////////////////////////////////////
-// If the key doesn't already exist in the hash table, the function returns
-// HT_NOTFOUND and the keyand value pointers become "owned" by the hash table.
-// If the key does already exist in the hash table, the function returns
-// HT_FOUND, the given key pointer becomes owned by the hash table, the old key
-// pointer is destroyed (!!) and the old value pointer is destroyed (!!). If
-// there is not enough memory for the new entry after evictions, both key and
-// value pointers are destroyed and HT_ERROR is returned.
-int hashtable_insert(struct HashTable *hashtable, struct BoundedData *key,
-                     struct BoundedData *value) {
-  // Determine the bucket index for the key.
-  uint64_t bucket_index = hashtable_get_bucket_index(hashtable, key);
-  struct BucketNode *previous_node = NULL;
-
-  hashtable_bucket_acquire(hashtable, bucket_index);
-  struct BucketNode *current_node = hashtable->buckets[bucket_index];
-
-  // Look for the key in the bucket.
-  while (current_node != NULL) {
-    if (bounded_data_equals(current_node->key, key)) {
-      // Found it!
-      // Free the old value and replace it with the new one.
-      bounded_data_destroy(current_node->value);
-      current_node->value = value;
+// Puts the given new item, which is not in any usage queue, in place of the
+// given old one in the given queue, which the old one is linked to. Assumes
+// that the mutex of the shard of the queue is acquired.
+static void hashtable_replace_in_usage(struct UsageQueue *queue,
+                                       struct Item *old_item,
+                                       struct Item *new_item) {
+  new_item->more_used = old_item->more_used;
+  new_item->less_used = old_item->less_used;
+  if (old_item->more_used == NULL) {
+    queue->most_used = new_item;
+  } else {
+    old_item->more_used->less_used = new_item;
+  }
+  if (old_item->less_used == NULL) {
+    queue->least_used = new_item;
+  } else {
+    old_item->less_used->more_used = new_item;
+  }
+  new_item->queue = old_item->queue;
+  old_item->queue = ITEM_QUEUE_NONE;
+}
 
-      // Delete the new key since the old one is already assigned and is the
-      // same.
-      bounded_data_destroy(key);
+// Returns the queue of the given shard that the given item is linked to.
+// Assumes that the shard mutex is acquired.
+static struct UsageQueue *hashtable_item_queue(struct UsageShard *shard,
+                                               struct Item *item) {
+  return item->queue == ITEM_QUEUE_WINDOW ? &shard->window : &shard->main;
+}
 
-      // Set as the most used.
+// Records an access to the key with the given hash for the admission policy.
+static void hashtable_record_access(struct HashTable *hashtable,
+                                    uint64_t key_hash) {
+  if (hashtable->admission_policy == ADMISSION_TINYLFU) {
+    frequency_sketch_increment(&hashtable->sketch, key_hash);
+  }
+}
 
-      hashtable_usage_acquire(hashtable);
-      hashtable_remove_usage_node(hashtable, current_node->usage_node);
-      hashtable_insert_as_most_used_usage_node(hashtable,
-                                               current_node->usage_node);
-      hashtable_usage_release(hashtable);
+// Moves the least used items of the admission window of the given shard to its
+// main queue while the window takes more than its share of the shard. An item
+// that is estimated to be more popular than the next victim of the main queue
+// becomes its most used item, and any other item becomes the next victim
+// itself. Assumes that the shard mutex is acquired.
+static void hashtable_admit_from_window(struct HashTable *hashtable,
+                                        struct UsageShard *shard) {
+  uint64_t max_window_size =
+      (shard->main.size + shard->window.size) * ADMISSION_WINDOW_PERCENT / 100;
+  if (max_window_size == 0) {
+    max_window_size = 1;
+  }
 
-      // Return HT_FOUND to signal that the key was found when inserting.
-      hashtable_bucket_release(hashtable, bucket_index);
-      return HT_FOUND;
+  while (shard->window.size > max_window_size) {
+    struct Item *candidate = shard->window.least_used;
+    struct Item *victim = shard->main.least_used;
+    hashtable_remove_from_usage(&shard->window, candidate);
+    candidate->queue = ITEM_QUEUE_MAIN;
+
+    if (victim == NULL ||
+        frequency_sketch_estimate(&hashtable->sketch, candidate->hash) >
+            frequency_sketch_estimate(&hashtable->sketch, victim->hash)) {
+      hashtable_insert_as_most_used(&shard->main, candidate);
+    } else {
+      // Without a second chance under the CLOCK policy either.
+      __atomic_store_n(&candidate->referenced, false, __ATOMIC_RELAXED);
+      hashtable_insert_as_least_used(&shard->main, candidate);
     }
+  }
+}
 
-    // Keep looking for the key in the bucket nodes.
-    previous_node = current_node;
-    current_node = current_node->next;
-  }
-
-  // Didn't find the key. Create a bucket node and add it to the bucket.
-  struct BucketNode *new_node =
-      hashtable_malloc_evict(hashtable, sizeof(struct BucketNode));
-  if (new_node == NULL) {
-    hashtable_bucket_release(hashtable, bucket_index);
-    bounded_data_destroy(key);
-    bounded_data_destroy(value);
-    return HT_ERROR;
-  }
-  new_node->key = key;
-  new_node->value = value;
-  new_node->next = NULL;       // Just in case.
-  new_node->usage_node = NULL; // Just in case.
-
-  // Create and set the new node as the most recently used one.
-  struct UsageNode *new_usage_node =
-      hashtable_malloc_evict(hashtable, sizeof(struct UsageNode));
-  if (new_usage_node == NULL) {
-    hashtable_bucket_release(hashtable, bucket_index);
-    free(new_node);
-    bounded_data_destroy(key);
-    bounded_data_destroy(value);
-    return HT_ERROR;
-  }
-  new_usage_node->less_used = NULL; // Just in case.
-  new_usage_node->more_used = NULL; // Just in case.
-  new_usage_node->bucket_node = new_node;
-  new_node->usage_node = new_usage_node;
-
-  hashtable_usage_acquire(hashtable);
-  hashtable_insert_as_most_used_usage_node(hashtable, new_usage_node);
-  hashtable_usage_release(hashtable);
-
-  if (previous_node == NULL) {
-    hashtable->buckets[bucket_index] = new_node;
-  } else {
-    previous_node->next = new_node;
+// Links the given item, which is not linked to any usage queue, to the given
+// shard as its most used item: in the admission window of the shard for the
+// TinyLFU admission policy, unless the given queue says otherwise, and in the
+// main queue for any other policy. Assumes that the shard mutex is acquired.
+static void hashtable_link_item(struct HashTable *hashtable,
+                                struct UsageShard *shard, struct Item *item,
+                                enum ItemQueue queue) {
+  if (hashtable->admission_policy != ADMISSION_TINYLFU) {
+    queue = ITEM_QUEUE_MAIN;
+  }
+  item->queue = queue;
+  hashtable_insert_as_most_used(hashtable_item_queue(shard, item), item);
+  if (queue == ITEM_QUEUE_WINDOW) {
+    hashtable_admit_from_window(hashtable, shard);
   }
+}
 
-  // Return HT_NOTFOUND to signal that the key wasn't found when inserting.
-  hashtable_bucket_release(hashtable, bucket_index);
+// Marks the given item as used. With the LRU policy the item becomes the most
+// used of its shard, unless it was removed from the hash table in the meantime.
+// With the CLOCK policy only its reference bit is set, so that hits don't write
+// to the shard.
+static void hashtable_mark_used(struct HashTable *hashtable,
+                                struct Item *item) {
+  if (hashtable->eviction_policy == EVICTION_CLOCK) {
+    // Avoid writing to the item when the bit is already set.
+    if (!__atomic_load_n(&item->referenced, __ATOMIC_RELAXED)) {
+      __atomic_store_n(&item->referenced, true, __ATOMIC_RELAXED);
+    }
+    return;
+  }
 
-  // Increase the keys counter.
-  hashtable_key_count_acquire(hashtable);
-  hashtable->key_count++;
-  hashtable_key_count_release(hashtable);
+  struct UsageShard *shard = hashtable_get_usage_shard(hashtable, item);
+  hashtable_usage_acquire(shard);
+  if (item->queue != ITEM_QUEUE_NONE) {
+    struct UsageQueue *queue = hashtable_item_queue(shard, item);
+    hashtable_remove_from_usage(queue, item);
+    hashtable_insert_as_most_used(queue, item);
+  }
+  hashtable_usage_release(shard);
+}
 
-  return HT_NOTFOUND;
+// Adds the given item, whose key is not in the hash table and which is already
+// linked to its usage queue shard, to the index of the given segment, to the
+// timer wheel and to the counters. Assumes that the segment mutex is acquired.
+static void hashtable_index_item(struct HashTable *hashtable,
+                                 struct HashTableSegment *segment,
+                                 struct Item *item) {
+  // New keys always go to the current index, even if the segment is growing.
+  // Adding an item doesn't move any other, so lock-free lookups don't need to
+  // know about it.
+  hash_index_insert(segment->index, item,
+                    hashtable_get_index_hash(hashtable, item->hash));
+  segment->key_count++;
+  hashtable_timer_add(hashtable, item);
+  hashtable_key_count_add(hashtable, 1);
+  hashtable_stored_bytes_add(hashtable, item_memory(item));
+  hashtable_segment_maybe_grow(hashtable, segment);
+}
+
+// Adds the given item, whose key is not in the hash table, to the given
+// segment as the most recently used item of its usage queue shard. Assumes
+// that the segment mutex is acquired.
+static void hashtable_add_item(struct HashTable *hashtable,
+                               struct HashTableSegment *segment,
+                               struct Item *item) {
+  struct UsageShard *shard = hashtable_get_usage_shard(hashtable, item);
+  hashtable_usage_acquire(shard);
+  hashtable_link_item(hashtable, shard, item, ITEM_QUEUE_WINDOW);
+  hashtable_usage_release(shard);
+  hashtable_index_item(hashtable, segment, item);
+}
+
+// Adds the given item, which holds the location of the value of an entry that
+// was just evicted, to the given segment as the least used item of the main
+// queue of its usage queue shard. The key was cold enough to be evicted, so it
+// goes neither through the admission window nor to the most used end of the
+// queue. Assumes that the segment mutex is acquired.
+static void hashtable_add_spilled_item(struct HashTable *hashtable,
+                                       struct HashTableSegment *segment,
+                                       struct Item *item) {
+  struct UsageShard *shard = hashtable_get_usage_shard(hashtable, item);
+  hashtable_usage_acquire(shard);
+  item->queue = ITEM_QUEUE_MAIN;
+  hashtable_insert_as_least_used(&shard->main, item);
+  hashtable_usage_release(shard);
+  hashtable_index_item(hashtable, segment, item);
 }
 
-// Attempts to retrieve a *copy* of the value associated to the given key in the
+// Inserts the given item into the hash table.
+//////////////////////////////////////
+// If the key of the item doesn't already exist in the hash table, the function
+// returns HT_NOTFOUND. If the key does already exist in the hash table, the
+// function returns HT_FOUND and the item that held it is released (!!). In
+// both cases the reference of the caller to the item becomes "owned" by the
 // hash table.
+int hashtable_insert(struct HashTable *hashtable, struct Item *item) {
+  // Determine the segment for the key.
+  struct BoundedData key = {item->key_size, item_key(item)};
+  uint64_t key_hash = bounded_data_hash(&key);
+  struct HashTableSegment *segment = hashtable_get_segment(hashtable, key_hash);
+  item->hash = key_hash;
+  hashtable_record_access(hashtable, key_hash);
+  struct UsageShard *shard = hashtable_get_usage_shard(hashtable, item);
+
+  hashtable_segment_acquire(segment);
+  hashtable_segment_rehash_step(hashtable, segment);
+
+  // Look for the key in the segment.
+  struct Item *current_item =
+      hashtable_segment_find(hashtable, segment, &key, key_hash);
+  if (current_item != NULL) {
+    // Found it!
+
+    // Put the new item in place of the old one, both in the segment and as the
+    // most used of the usage queue, and release the old one once no lock-free
+    // lookup can be taking a reference to it.
+    // The new value might not be of the same size class as the old one, so
+    // the old item might be in another usage queue.
+    hashtable_segment_replace(hashtable, segment, current_item, item);
+
+    // The key was already admitted if the old item made it to the main queue,
+    // so the new one goes straight there.
+    struct UsageShard *current_shard =
+        hashtable_get_usage_shard(hashtable, current_item);
+    hashtable_usage_acquire(current_shard);
+    enum ItemQueue queue = current_item->queue;
+    hashtable_remove_from_usage(
+        hashtable_item_queue(current_shard, current_item), current_item);
+    current_item->queue = ITEM_QUEUE_NONE;
+    hashtable_usage_release(current_shard);
+
+    hashtable_usage_acquire(shard);
+    hashtable_link_item(hashtable, shard, item, queue);
+    hashtable_usage_release(shard);
+
+    hashtable_timer_remove(hashtable, current_item);
+    hashtable_timer_add(hashtable, item);
+
+    hashtable_stored_bytes_add(hashtable, item_memory(item));
+    hashtable_stored_bytes_add(hashtable, -(int64_t)item_memory(current_item));
+    epoch_retire(hashtable_release_item, current_item);
+
+    // Return HT_FOUND to signal that the key was found when inserting.
+    hashtable_segment_release(segment);
+    return HT_FOUND;
+  }
+
+  // Didn't find the key.
+  hashtable_add_item(hashtable, segment, item);
+
+  // Return HT_NOTFOUND to signal that the key wasn't found when inserting.
+  hashtable_segment_release(segment);
+
+  return HT_NOTFOUND;
+}
+
+// Attempts to retrieve the item that holds the given key in the hash table,
+// without copying its value.
 //////////////////////////////////////
 // If the key doesn't already exist in the hash table, the function returns
-// HT_NOTFOUND and the given value pointer is left untouched. If the key does
+// HT_NOTFOUND and the given item pointer is left untouched. If the key does
 // already exist in the hash table, the function returns HT_FOUND and the given
-// value pointer is modified so that it holds a pointer to a copy of the value
-// associated to the given key in the hash table. The pointer of the given key
-// is owned by the client. If there is not enough memory for the duplicate of
-// the value then HT_ERROR is returned.
+// item pointer is modified so that it holds a pointer to the item, with a
+// reference taken for the caller: the item stays valid even if the key is
+// removed or overwritten, until the caller releases it with item_release. The
+// pointer of the given key is owned by the client.
 int hashtable_get(struct HashTable *hashtable, struct BoundedData *key,
-                  struct BoundedData **value) {
-  // Determine the bucket index for the key.
-  uint64_t bucket_index = hashtable_get_bucket_index(hashtable, key);
-
-  hashtable_bucket_acquire(hashtable, bucket_index);
-  struct BucketNode *current_node = hashtable->buckets[bucket_index];
-
-  // Look for the key in the bucket.
-  while (current_node != NULL) {
-    if (bounded_data_equals(current_node->key, key)) {
+                  struct Item **item) {
+  // Determine the segment for the key.
+  uint64_t key_hash = bounded_data_hash(key);
+  struct HashTableSegment *segment = hashtable_get_segment(hashtable, key_hash);
+  struct Item *current_item;
+
+  // Misses count too: a key that keeps being asked for is worth admitting.
+  hashtable_record_access(hashtable, key_hash);
+
+  // Look for the key without acquiring the segment mutex. Items found this way
+  // can't be freed until we leave the epoch critical section, so taking a
+  // reference to them is safe, but a miss is only trusted if no writer moved or
+  // removed items of the segment meanwhile.
+  epoch_enter();
+  for (int attempt = 0; attempt < HASH_TABLE_READ_ATTEMPTS; attempt++) {
+    uint64_t sequence = hashtable_segment_read_begin(segment);
+    current_item =
+        hashtable_segment_find_lock_free(hashtable, segment, key, key_hash);
+    if (current_item != NULL && item_expired(current_item)) {
+      // Expired entries are misses, even if they're still in the table until
+      // their timer wheel gets to them.
+      epoch_exit();
+      return HT_NOTFOUND;
+    }
+    if (current_item != NULL) {
       // Found it!
-      // Get a copy of the value and "return" a pointer to it.
-      struct BoundedData *copy = hashtable_malloc_evict_bounded_data(
-          hashtable, current_node->value->size);
-      if (copy == NULL) {
-        hashtable_bucket_release(hashtable, bucket_index);
-        return HT_ERROR;
-      }
-      memcpy(copy->data, current_node->value->data, current_node->value->size);
-      *value = copy;
-
-      // Set as the most used.
-      hashtable_usage_acquire(hashtable);
-      hashtable_remove_usage_node(hashtable, current_node->usage_node);
-      hashtable_insert_as_most_used_usage_node(hashtable,
-                                               current_node->usage_node);
-      hashtable_usage_release(hashtable);
-
-      // Return HT_FOUND to signal that the key was found when retrieving.
-      hashtable_bucket_release(hashtable, bucket_index);
+      item_acquire(current_item);
+      hashtable_mark_used(hashtable, current_item);
+      epoch_exit();
+      *item = current_item;
       return HT_FOUND;
     }
+    if (hashtable_segment_read_validate(segment, sequence)) {
+      // Return HT_NOTFOUND to signal that the key wasn't found when
+      // retrieving.
+      epoch_exit();
+      return HT_NOTFOUND;
+    }
+  }
+  epoch_exit();
 
-    // Keep looking for the key in the bucket nodes.
-    current_node = current_node->next;
+  // Writers kept moving items of the segment around, so fall back to looking
+  // for the key while holding the segment mutex.
+  hashtable_segment_acquire(segment);
+  hashtable_segment_rehash_step(hashtable, segment);
+
+  current_item = hashtable_segment_find(hashtable, segment, key, key_hash);
+  if (current_item == NULL || item_expired(current_item)) {
+    hashtable_segment_release(segment);
+    return HT_NOTFOUND;
   }
+  item_acquire(current_item);
+  hashtable_mark_used(hashtable, current_item);
+  hashtable_segment_release(segment);
+  *item = current_item;
+  return HT_FOUND;
+}
 
-  // Return HT_NOTFOUND to signal that the key wasn't found when retrieving.
-  hashtable_bucket_release(hashtable, bucket_index);
-  return HT_NOTFOUND;
+// Removes the given item from the given segment and from the usage queue, and
+// releases the reference of the hash table to it once no lock-free lookup can
+// be reading it. Assumes that the segment mutex is acquired.
+static void hashtable_unlink_item(struct HashTable *hashtable,
+                                  struct HashTableSegment *segment,
+                                  struct Item *item) {
+  struct UsageShard *shard = hashtable_get_usage_shard(hashtable, item);
+  hashtable_usage_acquire(shard);
+  hashtable_remove_from_usage(hashtable_item_queue(shard, item), item);
+  item->queue = ITEM_QUEUE_NONE;
+  hashtable_usage_release(shard);
+
+  hashtable_segment_remove(hashtable, segment, item);
+  hashtable_timer_remove(hashtable, item);
+  hashtable_key_count_add(hashtable, -1);
+  hashtable_stored_bytes_add(hashtable, -(int64_t)item_memory(item));
+  epoch_retire(hashtable_release_item, item);
 }
 
 // Attempts to remove the given key and its associated value from the hash
-// table and "returns" a pointer to a copy of the removed value.
+// table and "returns" a pointer to the removed item.
 //////////////////////////////////////
 // If the key doesn't already exist in the hash table, the function returns
-// HT_NOTFOUND and the given value pointer is left untouched. If the key does
-// already exist in the hash table, the function returns HT_FOUND, the given
-// value pointer is modified so that it holds a pointer to the value associated
-// to the given key in the hash table and the key pointer in the hash table is
-// destroyed (!!).
+// HT_NOTFOUND and the given item pointer is left untouched. If the key does
+// already exist in the hash table, the function returns HT_FOUND, the item is
+// removed from the hash table and the given item pointer is modified so that it
+// holds a pointer to it, with a reference taken for the caller. The item is
+// freed once the caller releases it with item_release.
 int hashtable_take(struct HashTable *hashtable, struct BoundedData *key,
-                   struct BoundedData **value) {
-  // Determine the bucket index for the key.
-  uint64_t bucket_index = hashtable_get_bucket_index(hashtable, key);
-  struct BucketNode *previous_node = NULL;
-
-  hashtable_bucket_acquire(hashtable, bucket_index);
-  struct BucketNode *current_node = hashtable->buckets[bucket_index];
-
-  while (current_node != NULL) {
-    // Look for the key in the bucket.
-    if (bounded_data_equals(current_node->key, key)) {
-      // Found it!
-
-      // Remove and destroy the usage node for the current bucket node.
-      hashtable_usage_acquire(hashtable);
-      hashtable_remove_usage_node(hashtable, current_node->usage_node);
-      hashtable_usage_release(hashtable);
-      free(current_node->usage_node);
-
-      // "Return" a pointer to the actual value and "remove" it from the bucket
-      // node.
-      *value = current_node->value;
-      current_node->value = NULL; // Just in case.
-
-      // Destroy the pointer to the key.
-      bounded_data_destroy(current_node->key);
-      current_node->key = NULL; // Just in case.
-
-      // Remove the node from the bucket
-      if (previous_node == NULL) {
-        // The key-value pair is stored in the first node of the bucket.
-        hashtable->buckets[bucket_index] = current_node->next;
-      } else {
-        // The key-value pair is not stored in the first node of the bucket.
-        previous_node->next = current_node->next;
-      }
-
-      // Destroy the bucket node of the key-value pair.
-      free(current_node);
-
-      hashtable_bucket_release(hashtable, bucket_index);
-
-      // Decrease the keys counter.
-      hashtable_key_count_acquire(hashtable);
-      hashtable->key_count--;
-      hashtable_key_count_release(hashtable);
-
-      // Return HT_FOUND to signal that the key was found when removing.
-      return HT_FOUND;
-    }
-
-    // Keep looking for the key in the bucket nodes.
-    previous_node = current_node;
-    current_node = current_node->next;
+                   struct Item **item) {
+  // Determine the segment for the key.
+  uint64_t key_hash = bounded_data_hash(key);
+  struct HashTableSegment *segment = hashtable_get_segment(hashtable, key_hash);
+
+  hashtable_segment_acquire(segment);
+  hashtable_segment_rehash_step(hashtable, segment);
+
+  // Look for the key in the segment.
+  struct Item *current_item =
+      hashtable_segment_find(hashtable, segment, key, key_hash);
+  if (current_item == NULL) {
+    // Return HT_NOTFOUND to signal that the key wasn't found when removing.
+    hashtable_segment_release(segment);
+    return HT_NOTFOUND;
+  }
+  if (item_expired(current_item)) {
+    // Expired entries are misses, but since we're here we remove it already.
+    hashtable_unlink_item(hashtable, segment, current_item);
+    hashtable_expired_count_add(hashtable);
+    hashtable_segment_release(segment);
+    return HT_NOTFOUND;
   }
 
-  // Return HT_NOTFOUND to signal that the key wasn't found when removing.
-  hashtable_bucket_release(hashtable, bucket_index);
-  return HT_NOTFOUND;
+  // Found it! Take a reference for the caller before the one of the hash table
+  // goes away.
+  item_acquire(current_item);
+  hashtable_unlink_item(hashtable, segment, current_item);
+
+  hashtable_segment_release(segment);
+  *item = current_item;
+  return HT_FOUND;
 }
 
 // Attempts to remove the given key and its associated value from the hash
-// table and get a pointer to a copy of the removed value.
+// table.
 //////////////////////////////////////
 // If the key doesn't already exist in the hash table, the function returns
 // HT_NOTFOUND. If the key does already exist in the hash table, the function
-// returns HT_FOUND, the key pointer in the hash table is destroyed (!!) and the
-// value pointer in the hash table is destroyed (!!).
+// returns HT_FOUND and the item in the hash table is released (!!).
 int hashtable_remove(struct HashTable *hashtable, struct BoundedData *key) {
-  struct BoundedData *removed_value = NULL;
-  int ret = hashtable_take(hashtable, key, &removed_value);
-  if (ret == HT_FOUND) {
-    // Destroy the value since we don't need it.
-    bounded_data_destroy(removed_value);
+  // Determine the segment for the key.
+  uint64_t key_hash = bounded_data_hash(key);
+  struct HashTableSegment *segment = hashtable_get_segment(hashtable, key_hash);
+
+  hashtable_segment_acquire(segment);
+  hashtable_segment_rehash_step(hashtable, segment);
+
+  struct Item *current_item =
+      hashtable_segment_find(hashtable, segment, key, key_hash);
+  if (current_item == NULL) {
+    hashtable_segment_release(segment);
+    return HT_NOTFOUND;
   }
-  return ret;
+
+  // Expired entries are removed all the same, but they were already gone as
+  // far as the client is concerned.
+  bool expired = item_expired(current_item);
+  hashtable_unlink_item(hashtable, segment, current_item);
+  if (expired) {
+    hashtable_expired_count_add(hashtable);
+  }
+  hashtable_segment_release(segment);
+  return expired ? HT_NOTFOUND : HT_FOUND;
 }
 
-// Recursively prints a bucket node of a hash table.
-static void hashtable_print_bucket_nodes(struct HashTable *hashtable,
-                                         struct BucketNode *bucket_node) {
-  if (bucket_node == NULL) {
-    printf("-> X\n");
-    return;
+// Items of a segment of a hash table collected by hashtable_visit.
+struct HashTableVisit {
+  struct Item **items;
+  uint64_t num_items;
+  uint64_t capacity;
+  bool complete; // False if some item didn't fit in the array.
+};
+
+// Takes a reference to the given item and adds it to the given
+// HashTableVisit.
+static void hashtable_visit_collect(struct Item *item, void *arg) {
+  struct HashTableVisit *visit = arg;
+  if (visit->num_items == visit->capacity) {
+    uint64_t capacity = visit->capacity == 0 ? 64 : visit->capacity * 2;
+    struct Item **items =
+        realloc(visit->items, sizeof(struct Item *) * capacity);
+    if (items == NULL) {
+      visit->complete = false;
+      return;
+    }
+    visit->items = items;
+    visit->capacity = capacity;
   }
+  item_acquire(item);
+  visit->items[visit->num_items++] = item;
+}
 
-  printf("-> (");
-  bounded_data_print(bucket_node->key);
-  printf(":");
-  printf("vsize%ld", bucket_node->value->size);
-  printf(") ");
+// Calls the given function with every item of the hash table and the given
+// argument, one segment at a time: the items of a segment are collected with a
+// reference taken for each of them while holding its mutex, and the function is
+// called once the mutex is released, so that it can take its time without
+// blocking the segment. Items inserted or removed in the meantime might not be
+// visited. Returns false if some item was skipped for lack of memory.
+bool hashtable_visit(struct HashTable *hashtable,
+                     void (*visitor)(struct Item *item, void *arg),
+                     void *arg) {
+  struct HashTableVisit visit = {NULL, 0, 0, true};
+  for (uint64_t i = 0; i < hashtable->num_segments; i++) {
+    struct HashTableSegment *segment = &hashtable->segments[i];
+    hashtable_segment_acquire(segment);
+    hash_index_visit(segment->index, hashtable_visit_collect, &visit);
+    if (segment->old_index != NULL) {
+      hash_index_visit(segment->old_index, hashtable_visit_collect, &visit);
+    }
+    hashtable_segment_release(segment);
+
+    for (uint64_t j = 0; j < visit.num_items; j++) {
+      visitor(visit.items[j], arg);
+      item_release(visit.items[j]);
+    }
+    visit.num_items = 0;
+  }
+  free(visit.items);
+  return visit.complete;
+}
 
-  hashtable_print_bucket_nodes(hashtable, bucket_node->next);
+// Prints an item of a hash table.
+static void hashtable_print_item(struct Item *item, void *arg) {
+  printf("(%.*s:vsize%u) ", (int)item->key_size, item_key(item),
+         item->value_size);
 }
 
 // Prints the given hashtable to standard output.
 void hashtable_print(struct HashTable *hashtable) {
   printf("=====================\n");
-  for (int i = 0; i < hashtable->num_buckets; i++) {
-    printf("%03d | ", i);
-    hashtable_print_bucket_nodes(hashtable, hashtable->buckets[i]);
+  for (uint64_t i = 0; i < hashtable->num_segments; i++) {
+    struct HashTableSegment *segment = &hashtable->segments[i];
+    printf("%03ld | ", i);
+    hash_index_visit(segment->index, hashtable_print_item, NULL);
+    if (segment->old_index != NULL) {
+      printf("| old ");
+      hash_index_visit(segment->old_index, hashtable_print_item, NULL);
+    }
+    printf("\n");
   }
   printf("=====================\n");
-  printf("=== Key count: %ld\n", hashtable->key_count);
+  printf("=== Key count: %ld\n", hashtable_key_count(hashtable));
   printf("=====================\n");
 }
 
 // Prints the usage queue of the given hashtable to standard output.
 void hashtable_print_usage_queue(struct HashTable *hashtable) {
-  printf("Least used | ");
+  for (uint64_t c = 0; c < hashtable->num_slab_classes; c++) {
+    for (uint64_t i = 0; i < hashtable->num_usage_shards; i++) {
+      printf("%02ld:%03ld | Least used | ", c, i);
+
+      struct UsageShard *shard = hashtable_usage_shard(hashtable, c, i);
+      struct Item *current = shard->main.least_used;
+      while (current != NULL) {
+        printf("[%.*s] ", (int)current->key_size, item_key(current));
+        current = current->more_used;
+      }
+      printf("| Window | ");
+      current = shard->window.least_used;
+      while (current != NULL) {
+        printf("[%.*s] ", (int)current->key_size, item_key(current));
+        current = current->more_used;
+      }
 
-  struct UsageNode *current = hashtable->least_used;
-  while (current != NULL) {
-    printf("[");
-    bounded_data_print(current->bucket_node->key);
-    printf("] ");
-    current = current->more_used;
+      printf("| Most used\n");
+    }
   }
+}
 
-  printf("| Most used\n");
+// Returns the number of shards of the usage queue of the hash table.
+uint64_t hashtable_num_usage_shards(struct HashTable *hashtable) {
+  return hashtable->num_usage_shards;
 }
 
-// De-allocates the memory for all the nodes in the bucket and the bucket
-// itself. De-allocates the memory of all the keys and values in the nodes as
-// well.
-static void hashtable_destroy_bucket(struct HashTable *hashtable,
-                                     int bucket_index) {
-  // Fetch the first node of the bucket.
-  struct BucketNode *current_node = hashtable->buckets[bucket_index];
-  while (current_node != NULL) {
-    struct BucketNode *node_to_destroy = current_node;
-    current_node = current_node->next;
-    bounded_data_destroy(node_to_destroy->key);
-    bounded_data_destroy(node_to_destroy->value);
-    free(node_to_destroy->usage_node);
-    free(node_to_destroy);
+// Returns the number of keys in the given shard of the usage queue of the hash
+// table, adding up the queues of every size class.
+uint64_t hashtable_usage_shard_size(struct HashTable *hashtable,
+                                    uint64_t shard) {
+  uint64_t size = 0;
+  for (uint64_t c = 0; c < hashtable->num_slab_classes; c++) {
+    struct UsageShard *usage_shard = hashtable_usage_shard(hashtable, c, shard);
+    hashtable_usage_acquire(usage_shard);
+    size += usage_shard->main.size + usage_shard->window.size;
+    hashtable_usage_release(usage_shard);
   }
+  return size;
+}
 
-  int rv = pthread_mutex_destroy(hashtable->bucket_mutexes + bucket_index);
-  if (rv != 0) {
-    perror("hashtable_destroy_bucket pthread_mutex_destroy");
-    abort();
-  }
+// De-allocates the memory for the given item.
+static void hashtable_destroy_item(struct Item *item, void *arg) {
+  item_destroy(item);
 }
 
 // De-allocates memory for the hash table and all its keys and values.
 void hashtable_destroy(struct HashTable *hashtable) {
   int rv;
 
-  for (int i = 0; i < hashtable->num_buckets; i++) {
-    // The usage nodes are destroyed when destroying the bucket.
-    hashtable_destroy_bucket(hashtable, i);
+  // Stop the eviction thread before the entries go away.
+  pthread_mutex_lock(&hashtable->evictor_mutex);
+  bool evictor_running = hashtable->evictor_running;
+  __atomic_store_n(&hashtable->evictor_running, false, __ATOMIC_RELAXED);
+  pthread_cond_signal(&hashtable->evictor_cond);
+  pthread_mutex_unlock(&hashtable->evictor_mutex);
+  if (evictor_running) {
+    pthread_join(hashtable->evictor_thread, NULL);
+  }
+  pthread_cond_destroy(&hashtable->evictor_cond);
+  pthread_mutex_destroy(&hashtable->evictor_mutex);
+
+  pthread_mutex_lock(&hashtable->compactor_mutex);
+  bool compactor_running = hashtable->compactor_running;
+  hashtable->compactor_running = false;
+  pthread_cond_signal(&hashtable->compactor_cond);
+  pthread_mutex_unlock(&hashtable->compactor_mutex);
+  if (compactor_running) {
+    pthread_join(hashtable->compactor_thread, NULL);
   }
-  free(hashtable->buckets);
-  free(hashtable->bucket_mutexes);
+  pthread_cond_destroy(&hashtable->compactor_cond);
+  pthread_mutex_destroy(&hashtable->compactor_mutex);
+
+  for (uint64_t i = 0; i < hashtable->num_segments; i++) {
+    // The usage queue is made of the items, so it goes away with them.
+    struct HashTableSegment *segment = &hashtable->segments[i];
+    hash_index_visit(segment->index, hashtable_destroy_item, NULL);
+    hash_index_destroy(segment->index);
+    if (segment->old_index != NULL) {
+      hash_index_visit(segment->old_index, hashtable_destroy_item, NULL);
+      hash_index_destroy(segment->old_index);
+    }
+    rv = pthread_mutex_destroy(&segment->mutex);
+    if (rv != 0) {
+      perror("hashtable_destroy pthread_mutex_destroy");
+      abort();
+    }
+  }
+  free(hashtable->segments);
 
-  rv = pthread_mutex_destroy(hashtable->key_count_mutex);
-  if (rv != 0) {
-    perror("hashtable_destroy pthread_mutex_destroy");
-    abort();
+  free(hashtable->counters);
+
+  for (uint64_t i = 0;
+       i < hashtable->num_slab_classes * hashtable->num_usage_shards; i++) {
+    rv = pthread_mutex_destroy(&hashtable->usage_shards[i].mutex);
+    if (rv != 0) {
+      perror("hashtable_destroy pthread_mutex_destroy3");
+      abort();
+    }
   }
-  free(hashtable->key_count_mutex);
+  free(hashtable->usage_shards);
 
-  rv = pthread_mutex_destroy(hashtable->usage_mutex);
-  if (rv != 0) {
-    perror("hashtable_destroy pthread_mutex_destroy2");
-    abort();
+  for (uint64_t i = 0; i < hashtable->num_usage_shards; i++) {
+    timer_wheel_destroy(&hashtable->timer_wheels[i]);
+  }
+  free(hashtable->timer_wheels);
+
+  if (hashtable->admission_policy == ADMISSION_TINYLFU) {
+    frequency_sketch_destroy(&hashtable->sketch);
   }
-  free(hashtable->usage_mutex);
 
   free(hashtable);
 }
 
 // Returns the number of keys stored in the hash table.
 uint64_t hashtable_key_count(struct HashTable *hashtable) {
-  return hashtable->key_count;
+  int64_t key_count = 0;
+  uint64_t num_used_counters = hashtable_num_used_counters(hashtable);
+  for (uint64_t i = 0; i < num_used_counters; i++) {
+    key_count +=
+        __atomic_load_n(&hashtable->counters[i].key_count, __ATOMIC_RELAXED);
+  }
+  // Keys removed by one thread might be counted before the same keys inserted
+  // by another one.
+  return key_count > 0 ? key_count : 0;
 }
 
-// Evicts the entries from the hash table using a best-effort least recently
-// used order: it starts trying with the least recently used entry and when
-// unsuccessful it continues with the next least recently used entry and so on.
-// If an eviction is successful then HT_FOUND is returned. If all eviction
-// attempts were consumed without a successful eviction then HT_NOTFOUND is
-// returned.
-static int evict_lru(struct HashTable *hashtable) {
-  int remaining_tries = MAX_EVICTION_ATTEMPTS;
+// Returns the number of keys of the hash table that were removed because they
+// expired.
+uint64_t hashtable_expired_count(struct HashTable *hashtable) {
+  int64_t expired_count = 0;
+  uint64_t num_used_counters = hashtable_num_used_counters(hashtable);
+  for (uint64_t i = 0; i < num_used_counters; i++) {
+    expired_count += __atomic_load_n(&hashtable->counters[i].expired_count,
+                                     __ATOMIC_RELAXED);
+  }
+  return expired_count;
+}
+
+// Returns the number of keys of the hash table that were evicted by insertions
+// that ran out of room.
+uint64_t hashtable_foreground_evictions(struct HashTable *hashtable) {
+  int64_t evictions = 0;
+  uint64_t num_used_counters = hashtable_num_used_counters(hashtable);
+  for (uint64_t i = 0; i < num_used_counters; i++) {
+    evictions += __atomic_load_n(&hashtable->counters[i].foreground_evictions,
+                                 __ATOMIC_RELAXED);
+  }
+  return evictions;
+}
+
+// Returns the number of keys of the hash table that were evicted by the
+// eviction thread.
+uint64_t hashtable_background_evictions(struct HashTable *hashtable) {
+  int64_t evictions = 0;
+  uint64_t num_used_counters = hashtable_num_used_counters(hashtable);
+  for (uint64_t i = 0; i < num_used_counters; i++) {
+    evictions += __atomic_load_n(&hashtable->counters[i].background_evictions,
+                                 __ATOMIC_RELAXED);
+  }
+  return evictions;
+}
+
+// Returns the number of keys of the hash table whose value was written to the
+// extension store when they were evicted.
+uint64_t hashtable_spilled_count(struct HashTable *hashtable) {
+  int64_t spilled_count = 0;
+  uint64_t num_used_counters = hashtable_num_used_counters(hashtable);
+  for (uint64_t i = 0; i < num_used_counters; i++) {
+    spilled_count += __atomic_load_n(&hashtable->counters[i].spilled_count,
+                                     __ATOMIC_RELAXED);
+  }
+  return spilled_count;
+}
+
+// Removes a batch of the entries of the hash table that expired, of at most
+// HASH_TABLE_EXPIRATION_BATCH entries. The timer wheels are visited in turns,
+// skipping the ones that another thread is already going through. Returns true
+// if the batch was full, so that there might be more expired entries.
+bool hashtable_expire(struct HashTable *hashtable) {
+  struct Item *expired[HASH_TABLE_EXPIRATION_BATCH];
+  uint64_t num_expired = 0;
+  uint32_t now = timer_wheel_now();
+
+  uint64_t first_wheel = __atomic_fetch_add(&hashtable->expiration_wheel, 1,
+                                            __ATOMIC_RELAXED);
+  for (uint64_t i = 0; i < hashtable->num_usage_shards &&
+                       num_expired < HASH_TABLE_EXPIRATION_BATCH;
+       i++) {
+    struct TimerWheel *wheel =
+        &hashtable->timer_wheels[(first_wheel + i) &
+                                 (hashtable->num_usage_shards - 1)];
+    if (!timer_wheel_due(wheel, now) ||
+        pthread_mutex_trylock(&wheel->mutex) != 0) {
+      continue;
+    }
+    uint64_t count =
+        timer_wheel_expire(wheel, now, expired + num_expired,
+                           HASH_TABLE_EXPIRATION_BATCH - num_expired);
+    // Items in a timer wheel are in the table, so the reference of the table
+    // is still there.
+    for (uint64_t j = num_expired; j < num_expired + count; j++) {
+      item_acquire(expired[j]);
+    }
+    pthread_mutex_unlock(&wheel->mutex);
+    num_expired += count;
+  }
 
-  hashtable_usage_acquire(hashtable);
+  // The segment mutex can't be acquired while holding the one of a timer
+  // wheel, so the entries are removed now, unless they were removed from their
+  // segment in the meantime.
+  for (uint64_t i = 0; i < num_expired; i++) {
+    struct Item *item = expired[i];
+    struct BoundedData key = {item->key_size, item_key(item)};
+    struct HashTableSegment *segment =
+        hashtable_get_segment(hashtable, item->hash);
+
+    hashtable_segment_acquire(segment);
+    hashtable_segment_rehash_step(hashtable, segment);
+    if (hashtable_segment_find(hashtable, segment, &key, item->hash) == item) {
+      hashtable_unlink_item(hashtable, segment, item);
+      hashtable_expired_count_add(hashtable);
+    }
+    hashtable_segment_release(segment);
+    item_release(item);
+  }
 
-  struct UsageNode *victim_usage_node = hashtable->least_used;
+  return num_expired == HASH_TABLE_EXPIRATION_BATCH;
+}
 
-  while (victim_usage_node != NULL && remaining_tries > 0) {
-    uint64_t bucket_index = hashtable_get_bucket_index(
-        hashtable, victim_usage_node->bucket_node->key);
+// Returns the ratio between the memory of the pages of the slab allocator that
+// hold items and the memory taken by the items stored in the hash table, which
+// grows with the chunks left free inside the pages. It's 1 for an empty table.
+double hashtable_fragmentation_ratio(struct HashTable *hashtable) {
+  uint64_t stored_bytes = hashtable_stored_bytes(hashtable);
+  if (stored_bytes == 0) {
+    return 1;
+  }
+  return (double)slab_page_bytes() / stored_bytes;
+}
 
-    if (hashtable_bucket_try_acquire(hashtable, bucket_index)) {
-      // Lock acquisition successful: unlink the victim bucket node from the
-      // hash table's bucket linked to the victim.
-      struct BucketNode *victim_bucket_node = victim_usage_node->bucket_node;
-      struct BucketNode *current_bucket_node = hashtable->buckets[bucket_index];
+// Returns the number of bytes of memory taken by the items stored in the hash
+// table.
+uint64_t hashtable_stored_bytes(struct HashTable *hashtable) {
+  int64_t bytes = __atomic_load_n(&hashtable->stored_bytes, __ATOMIC_RELAXED);
+  uint64_t num_used_counters = hashtable_num_used_counters(hashtable);
+  for (uint64_t i = 0; i < num_used_counters; i++) {
+    bytes += __atomic_load_n(&hashtable->counters[i].pending_bytes,
+                             __ATOMIC_RELAXED);
+  }
+  return bytes > 0 ? bytes : 0;
+}
 
-      // current_bucket_node *shouldn't* be NULL, so we add a log just in case
-      // because something very wrong is happening in that case.
-      if (current_bucket_node == NULL) {
-        printf(
-            "CRITICAL ERROR: trying to evict an entry from an empty bucket\n");
-        hashtable_bucket_release(hashtable, bucket_index);
-        hashtable_usage_release(hashtable);
-        return HT_NOTFOUND;
+// See below: spilling a value reserves memory, which can evict entries.
+static bool hashtable_reserve_memory(struct HashTable *hashtable,
+                                     uint64_t bytes, uint64_t slab_class);
+
+// Allocates an item for the given key that holds the given location of its
+// value in the extension store instead of the value, and that expires when
+// the given item does. The item is allocated without evicting entries, since
+// it's only needed while evicting them, so the caller reserves its bytes in
+// the memory budget when it adds to what the items take. Returns NULL if there
+// is no memory for it.
+static struct Item *hashtable_create_spilled_item(
+    struct Item *item, struct ExtStoreLocation *location) {
+  size_t size =
+      item_size(item->key_size, sizeof(struct ExtStoreLocation), item->expires);
+  struct Item *spilled_item = slab_alloc(size);
+  if (spilled_item == NULL) {
+    return NULL;
+  }
+  item_initialize(spilled_item, item->key_size,
+                  sizeof(struct ExtStoreLocation), item->expires ? 1 : 0);
+  memcpy(item_key(spilled_item), item_key(item), item->key_size);
+  memcpy(item_value(spilled_item), location, sizeof(struct ExtStoreLocation));
+  spilled_item->spilled = true;
+  spilled_item->hash = item->hash;
+  if (item->expires) {
+    item_timer(spilled_item)->expiration = item_timer(item)->expiration;
+  }
+  return spilled_item;
+}
+
+// True if the value of the given item is worth writing to the extension store
+// when it's evicted: only values of at least EXTSTORE_MIN_VALUE_SIZE bytes
+// that are still in memory and didn't expire are written.
+static bool hashtable_spillable(struct Item *item) {
+  return !item->spilled && item->value_size >= EXTSTORE_MIN_VALUE_SIZE &&
+         !item_expired(item);
+}
+
+// Evicts the given item, which the caller holds a reference to, writing its
+// value to the extension store of the hash table first. The value is written
+// while the item is still in the hash table, and the item is only replaced by
+// one with the location of the value if it's still there once the value is
+// written, so that keys removed or stored again in the meantime are left as
+// they are and the record is left behind. The item with the location takes
+// its bytes from the memory budget like any other insertion, and it's the next
+// victim of its shard (see hashtable_add_spilled_item). If the value can't be
+// written or there is no room for that item, the item is evicted without it.
+// Returns the number of bytes freed, which is 0 if the item was no longer in
+// the hash table.
+static uint64_t hashtable_spill_item(struct HashTable *hashtable,
+                                     struct Item *item) {
+  struct ExtStoreLocation location;
+  struct Item *spilled_item = NULL;
+  size_t size =
+      item_size(item->key_size, sizeof(struct ExtStoreLocation), item->expires);
+  if (hashtable_reserve_memory(hashtable, slab_alloc_size(size),
+                               slab_class_for(size)) &&
+      extstore_write(hashtable->extstore, item_key(item), item->key_size,
+                     item_value(item), item->value_size, item->compressed,
+                     &location)) {
+    spilled_item = hashtable_create_spilled_item(item, &location);
+  }
+
+  struct BoundedData key = {item->key_size, item_key(item)};
+  struct HashTableSegment *segment =
+      hashtable_get_segment(hashtable, item->hash);
+  uint64_t freed_bytes = 0;
+  hashtable_segment_acquire(segment);
+  hashtable_segment_rehash_step(hashtable, segment);
+  if (hashtable_segment_find(hashtable, segment, &key, item->hash) == item) {
+    hashtable_unlink_item(hashtable, segment, item);
+    hashtable_eviction_count_add(hashtable, true);
+    freed_bytes = item_memory(item);
+    if (spilled_item != NULL) {
+      hashtable_add_spilled_item(hashtable, segment, spilled_item);
+      hashtable_spilled_count_add(hashtable);
+      freed_bytes -= item_memory(spilled_item);
+      spilled_item = NULL;
+    }
+  }
+  hashtable_segment_release(segment);
+
+  if (spilled_item != NULL) {
+    // The key was removed or stored again while the value was written.
+    item_release(spilled_item);
+  }
+  item_release(item);
+  return freed_bytes;
+}
+
+// True if the given item is one of the given victims whose value is waiting to
+// be spilled.
+static bool hashtable_spill_pending(struct Item **spills, uint64_t num_spills,
+                                    struct Item *item) {
+  for (uint64_t i = 0; i < num_spills; i++) {
+    if (spills[i] == item) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Evicts entries of the given shard of the usage queue until they add up to at
+// least the given number of bytes, using a best-effort least recently used
+// order: it starts trying with the least recently used entry and when
+// unsuccessful it continues with the next least recently used entry and so on,
+// consuming the given eviction attempts. With the CLOCK policy referenced
+// entries are skipped, which clears their bit and moves them to the most used
+// end of the shard. The victims come from the main queue of the shard, or from
+// its admission window when the main queue is empty. A batch of at most
+// MAX_EVICTIONS_PER_OPERATION victims is unlinked while holding the shard
+// mutex, and they are only released once it's dropped. The eviction thread
+// writes the large values of the victims to the extension store, if there is
+// one, so those victims are only referenced while holding the mutex and they
+// are spilled once it's dropped, see hashtable_spill_item. Returns the number
+// of bytes freed, which is 0 if the attempts were consumed, the shard ran out
+// of entries or the usage queue and the segments disagree.
+static uint64_t evict_lru_from_shard(struct HashTable *hashtable,
+                                     struct UsageShard *shard, uint64_t bytes,
+                                     bool background, int *remaining_tries) {
+  struct Item *victims[MAX_EVICTIONS_PER_OPERATION];
+  uint64_t num_victims = 0;
+  struct Item *spills[MAX_EVICTIONS_PER_OPERATION];
+  uint64_t num_spills = 0;
+  uint64_t freed_bytes = 0;
+
+  hashtable_usage_acquire(shard);
+
+  struct UsageQueue *queue =
+      shard->main.size > 0 ? &shard->main : &shard->window;
+  struct Item *victim = queue->least_used;
+
+  // Every entry gets at most one second chance per call, so that the hand
+  // stops after going around the whole queue once.
+  uint64_t remaining_chances = queue->size;
+
+  while (victim != NULL && *remaining_tries > 0 && freed_bytes < bytes &&
+         num_victims + num_spills < MAX_EVICTIONS_PER_OPERATION) {
+    if (hashtable->eviction_policy == EVICTION_CLOCK && remaining_chances > 0 &&
+        __atomic_load_n(&victim->referenced, __ATOMIC_RELAXED)) {
+      // Used since the hand last went by: give it a second chance.
+      struct Item *next = victim->more_used;
+      __atomic_store_n(&victim->referenced, false, __ATOMIC_RELAXED);
+      hashtable_remove_from_usage(queue, victim);
+      hashtable_insert_as_most_used(queue, victim);
+      remaining_chances--;
+
+      // If it was the most used one, the hand goes back to the least used.
+      victim = next != NULL ? next : queue->least_used;
+      continue;
+    }
+    if (background && hashtable->extstore != NULL &&
+        hashtable_spillable(victim)) {
+      // Its value is written to the extension store before it's unlinked, so
+      // it stays in the hash table and the usage queue for now, where the hand
+      // can reach it again after going back to the least used entry.
+      if (hashtable_spill_pending(spills, num_spills, victim)) {
+        victim = victim->more_used;
+        continue;
       }
+      item_acquire(victim);
+      spills[num_spills++] = victim;
+      freed_bytes += item_memory(victim);
+      victim = victim->more_used;
+      continue;
+    }
+    struct HashTableSegment *segment =
+        hashtable_get_segment(hashtable, victim->hash);
 
-      if (current_bucket_node == victim_bucket_node) {
-        // The victim is the first link in the bucket.
-        hashtable->buckets[bucket_index] = victim_bucket_node->next;
-      } else {
-        // The victim is not the first link in the bucket, find its previous
-        // node.
-        while (current_bucket_node->next != victim_bucket_node) {
-          current_bucket_node = current_bucket_node->next;
-        }
-        // Now current_bucket_node holds the previous node, so we can unlink the
-        // victim node.
-        current_bucket_node->next = victim_bucket_node->next;
+    if (!hashtable_segment_try_acquire(segment)) {
+      // The segment for the current victim is acquired so try with the next
+      // least used item in the shard.
+      victim = victim->more_used;
+
+      // Update the number of eviction attempts.
+      (*remaining_tries)--;
+      continue;
+    }
+
+    // Lock acquisition successful: unlink the victim from its segment. The
+    // victim *should* be in the segment, so we add a log just in case because
+    // something very wrong is happening otherwise.
+    if (!hashtable_segment_remove(hashtable, segment, victim)) {
+      fprintf(stderr, "evict_lru_from_shard: trying to evict an entry that is "
+                      "not in its segment\n");
+      hashtable_segment_release(segment);
+      *remaining_tries = 0;
+      break;
+    }
+
+    hashtable_timer_remove(hashtable, victim);
+
+    // We're done working with the segment, so we can release the lock.
+    hashtable_segment_release(segment);
+
+    // Remove the victim from the usage queue, and go on with the next one.
+    struct Item *next = victim->more_used;
+    hashtable_remove_from_usage(queue, victim);
+    victim->queue = ITEM_QUEUE_NONE;
+    victims[num_victims++] = victim;
+    freed_bytes += item_memory(victim);
+    victim = next;
+  }
+
+  // We're done working with the usage queue, so we can release the lock.
+  hashtable_usage_release(shard);
+
+  // Free the victims once no lock-free lookup can be reading them. Their memory
+  // stops counting towards the budget right away, so that evictions to get
+  // under the watermarks don't wait for the epochs.
+  uint64_t victim_bytes = 0;
+  for (uint64_t i = 0; i < num_victims; i++) {
+    victim_bytes += item_memory(victims[i]);
+    epoch_retire(hashtable_release_item, victims[i]);
+    hashtable_eviction_count_add(hashtable, background);
+  }
+  hashtable_stored_bytes_add(hashtable, -(int64_t)victim_bytes);
+  hashtable_key_count_add(hashtable, -(int64_t)num_victims);
+
+  // Only the eviction thread spills values, so that insertions never wait for
+  // the disk.
+  for (uint64_t i = 0; i < num_spills; i++) {
+    victim_bytes += hashtable_spill_item(hashtable, spills[i]);
+  }
+
+  return victim_bytes;
+}
+
+// Evicts entries from the hash table until they add up to at least the given
+// number of bytes, starting with the usage queue of the given size class. When
+// the class has nothing left to evict, the queues of the other classes are
+// tried in order: their chunks don't fit the allocation that needs room, but
+// their pages go back to every class once they're empty. The shards of each
+// queue are tried in round-robin order, starting from a different one on every
+// call so that evictions are spread evenly across them. The evictions are
+// counted as made by the eviction thread if the given flag is set. Returns the
+// number of bytes freed, which is less than the requested ones if all eviction
+// attempts were consumed first.
+static uint64_t evict_lru(struct HashTable *hashtable, uint64_t first_class,
+                          uint64_t bytes, bool background) {
+  int remaining_tries = MAX_EVICTION_ATTEMPTS;
+  uint64_t freed_bytes = 0;
+  uint64_t first_shard =
+      __atomic_fetch_add(&hashtable->eviction_shard, 1, __ATOMIC_RELAXED);
+
+  for (uint64_t c = 0; c < hashtable->num_slab_classes && remaining_tries > 0;
+       c++) {
+    uint64_t slab_class = (first_class + c) % hashtable->num_slab_classes;
+    for (uint64_t i = 0;
+         i < hashtable->num_usage_shards && remaining_tries > 0; i++) {
+      struct UsageShard *shard = hashtable_usage_shard(
+          hashtable, slab_class,
+          (first_shard + i) & (hashtable->num_usage_shards - 1));
+      // A shard might give up before the end of its queue after a batch, so
+      // it's tried again until it has nothing else to give.
+      uint64_t shard_bytes;
+      do {
+        shard_bytes =
+            evict_lru_from_shard(hashtable, shard, bytes - freed_bytes,
+                                 background, &remaining_tries);
+        freed_bytes += shard_bytes;
+      } while (shard_bytes > 0 && freed_bytes < bytes);
+      if (freed_bytes >= bytes) {
+        return freed_bytes;
       }
+    }
+  }
 
-      // We're done working with the bucket, so we can release the lock.
-      hashtable_bucket_release(hashtable, bucket_index);
+  return freed_bytes;
+}
 
-      // Remove the least used node from the usage queue.
-      hashtable_remove_usage_node(hashtable, victim_usage_node);
+// Allocates memory of the given size with the given function, evicting
+// batches of entries that add up to that size (starting with the given size
+// class) until the memory is successfully allocated. Freed chunks only make
+// room for other classes once their whole page is free, so it gives up when
+// nothing is left to evict or when the entries evicted add up to the whole
+// memory budget. Returns a pointer to the allocated space if successful or NULL
+// if it wasn't possible to allocate memory.
+static void *hashtable_alloc_evict(struct HashTable *hashtable,
+                                   void *(*alloc)(size_t size), size_t size,
+                                   uint64_t slab_class) {
+  uint64_t evicted_bytes = 0;
+
+  while (true) {
+    void *ptr = alloc(size);
+    if (ptr != NULL) {
+      // Success!
+      return ptr;
+    }
+    if (evicted_bytes >= hashtable->memory_budget) {
+      fprintf(stderr, "hashtable_alloc_evict: evicted the whole budget without "
+                      "making room for %lu bytes\n",
+              (uint64_t)size);
+      return NULL;
+    }
+    // Running out of entries to evict is the ordinary way of running out of
+    // memory, which the caller reports.
+    uint64_t freed_bytes = evict_lru(hashtable, slab_class, size, false);
+    if (freed_bytes == 0) {
+      return NULL;
+    }
+    evicted_bytes += freed_bytes;
+    // The evicted entries are freed through epochs, free them right away if no
+    // lock-free lookup can be reading them. Keep trying.
+    epoch_reclaim();
+  }
+}
 
-      // We're done working with the usage queue, so we can release the lock.
-      hashtable_usage_release(hashtable);
+// Performs hashtable evictions until the memory is successfully allocated.
+// Returns a pointer to the allocated space if successful or NULL if it wasn't
+// possible to allocate memory.
+void *hashtable_malloc_evict(struct HashTable *hashtable, size_t size) {
+  // The memory of the connections and the indexes is not part of the budget of
+  // the items, so this only evicts when the system itself runs out of memory.
+  // Items live in the slab allocator, whose memory only goes back to the
+  // system a page at a time, so start evicting from the large class: every
+  // large item gives back whole pages.
+  return hashtable_alloc_evict(hashtable, malloc, size,
+                               hashtable->num_slab_classes - 1);
+}
 
-      // Free the memory that is no longer used: the victim bucket node's key
-      // and value, the victim bucket node and the least used usage queue node.
-      bounded_data_destroy(victim_bucket_node->key);
-      bounded_data_destroy(victim_bucket_node->value);
-      free(victim_bucket_node);
-      free(victim_usage_node);
+// Returns the size class whose items take the most memory, which is where the
+// eviction thread evicts from: the usage queues are per class, so there is no
+// global least used entry to pick.
+static uint64_t hashtable_largest_class(struct HashTable *hashtable) {
+  uint64_t largest_class = 0;
+  uint64_t largest_bytes = 0;
+  for (uint64_t c = 0; c < hashtable->num_slab_classes; c++) {
+    struct SlabClassStats stats;
+    slab_class_stats(c, &stats);
+    uint64_t bytes = stats.chunk_size == 0
+                         ? stats.num_pages * SLAB_PAGE_SIZE
+                         : stats.used_chunks * stats.chunk_size;
+    if (bytes > largest_bytes) {
+      largest_class = c;
+      largest_bytes = bytes;
+    }
+  }
+  return largest_class;
+}
 
-      // Lastly, decrease the number of keys because we just removed an element!
-      hashtable_key_count_acquire(hashtable);
-      hashtable->key_count--;
-      hashtable_key_count_release(hashtable);
+// Body of the eviction thread of the given hash table. While the items take
+// more than the low watermark it evicts entries that add up to the excess, or
+// to HASH_TABLE_EVICTOR_MIN_BYTES if it's smaller, and otherwise it waits
+// until an insertion wakes it up, or for HASH_TABLE_EVICTOR_INTERVAL_MS in case
+// the wake-up was missed. It also waits when nothing could be evicted, like
+// when every segment it tried was busy, instead of trying again right away.
+static void *hashtable_evictor(void *arg) {
+  struct HashTable *hashtable = arg;
+  bool evicted = true;
+
+  epoch_register();
+
+  pthread_mutex_lock(&hashtable->evictor_mutex);
+  while (hashtable->evictor_running) {
+    uint64_t stored_bytes = hashtable_stored_bytes(hashtable);
+    if (stored_bytes <= hashtable->low_watermark || !evicted) {
+      evicted = true;
+      struct timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_nsec += HASH_TABLE_EVICTOR_INTERVAL_MS * 1000000L;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+      __atomic_store_n(&hashtable->evictor_idle, true, __ATOMIC_RELAXED);
+      pthread_cond_timedwait(&hashtable->evictor_cond,
+                             &hashtable->evictor_mutex, &deadline);
+      __atomic_store_n(&hashtable->evictor_idle, false, __ATOMIC_RELAXED);
+      continue;
+    }
+    pthread_mutex_unlock(&hashtable->evictor_mutex);
 
-      // Return HT_FOUND to signal that a victim was successfully found and
-      // evicted.
-      return HT_FOUND;
+    uint64_t bytes = stored_bytes - hashtable->low_watermark;
+    if (bytes < HASH_TABLE_EVICTOR_MIN_BYTES) {
+      bytes = HASH_TABLE_EVICTOR_MIN_BYTES;
     }
+    evicted = evict_lru(hashtable, hashtable_largest_class(hashtable), bytes,
+                        true) > 0;
+    // Free the evicted entries right away if no lock-free lookup can be
+    // reading them, so that their pages go back to the slab allocator.
+    epoch_reclaim();
+
+    pthread_mutex_lock(&hashtable->evictor_mutex);
+  }
+  pthread_mutex_unlock(&hashtable->evictor_mutex);
+
+  epoch_unregister();
+  return NULL;
+}
+
+// Starts a thread that evicts entries of the given hash table ahead of the
+// insertions, whenever the items take more than the low watermark of the memory
+// budget. The thread runs until the hash table is destroyed.
+void hashtable_start_evictor(struct HashTable *hashtable) {
+  __atomic_store_n(&hashtable->evictor_running, true, __ATOMIC_RELAXED);
+  int rv = pthread_create(&hashtable->evictor_thread, NULL, hashtable_evictor,
+                          hashtable);
+  if (rv != 0) {
+    perror("hashtable_start_evictor pthread_create");
+    abort();
+  }
+}
+
+// Puts the given copy of an item, which takes the same memory, in the place of
+// the item in the given segment, its usage queue and its timer wheel, and
+// releases the item once no lock-free lookup can be reading it. Lookups find
+// either of them, and responses that hold the item keep it until they're done.
+// Assumes that the segment mutex is acquired.
+static void hashtable_swap_item(struct HashTable *hashtable,
+                                struct HashTableSegment *segment,
+                                struct Item *item, struct Item *copy) {
+  hashtable_segment_replace(hashtable, segment, item, copy);
+
+  struct UsageShard *shard = hashtable_get_usage_shard(hashtable, item);
+  hashtable_usage_acquire(shard);
+  hashtable_replace_in_usage(hashtable_item_queue(shard, item), item, copy);
+  hashtable_usage_release(shard);
+
+  hashtable_timer_remove(hashtable, item);
+  hashtable_timer_add(hashtable, copy);
+  epoch_retire(hashtable_release_item, item);
+}
 
-    // The bucket node for the current victim usage node is acquired so try with
-    // the next least used node in the usage queue.
-    victim_usage_node = victim_usage_node->more_used;
+// Returns the item of the hash table with the given key if it holds the given
+// location of its value in the extension store, NULL otherwise. Assumes that
+// the segment mutex is acquired.
+static struct Item *
+hashtable_find_spilled(struct HashTable *hashtable,
+                       struct HashTableSegment *segment,
+                       struct BoundedData *key, uint64_t key_hash,
+                       struct ExtStoreLocation *location) {
+  struct Item *item = hashtable_segment_find(hashtable, segment, key, key_hash);
+  if (item == NULL || !item->spilled) {
+    return NULL;
+  }
+  // The value starts right after the key, so it's not necessarily aligned.
+  struct ExtStoreLocation item_location;
+  memcpy(&item_location, item_value(item), sizeof(item_location));
+  if (item_location.offset != location->offset ||
+      item_location.generation != location->generation) {
+    return NULL;
+  }
+  return item;
+}
 
-    // Update the number of eviction attempts.
-    remaining_tries--;
+// Removes the item of the hash table with the given key if it holds the given
+// location of its value in the extension store, counting it as evicted by the
+// eviction thread.
+static void hashtable_drop_spilled(struct HashTable *hashtable,
+                                   struct BoundedData *key, uint64_t key_hash,
+                                   struct ExtStoreLocation *location) {
+  struct HashTableSegment *segment = hashtable_get_segment(hashtable, key_hash);
+  hashtable_segment_acquire(segment);
+  struct Item *item =
+      hashtable_find_spilled(hashtable, segment, key, key_hash, location);
+  if (item != NULL) {
+    hashtable_unlink_item(hashtable, segment, item);
+    hashtable_eviction_count_add(hashtable, true);
   }
+  hashtable_segment_release(segment);
+}
 
-  // At this point we either ran out of eviction attempts or we consumed all the
-  // usage queue.
-  // We can release the usage queue mutex.
-  hashtable_usage_release(hashtable);
+// Handles a record of a segment of the extension store that is being
+// compacted, see extstore_compact. Records whose key still points to them are
+// written again and the key is pointed to the copy, if the given flag allows
+// it, or the key is removed otherwise. Returns true if the record was written
+// again.
+static bool hashtable_rescue_record(void *arg, struct ExtStoreRecord *record,
+                                    bool keep) {
+  struct HashTable *hashtable = arg;
+  struct BoundedData key = {record->key_size, (char *)record->key};
+  uint64_t key_hash = bounded_data_hash(&key);
+  struct HashTableSegment *segment = hashtable_get_segment(hashtable, key_hash);
+
+  // Records that no key points to anymore are just left behind.
+  hashtable_segment_acquire(segment);
+  bool live = hashtable_find_spilled(hashtable, segment, &key, key_hash,
+                                     &record->location) != NULL;
+  hashtable_segment_release(segment);
+  if (!live) {
+    return false;
+  }
 
-  // Just in case, we log a message when we run out of nodes in the usage queue.
-  if (victim_usage_node == NULL) {
-    printf("CRITICAL ERROR: ran out of usage nodes to evict!\n");
+  struct ExtStoreLocation location;
+  if (!keep || !extstore_write(hashtable->extstore, record->key,
+                               record->key_size, record->value,
+                               record->location.value_size,
+                               record->location.compressed, &location)) {
+    hashtable_drop_spilled(hashtable, &key, key_hash, &record->location);
+    return false;
   }
 
-  return HT_NOTFOUND;
+  // The key might have changed while the record was written again, in which
+  // case the copy is left behind as well.
+  hashtable_segment_acquire(segment);
+  struct Item *item = hashtable_find_spilled(hashtable, segment, &key,
+                                             key_hash, &record->location);
+  struct Item *copy =
+      item != NULL ? hashtable_create_spilled_item(item, &location) : NULL;
+  if (copy != NULL) {
+    hashtable_swap_item(hashtable, segment, item, copy);
+  } else if (item != NULL) {
+    hashtable_unlink_item(hashtable, segment, item);
+    hashtable_eviction_count_add(hashtable, true);
+  }
+  hashtable_segment_release(segment);
+  return copy != NULL;
 }
 
-// Performs hashtable evictions until the maximum evictions per operation is
-// reached or until the memory is successfully allocated. Returns a pointer to
-// the allocated space if successful or NULL if it wasn't possible to allocate
-// memory.
-void *hashtable_malloc_evict(struct HashTable *hashtable, size_t size) {
-  int remaining_evictions = MAX_EVICTIONS_PER_OPERATION;
-  void *ptr = NULL;
-  int rv;
+// Makes the eviction thread of the given hash table write the values of at
+// least EXTSTORE_MIN_VALUE_SIZE bytes that it evicts to the given extension
+// store, keeping an entry with their location in their place, and makes the
+// compaction thread compact the store. Must be called before starting them.
+void hashtable_set_extstore(struct HashTable *hashtable,
+                            struct ExtStore *extstore) {
+  hashtable->extstore = extstore;
+}
+
+// Moves the given item, which the caller holds a reference to, to a new chunk
+// of the slab allocator, if it's still in the hash table. The copy takes the
+// place of the item, see hashtable_swap_item. Returns true if the item was
+// moved.
+static bool hashtable_relocate_item(struct HashTable *hashtable,
+                                    struct Item *item) {
+  struct BoundedData key = {item->key_size, item_key(item)};
+  struct HashTableSegment *segment =
+      hashtable_get_segment(hashtable, item->hash);
+
+  hashtable_segment_acquire(segment);
+  if (hashtable_segment_find(hashtable, segment, &key, item->hash) != item) {
+    // Removed or replaced in the meantime.
+    hashtable_segment_release(segment);
+    return false;
+  }
+  size_t size = item_size(item->key_size, item->value_size, item->expires);
+  struct Item *copy = slab_alloc(size);
+  if (copy == NULL) {
+    hashtable_segment_release(segment);
+    return false;
+  }
+
+  // Only the links and the reference count of an item in the table change,
+  // and they're set below.
+  memcpy(copy, item, size);
+  copy->refcount = 1;
+  hashtable_swap_item(hashtable, segment, item, copy);
+
+  hashtable_segment_release(segment);
+  return true;
+}
+
+// Compacts the items of the given size class: picks the pages worth compacting
+// and moves the items stored in them to the other pages of the class.
+static void hashtable_compact_class(struct HashTable *hashtable,
+                                    uint64_t slab_class) {
+  void *pages[HASH_TABLE_COMPACTION_PAGES];
+  uint64_t num_pages =
+      slab_compaction_begin(slab_class, pages, HASH_TABLE_COMPACTION_PAGES);
+  if (num_pages == 0) {
+    return;
+  }
 
-  do {
-    ptr = malloc(size);
-    if (ptr == NULL) {
-      rv = evict_lru(hashtable);
-      if (rv == HT_NOTFOUND) {
-        printf("CRITICAL ERROR (hashtable_malloc_evict): couldn't successfully "
-               "evict a hash table entry\n");
-        return NULL;
+  // The pages hold chunks that aren't items of the table yet, or anymore, so
+  // the items to move are found through the usage queues instead, which only
+  // hold items of the table.
+  uint64_t capacity = 1024;
+  struct Item **items = malloc(sizeof(struct Item *) * capacity);
+  if (items == NULL) {
+    slab_compaction_end(slab_class, pages, num_pages);
+    return;
+  }
+  for (uint64_t i = 0; i < hashtable->num_usage_shards; i++) {
+    struct UsageShard *shard = hashtable_usage_shard(hashtable, slab_class, i);
+    uint64_t num_items = 0;
+
+    hashtable_usage_acquire(shard);
+    struct UsageQueue *queues[] = {&shard->main, &shard->window};
+    for (int q = 0; q < 2; q++) {
+      for (struct Item *item = queues[q]->least_used; item != NULL;
+           item = item->more_used) {
+        if (!slab_in_pages(item, pages, num_pages)) {
+          continue;
+        }
+        if (num_items == capacity) {
+          struct Item **grown =
+              realloc(items, sizeof(struct Item *) * capacity * 2);
+          if (grown == NULL) {
+            break;
+          }
+          items = grown;
+          capacity *= 2;
+        }
+        // Items in a usage queue are in the table, so the reference of the
+        // table is still there.
+        item_acquire(item);
+        items[num_items++] = item;
       }
-      // Keep trying
-      remaining_evictions--;
+    }
+    hashtable_usage_release(shard);
+
+    for (uint64_t j = 0; j < num_items; j++) {
+      hashtable_relocate_item(hashtable, items[j]);
+      item_release(items[j]);
+    }
+  }
+  free(items);
+
+  // The pages go back as soon as the moved items are freed. The ones that
+  // still hold items that couldn't be moved take allocations again.
+  slab_compaction_end(slab_class, pages, num_pages);
+}
+
+// Body of the compaction thread of the given hash table, which compacts every
+// size class every HASH_TABLE_COMPACTION_INTERVAL_MS.
+static void *hashtable_compactor(void *arg) {
+  struct HashTable *hashtable = arg;
+
+  epoch_register();
+
+  pthread_mutex_lock(&hashtable->compactor_mutex);
+  while (hashtable->compactor_running) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += HASH_TABLE_COMPACTION_INTERVAL_MS * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    if (pthread_cond_timedwait(&hashtable->compactor_cond,
+                               &hashtable->compactor_mutex,
+                               &deadline) != ETIMEDOUT) {
       continue;
     }
-    // Success!
-    return ptr;
-  } while (remaining_evictions > 0);
+    pthread_mutex_unlock(&hashtable->compactor_mutex);
 
-  printf("CRITICAL ERROR: Eviction failure! All evictions per operation "
-         "depleted\n");
+    for (uint64_t c = 0; c < hashtable->num_slab_classes; c++) {
+      hashtable_compact_class(hashtable, c);
+    }
+    // Keep EXTSTORE_MIN_FREE_SEGMENTS segments of the extension store free
+    // for the values evicted until the next pass.
+    while (hashtable->extstore != NULL &&
+           extstore_compact(hashtable->extstore, hashtable_rescue_record,
+                            hashtable)) {
+    }
+    // Free the moved items right away if no lock-free lookup can be reading
+    // them, so that their pages go back to the system.
+    epoch_reclaim();
+
+    pthread_mutex_lock(&hashtable->compactor_mutex);
+  }
+  pthread_mutex_unlock(&hashtable->compactor_mutex);
+
+  epoch_unregister();
   return NULL;
 }
 
+// Starts a thread that compacts the items of the given hash table every
+// HASH_TABLE_COMPACTION_INTERVAL_MS: the items in the sparsest pages of each
+// size class are moved to the free chunks of the other pages of the class, so
+// that the emptied pages go back to the system and to the other classes. The
+// thread runs until the hash table is destroyed.
+void hashtable_start_compactor(struct HashTable *hashtable) {
+  hashtable->compactor_running = true;
+  int rv = pthread_create(&hashtable->compactor_thread, NULL,
+                          hashtable_compactor, hashtable);
+  if (rv != 0) {
+    perror("hashtable_start_compactor pthread_create");
+    abort();
+  }
+}
+
+// Wakes the eviction thread of the given hash table up if it's waiting.
+static void hashtable_wake_evictor(struct HashTable *hashtable) {
+  if (!__atomic_load_n(&hashtable->evictor_idle, __ATOMIC_RELAXED)) {
+    return;
+  }
+  pthread_mutex_lock(&hashtable->evictor_mutex);
+  pthread_cond_signal(&hashtable->evictor_cond);
+  pthread_mutex_unlock(&hashtable->evictor_mutex);
+}
+
+// Makes room in the memory budget of the hash table for an item that takes the
+// given number of bytes. Once the items take more than the low watermark the
+// eviction thread is woken up to evict entries ahead of the insertions. Only
+// if storing the item would take the items over the high watermark anyway,
+// entries are evicted right away (starting with the given size class) until
+// they would be under it, or under the low watermark when there is no eviction
+// thread. Returns false if the item doesn't fit in the budget.
+static bool hashtable_reserve_memory(struct HashTable *hashtable,
+                                     uint64_t bytes, uint64_t slab_class) {
+  if (bytes > hashtable->memory_budget) {
+    return false;
+  }
+  uint64_t stored_bytes = hashtable_stored_bytes_estimate(hashtable);
+  if (stored_bytes + bytes <= hashtable->low_watermark) {
+    return true;
+  }
+  hashtable_wake_evictor(hashtable);
+  if (stored_bytes + bytes <= hashtable->high_watermark) {
+    return true;
+  }
+
+  // Evict the whole excess at once, in as few batches as possible.
+  bool evictor_running =
+      __atomic_load_n(&hashtable->evictor_running, __ATOMIC_RELAXED);
+  uint64_t target =
+      evictor_running ? hashtable->high_watermark : hashtable->low_watermark;
+  stored_bytes = hashtable_stored_bytes_estimate(hashtable);
+  while (stored_bytes + bytes > target &&
+         evict_lru(hashtable, slab_class, stored_bytes + bytes - target,
+                   false) > 0) {
+    stored_bytes = hashtable_stored_bytes_estimate(hashtable);
+  }
+  // Free the evicted entries right away if no lock-free lookup can be reading
+  // them, so that their pages go back to the slab allocator.
+  epoch_reclaim();
+
+  // Other insertions might have taken the room in the meantime, or the
+  // evictions might have given up before the low watermark. Either way, the
+  // budget itself is the hard limit.
+  return hashtable_stored_bytes_estimate(hashtable) + bytes <=
+         hashtable->memory_budget;
+}
+
+// Allocates an item with room for a key and a value of the given sizes, which
+// expires after the given number of seconds (never if it's 0), evicting entries
+// if storing it would take the items over the high watermark of the memory
+// budget or if there is not enough memory. Returns NULL if it wasn't possible
+// to make room for it. The caller copies the key and the value into the item
+// (see item_key and item_value) before inserting it.
+struct Item *hashtable_create_item(struct HashTable *hashtable,
+                                   uint64_t key_size, uint64_t value_size,
+                                   uint32_t ttl) {
+  if (key_size > ITEM_MAX_DATA_SIZE || value_size > ITEM_MAX_DATA_SIZE) {
+    return NULL;
+  }
+
+  // Evict from the size class of the item first, since the memory freed there
+  // fits the item. The budget is checked before allocating, but the slab
+  // allocator can still run out of pages when other classes hold them.
+  size_t size = item_size(key_size, value_size, ttl != 0);
+  uint64_t slab_class = slab_class_for(size);
+  if (!hashtable_reserve_memory(hashtable, slab_alloc_size(size),
+                                slab_class)) {
+    return NULL;
+  }
+  struct Item *item =
+      hashtable_alloc_evict(hashtable, slab_alloc, size, slab_class);
+  if (item == NULL) {
+    return NULL;
+  }
+  item_initialize(item, key_size, value_size, ttl);
+  return item;
+}
+
 // Tries to allocate memory for a BoundedData struct and a buffer of the given
 // size. If it fails return NULL, otherwise return a pointer to the BoundedData
-// struct. If buffer_size is 0, the bounded data struct will be uninitialized.
+// struct. If buffer_size is 0, the bounded data struct has no buffer.
 struct BoundedData *
 hashtable_malloc_evict_bounded_data(struct HashTable *hashtable,
                                     size_t buffer_size) {
@@ -625,11 +2042,12 @@ hashtable_malloc_evict_bounded_data(struct HashTable *hashtable,
     return NULL;
   }
 
+  bounded_data->size = buffer_size;
+  bounded_data->data = NULL;
   if (buffer_size == 0) {
     return bounded_data;
   }
 
-  bounded_data->size = buffer_size;
   bounded_data->data = hashtable_malloc_evict(hashtable, buffer_size);
   if (bounded_data->data == NULL) {
     free(bounded_data);
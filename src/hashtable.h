@@ -2,102 +2,294 @@
 #define __HASHTABLE_H__
 
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "bounded_data.h"
+#include "extstore.h"
+#include "frequency_sketch.h"
+#include "item.h"
+#include "timer_wheel.h"
 
 #define HT_FOUND 1
 #define HT_NOTFOUND 2
 #define HT_ERROR 3
 
-struct BucketNode {
-  struct BucketNode *next;
-  struct BoundedData *key;
-  struct BoundedData *value;
-  struct UsageNode *usage_node;
+// Policies to pick the entries that are evicted when memory runs out.
+enum EvictionPolicy {
+  // Strict least recently used: every hit moves the entry to the most used end
+  // of its usage queue shard.
+  EVICTION_LRU,
+  // Second chance (CLOCK): a hit only sets the reference bit of the entry. The
+  // eviction hand goes through the shard from the least used end, clearing the
+  // bits and sending referenced entries back to the most used end, and evicts
+  // the first entry that wasn't referenced.
+  EVICTION_CLOCK,
 };
 
-struct UsageNode {
-  struct BucketNode *bucket_node;
-  struct UsageNode *more_used;
-  struct UsageNode *less_used;
+// Policies to decide whether new entries are worth the entries they displace.
+enum AdmissionPolicy {
+  // Every new entry is admitted, and the entries are evicted in the order of
+  // the eviction policy.
+  ADMISSION_ALL,
+  // W-TinyLFU: new entries go to a small admission window first. The least
+  // used entry of a window that outgrows its share of the shard only moves on
+  // to the main queue as the most used entry if its key is estimated to be
+  // more popular than the next victim of the main queue. Otherwise it becomes
+  // the next victim itself, so that a flood of keys that are used once doesn't
+  // evict the entries that are used all the time.
+  ADMISSION_TINYLFU,
+};
+
+// A least recently used queue made of the links embedded in the items.
+struct UsageQueue {
+  struct Item *most_used;
+  struct Item *least_used;
+  uint64_t size; // Number of items in the queue.
+};
+
+// A shard of the usage queue. Keys are spread across the shards by hash and
+// each shard is an independent least recently used queue with its own mutex,
+// so that operations on keys of different shards don't contend.
+struct UsageShard {
+  pthread_mutex_t mutex;
+  struct UsageQueue main;
+  struct UsageQueue window; // Only used by the TinyLFU admission policy.
+};
+
+#define CACHE_LINE_SIZE 64
+
+// Counters of the keys and of the memory of the items of a hash table updated
+// by a thread. Padded to a cache line so that threads updating their counters
+// don't invalidate each other's caches. They're only added up when the totals
+// are requested, and can go negative when a thread removes keys inserted by
+// another one.
+struct HashTableCounters {
+  int64_t key_count;
+  int64_t expired_count;
+  int64_t foreground_evictions; // Made by insertions that ran out of room.
+  int64_t background_evictions; // Made by the eviction thread.
+  int64_t spilled_count;        // Evicted keys whose value is in the extstore.
+  // Bytes added (or subtracted) by the thread that aren't part of the shared
+  // total of the table yet.
+  int64_t pending_bytes;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct HashIndex;
+
+// A segment of the hash table. Each segment owns an independent index of its
+// keys protected by its own mutex, so that it can grow without pausing the rest
+// of the table. While a segment is growing it keeps its previous index around
+// and moves a few positions of it into the new one on every write operation.
+// Lookups don't acquire the mutex: writers make the sequence number odd while
+// they move or remove items, so that a lookup that didn't find its key can tell
+// whether it might have missed it.
+struct HashTableSegment {
+  pthread_mutex_t mutex;
+  uint64_t sequence; // Odd while a writer moves or removes items.
+
+  struct HashIndex *index;     // Current index.
+  struct HashIndex *old_index; // Old index, NULL if not growing.
+  uint64_t rehash_position;    // Next position of the old index to be moved.
+
+  uint64_t key_count; // Number of keys stored in the segment.
 };
 
 struct HashTable {
-  uint64_t num_buckets;
-  struct BucketNode **buckets;
-  pthread_mutex_t *bucket_mutexes;
+  uint64_t num_segments;
+  uint64_t segment_bits; // log2(num_segments).
+  struct HashTableSegment *segments;
+
+  uint64_t num_counters; // Slots of the per-thread counters.
+  struct HashTableCounters *counters;
+
+  // Memory budget for the items, in bytes. Once the items take more than the
+  // low watermark, the eviction thread evicts entries until they're under it
+  // again. Insertions only evict entries themselves when the items would take
+  // more than the high watermark anyway.
+  uint64_t memory_budget;
+  uint64_t high_watermark;
+  uint64_t low_watermark;
+  // Memory taken by the items in the table, except for the bytes pending in the
+  // per-thread counters.
+  int64_t stored_bytes;
+
+  enum EvictionPolicy eviction_policy;
+  enum AdmissionPolicy admission_policy;
+  // Frequency of the keys, only used by the TinyLFU admission policy.
+  struct FrequencySketch sketch;
+  uint64_t num_slab_classes; // Each of them has its own usage queue.
+  uint64_t num_usage_shards; // Shards of the usage queue of each class.
+  struct UsageShard *usage_shards;
+  uint64_t eviction_shard; // Shard where the next eviction starts looking.
+
+  // Timer wheels of the items that expire, one per shard of the usage queue.
+  struct TimerWheel *timer_wheels;
+  uint64_t expiration_wheel; // Wheel where the next expiration starts.
+
+  // Eviction thread, see hashtable_start_evictor. The flags are written while
+  // holding the mutex and read atomically without it by insertions, which
+  // signal the condition variable when the items go over the low watermark
+  // while the thread is idle.
+  pthread_t evictor_thread;
+  pthread_mutex_t evictor_mutex;
+  pthread_cond_t evictor_cond;
+  bool evictor_running;
+  bool evictor_idle;
 
-  uint64_t key_count;
-  pthread_mutex_t *key_count_mutex;
+  // Compaction thread, see hashtable_start_compactor. The mutex protects the
+  // flag, and the condition variable wakes the thread up to stop it.
+  pthread_t compactor_thread;
+  pthread_mutex_t compactor_mutex;
+  pthread_cond_t compactor_cond;
+  bool compactor_running;
 
-  struct UsageNode *most_used;
-  struct UsageNode *least_used;
-  pthread_mutex_t *usage_mutex;
+  // Extension store the eviction thread spills large values to, NULL if there
+  // is none. See hashtable_set_extstore.
+  struct ExtStore *extstore;
 };
 
-// Allocates memory for a hash table (including all its buckets, the mutex and
-// the usage queue) and stores the callback for the hash function.
-struct HashTable *hashtable_create(uint64_t num_buckets);
+// Allocates memory for a hash table (including its segments, the mutexes and
+// the usage queue shards). The given capacity is the number of keys the table
+// can hold before it starts growing, which it does on its own as keys are
+// inserted. The items stored in the table can take up to the given memory
+// budget, in bytes, and entries are evicted following the given policies to
+// stay under it.
+struct HashTable *hashtable_create(uint64_t capacity,
+                                   enum EvictionPolicy eviction_policy,
+                                   enum AdmissionPolicy admission_policy,
+                                   uint64_t memory_budget);
 
-// Inserts the given key and value into the hash table.
+// Starts a thread that evicts entries of the given hash table ahead of the
+// insertions, whenever the items take more than the low watermark of the memory
+// budget. The thread runs until the hash table is destroyed.
+void hashtable_start_evictor(struct HashTable *hashtable);
+
+// Starts a thread that compacts the items of the given hash table every
+// HASH_TABLE_COMPACTION_INTERVAL_MS: the items in the sparsest pages of each
+// size class are moved to the free chunks of the other pages of the class, so
+// that the emptied pages go back to the system and to the other classes. The
+// thread runs until the hash table is destroyed.
+void hashtable_start_compactor(struct HashTable *hashtable);
+
+// Makes the eviction thread of the given hash table write the values of at
+// least EXTSTORE_MIN_VALUE_SIZE bytes that it evicts to the given extension
+// store, keeping an entry with their location in their place, and makes the
+// compaction thread compact the store. Must be called before starting them.
+void hashtable_set_extstore(struct HashTable *hashtable,
+                            struct ExtStore *extstore);
+
+// Allocates an item with room for a key and a value of the given sizes, which
+// expires after the given number of seconds (never if it's 0), evicting entries
+// if storing it would take the items over the high watermark of the memory
+// budget or if there is not enough memory. Returns NULL if it wasn't possible
+// to make room for it. The caller copies the key and the value into the item
+// (see item_key and item_value) before inserting it.
+struct Item *hashtable_create_item(struct HashTable *hashtable,
+                                   uint64_t key_size, uint64_t value_size,
+                                   uint32_t ttl);
+
+// Inserts the given item into the hash table.
 //////////////////////////////////////
-// If the key doesn't already exist in the hash table, the function returns
-// HT_NOTFOUND and the keyand value pointers become "owned" by the hash table.
-// If the key does already exist in the hash table, the function returns
-// HT_FOUND, the given key pointer becomes owned by the hash table, the old key
-// pointer is destroyed (!!) and the old value pointer is destroyed (!!). If
-// there is not enough memory for the new entry after evictions, both key and
-// value pointers are destroyed and HT_ERROR is returned.
-int hashtable_insert(struct HashTable *hashtable, struct BoundedData *key,
-                     struct BoundedData *value);
-
-// Attempts to retrieve a *copy* of the value associated to the given key in the
+// If the key of the item doesn't already exist in the hash table, the function
+// returns HT_NOTFOUND. If the key does already exist in the hash table, the
+// function returns HT_FOUND and the item that held it is released (!!). In
+// both cases the reference of the caller to the item becomes "owned" by the
 // hash table.
+int hashtable_insert(struct HashTable *hashtable, struct Item *item);
+
+// Attempts to retrieve the item that holds the given key in the hash table,
+// without copying its value.
 //////////////////////////////////////
 // If the key doesn't already exist in the hash table, the function returns
-// HT_NOTFOUND and the given value pointer is left untouched. If the key does
+// HT_NOTFOUND and the given item pointer is left untouched. If the key does
 // already exist in the hash table, the function returns HT_FOUND and the given
-// value pointer is modified so that it holds a pointer to a copy of the value
-// associated to the given key in the hash table. The pointer of the given key
-// is owned by the client. If there is not enough memory for the duplicate of
-// the value then HT_ERROR is returned.
+// item pointer is modified so that it holds a pointer to the item, with a
+// reference taken for the caller: the item stays valid even if the key is
+// removed or overwritten, until the caller releases it with item_release. The
+// pointer of the given key is owned by the client.
 int hashtable_get(struct HashTable *hashtable, struct BoundedData *key,
-                  struct BoundedData **value);
+                  struct Item **item);
 
 // Attempts to remove the given key and its associated value from the hash
-// table and "returns" a pointer to a copy of the removed value.
+// table and "returns" a pointer to the removed item.
 //////////////////////////////////////
 // If the key doesn't already exist in the hash table, the function returns
-// HT_NOTFOUND and the given value pointer is left untouched. If the key does
-// already exist in the hash table, the function returns HT_FOUND, the given
-// value pointer is modified so that it holds a pointer to the value associated
-// to the given key in the hash table and the key pointer in the hash table is
-// destroyed (!!).
+// HT_NOTFOUND and the given item pointer is left untouched. If the key does
+// already exist in the hash table, the function returns HT_FOUND, the item is
+// removed from the hash table and the given item pointer is modified so that it
+// holds a pointer to it, with a reference taken for the caller. The item is
+// freed once the caller releases it with item_release.
 int hashtable_take(struct HashTable *hashtable, struct BoundedData *key,
-                   struct BoundedData **value);
+                   struct Item **item);
 
 // Attempts to remove the given key and its associated value from the hash
-// table and get a pointer to a copy of the removed value.
+// table.
 //////////////////////////////////////
 // If the key doesn't already exist in the hash table, the function returns
 // HT_NOTFOUND. If the key does already exist in the hash table, the function
-// returns HT_FOUND, the key pointer in the hash table is destroyed (!!) and the
-// value pointer in the hash table is destroyed (!!).
+// returns HT_FOUND and the item in the hash table is released (!!).
 int hashtable_remove(struct HashTable *hashtable, struct BoundedData *key);
 
+// Calls the given function with every item of the hash table and the given
+// argument, one segment at a time: the items of a segment are collected with a
+// reference taken for each of them while holding its mutex, and the function is
+// called once the mutex is released, so that it can take its time without
+// blocking the segment. Items inserted or removed in the meantime might not be
+// visited. Returns false if some item was skipped for lack of memory.
+bool hashtable_visit(struct HashTable *hashtable,
+                     void (*visitor)(struct Item *item, void *arg), void *arg);
+
 // Prints the given hashtable to standard output.
 void hashtable_print(struct HashTable *hashtable);
 
 // Prints the usage queue of the given hashtable to standard output.
 void hashtable_print_usage_queue(struct HashTable *hashtable);
 
+// Returns the number of shards of the usage queue of the hash table.
+uint64_t hashtable_num_usage_shards(struct HashTable *hashtable);
+
+// Returns the number of keys in the given shard of the usage queue of the hash
+// table, adding up the queues of every size class.
+uint64_t hashtable_usage_shard_size(struct HashTable *hashtable,
+                                    uint64_t shard);
+
 // De-allocates memory for the hash table and all its keys and values.
 void hashtable_destroy(struct HashTable *hashtable);
 
 // Returns the number of keys stored in the hash table.
 uint64_t hashtable_key_count(struct HashTable *hashtable);
 
+// Returns the number of keys of the hash table that were removed because they
+// expired.
+uint64_t hashtable_expired_count(struct HashTable *hashtable);
+
+// Returns the number of keys of the hash table that were evicted by insertions
+// that ran out of room.
+uint64_t hashtable_foreground_evictions(struct HashTable *hashtable);
+
+// Returns the number of keys of the hash table that were evicted by the
+// eviction thread.
+uint64_t hashtable_background_evictions(struct HashTable *hashtable);
+
+// Returns the number of keys of the hash table whose value was written to the
+// extension store when they were evicted.
+uint64_t hashtable_spilled_count(struct HashTable *hashtable);
+
+// Removes a batch of the entries of the hash table that expired, of at most
+// HASH_TABLE_EXPIRATION_BATCH entries. Returns true if the batch was full, so
+// that there might be more expired entries.
+bool hashtable_expire(struct HashTable *hashtable);
+
+// Returns the number of bytes of memory taken by the items stored in the hash
+// table.
+uint64_t hashtable_stored_bytes(struct HashTable *hashtable);
+
+// Returns the ratio between the memory of the pages of the slab allocator that
+// hold items and the memory taken by the items stored in the hash table, which
+// grows with the chunks left free inside the pages. It's 1 for an empty table.
+double hashtable_fragmentation_ratio(struct HashTable *hashtable);
+
 // Performs hashtable evictions until the maximum evictions per operation is
 // reached or until the memory is successfully allocated. Returns a pointer to
 // the allocated space if successful or NULL if it wasn't possible to allocate
@@ -106,7 +298,7 @@ void *hashtable_malloc_evict(struct HashTable *hashtable, size_t size);
 
 // Tries to allocate memory for a BoundedData struct and a buffer of the given
 // size. If it fails return NULL, otherwise return a pointer to the BoundedData
-// struct. If buffer_size is 0, the bounded data struct will be uninitialized.
+// struct. If buffer_size is 0, the bounded data struct has no buffer.
 struct BoundedData *
 hashtable_malloc_evict_bounded_data(struct HashTable *hashtable,
                                     size_t buffer_size);
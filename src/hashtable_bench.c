@@ -0,0 +1,135 @@
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hashtable.h"
+#include "parameters.h"
+#include "slab.h"
+
+// Benchmark for the hash table. Inserts the given amount of keys and then
+// measures lookups of keys that are in the table (hits) and of keys that are
+// not (misses). It also reports the memory taken by each key (heap memory and
+// pages of the slab allocator), and how much of it is spent on top of the key
+// and value bytes. Build it with `make bench`,
+// which produces one executable per hash index implementation.
+
+#define KEY_BUFFER_SIZE 32
+
+// Returns the current time in seconds.
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Returns the number of bytes of heap memory and slab pages in use.
+static size_t memory_in_use() {
+  size_t memory = mallinfo2().uordblks;
+  for (uint64_t i = 0; i < slab_num_classes(); i++) {
+    struct SlabClassStats stats;
+    slab_class_stats(i, &stats);
+    memory += stats.num_pages * SLAB_PAGE_SIZE;
+  }
+  return memory;
+}
+
+// Allocates an item with a copy of the given key and value.
+static struct Item *item_create(struct HashTable *hashtable, char *key,
+                                size_t key_size, char *value,
+                                size_t value_size) {
+  struct Item *item =
+      hashtable_create_item(hashtable, key_size, value_size, 0);
+  if (item == NULL) {
+    perror("item_create hashtable_create_item");
+    abort();
+  }
+  memcpy(item_key(item), key, key_size);
+  memcpy(item_value(item), value, value_size);
+  return item;
+}
+
+// Writes the i-th key of the benchmark into the given buffer and returns its
+// size. Keys with the given prefix are never inserted, so they miss.
+static size_t make_key(char *buffer, char prefix, uint64_t i) {
+  return snprintf(buffer, KEY_BUFFER_SIZE, "%ckey:%lu", prefix,
+                  i * 2654435761UL);
+}
+
+// Looks up the given amount of random keys with the given prefix and returns
+// the number of lookups that found the key.
+static uint64_t lookup_keys(struct HashTable *hashtable, uint64_t num_keys,
+                            uint64_t num_lookups, char prefix) {
+  char key_buffer[KEY_BUFFER_SIZE];
+  struct BoundedData key = {0, key_buffer};
+  uint64_t found = 0;
+  uint64_t state = 88172645463325252UL;
+
+  for (uint64_t i = 0; i < num_lookups; i++) {
+    // xorshift64 to pick the keys in random order.
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    key.size = make_key(key_buffer, prefix, state % num_keys);
+
+    struct Item *item = NULL;
+    if (hashtable_get(hashtable, &key, &item) == HT_FOUND) {
+      item_release(item);
+      found++;
+    }
+  }
+
+  return found;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "USAGE: %s NUM_KEYS [NUM_LOOKUPS]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  uint64_t num_keys = strtoul(argv[1], NULL, 10);
+  uint64_t num_lookups = argc == 3 ? strtoul(argv[2], NULL, 10) : num_keys;
+  char key_buffer[KEY_BUFFER_SIZE];
+  uint64_t data_bytes = 0;
+  double start;
+
+  slab_initialize(SLAB_MEMORY);
+  struct HashTable *hashtable =
+      hashtable_create(HASH_TABLE_INITIAL_CAPACITY, EVICTION_LRU,
+                       ADMISSION_ALL, SLAB_MEMORY);
+
+  size_t memory_before = memory_in_use();
+  start = now();
+  for (uint64_t i = 0; i < num_keys; i++) {
+    size_t key_size = make_key(key_buffer, 'h', i);
+    hashtable_insert(hashtable,
+                     item_create(hashtable, key_buffer, key_size, "value", 5));
+    data_bytes += key_size + 5;
+  }
+  double insert_time = now() - start;
+  // Includes the memory of the indexes, which grow along with the keys.
+  size_t memory_bytes = memory_in_use() - memory_before;
+
+  start = now();
+  uint64_t hits = lookup_keys(hashtable, num_keys, num_lookups, 'h');
+  double hit_time = now() - start;
+
+  start = now();
+  uint64_t misses = lookup_keys(hashtable, num_keys, num_lookups, 'm');
+  double miss_time = now() - start;
+
+  printf("%s: %lu keys\n", argv[0], hashtable_key_count(hashtable));
+  printf("  insert: %8.1f ns/op\n", insert_time * 1e9 / num_keys);
+  printf("  hit:    %8.1f ns/op (%lu found)\n", hit_time * 1e9 / num_lookups,
+         hits);
+  printf("  miss:   %8.1f ns/op (%lu found)\n", miss_time * 1e9 / num_lookups,
+         misses);
+  printf("  memory: %8.1f bytes/key (%.1f of key and value, %.1f overhead)\n",
+         (double)memory_bytes / num_keys, (double)data_bytes / num_keys,
+         (double)(memory_bytes - data_bytes) / num_keys);
+
+  hashtable_destroy(hashtable);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,169 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "epoch.h"
+#include "extstore.h"
+#include "hashtable.h"
+#include "parameters.h"
+#include "slab.h"
+
+// Test for the hash table. Removes keys while the eviction thread writes their
+// values to an extension store, and checks that no removed key comes back. A
+// thread keeps inserting other keys so that the keys being removed are the
+// least recently used ones by then, and the budget is small enough to keep the
+// eviction thread busy. It runs once with the LRU eviction policy and once
+// with the CLOCK one. Build and run it with `make test`.
+
+#define KEY_BUFFER_SIZE 32
+#define TEST_MEMORY_BUDGET (16UL << 20)
+#define TEST_VALUE_SIZE (4 * EXTSTORE_MIN_VALUE_SIZE)
+#define TEST_ROUNDS 200
+#define TEST_KEYS_PER_ROUND 256
+
+static char value[TEST_VALUE_SIZE];
+
+// State shared with the thread that keeps inserting keys.
+struct Filler {
+  struct HashTable *hashtable;
+  enum EvictionPolicy eviction_policy;
+  bool stop;
+};
+
+// Inserts the given key with the test value, aborting if it can't.
+static void insert_key(struct HashTable *hashtable, char *key,
+                       size_t key_size) {
+  struct Item *item =
+      hashtable_create_item(hashtable, key_size, TEST_VALUE_SIZE, 0);
+  if (item == NULL) {
+    perror("insert_key hashtable_create_item");
+    abort();
+  }
+  memcpy(item_key(item), key, key_size);
+  memcpy(item_value(item), value, TEST_VALUE_SIZE);
+  hashtable_insert(hashtable, item);
+}
+
+// True if the given key is in the hash table.
+static bool key_found(struct HashTable *hashtable, char *key,
+                      size_t key_size) {
+  struct BoundedData key_data = {key_size, key};
+  struct Item *item;
+  if (hashtable_get(hashtable, &key_data, &item) != HT_FOUND) {
+    return false;
+  }
+  item_release(item);
+  return true;
+}
+
+// Keeps inserting new keys until told to stop, pushing the keys of the test
+// towards the least recently used end of the usage queue. With the CLOCK
+// policy every key is read right after it's inserted, so that the most used
+// entries are referenced and the hand keeps going back to the least used ones.
+static void *filler(void *arg) {
+  struct Filler *filler = arg;
+  char key[KEY_BUFFER_SIZE];
+
+  epoch_register();
+  for (uint64_t i = 0; !__atomic_load_n(&filler->stop, __ATOMIC_RELAXED);
+       i++) {
+    size_t key_size = snprintf(key, KEY_BUFFER_SIZE, "fill:%lu", i);
+    insert_key(filler->hashtable, key, key_size);
+    if (filler->eviction_policy == EVICTION_CLOCK) {
+      key_found(filler->hashtable, key, key_size);
+    }
+    epoch_reclaim();
+  }
+  epoch_unregister();
+  return NULL;
+}
+
+// Runs the test with the given eviction policy and an extension store in the
+// file at the given path. Returns the number of failures.
+static uint64_t run_test(enum EvictionPolicy eviction_policy,
+                         const char *path) {
+  struct HashTable *hashtable =
+      hashtable_create(HASH_TABLE_INITIAL_CAPACITY, eviction_policy,
+                       ADMISSION_ALL, TEST_MEMORY_BUDGET);
+  struct ExtStore *extstore = extstore_open(path);
+  if (extstore == NULL) {
+    fprintf(stderr, "ERROR: couldn't open the extension store '%s'.\n", path);
+    exit(EXIT_FAILURE);
+  }
+  hashtable_set_extstore(hashtable, extstore);
+  hashtable_start_evictor(hashtable);
+
+  struct Filler filler_state = {hashtable, eviction_policy, false};
+  pthread_t filler_thread;
+  if (pthread_create(&filler_thread, NULL, filler, &filler_state) != 0) {
+    perror("run_test pthread_create");
+    exit(EXIT_FAILURE);
+  }
+
+  // Every round inserts its keys, lets the filler push them towards eviction
+  // and removes them while they're being spilled.
+  char key[KEY_BUFFER_SIZE];
+  uint64_t num_failures = 0;
+  for (uint64_t round = 0; round < TEST_ROUNDS; round++) {
+    for (uint64_t i = 0; i < TEST_KEYS_PER_ROUND; i++) {
+      insert_key(hashtable, key,
+                 snprintf(key, KEY_BUFFER_SIZE, "del:%lu:%lu", round, i));
+    }
+    usleep(1000);
+    for (uint64_t i = 0; i < TEST_KEYS_PER_ROUND; i++) {
+      size_t key_size =
+          snprintf(key, KEY_BUFFER_SIZE, "del:%lu:%lu", round, i);
+      struct BoundedData key_data = {key_size, key};
+      hashtable_remove(hashtable, &key_data);
+      if (key_found(hashtable, key, key_size)) {
+        printf("FAIL: %s found right after removing it\n", key);
+        num_failures++;
+      }
+    }
+    epoch_reclaim();
+  }
+
+  __atomic_store_n(&filler_state.stop, true, __ATOMIC_RELAXED);
+  pthread_join(filler_thread, NULL);
+  // Give the eviction thread time to finish the spills it started.
+  usleep(500000);
+
+  for (uint64_t round = 0; round < TEST_ROUNDS; round++) {
+    for (uint64_t i = 0; i < TEST_KEYS_PER_ROUND; i++) {
+      size_t key_size =
+          snprintf(key, KEY_BUFFER_SIZE, "del:%lu:%lu", round, i);
+      if (key_found(hashtable, key, key_size)) {
+        printf("FAIL: %s came back after removing it\n", key);
+        num_failures++;
+      }
+    }
+  }
+
+  printf("%s: %lu removed keys, %lu spilled values, %lu failures\n",
+         eviction_policy == EVICTION_CLOCK ? "clock" : "lru",
+         (uint64_t)TEST_ROUNDS * TEST_KEYS_PER_ROUND,
+         hashtable_spilled_count(hashtable), num_failures);
+  hashtable_destroy(hashtable);
+  epoch_reclaim();
+  return num_failures;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "USAGE: %s EXTSTORE_PATH\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  memset(value, 'v', TEST_VALUE_SIZE);
+  slab_initialize(SLAB_MEMORY);
+  epoch_register();
+
+  uint64_t num_failures = run_test(EVICTION_LRU, argv[1]);
+  num_failures += run_test(EVICTION_CLOCK, argv[1]);
+
+  unlink(argv[1]);
+  return num_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
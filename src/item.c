@@ -0,0 +1,107 @@
+#include <string.h>
+
+#include "item.h"
+#include "slab.h"
+#include "timer_wheel.h"
+
+// Returns the offset of the ItemTimer of an item with the given key and value
+// sizes from the start of its data, aligned for the pointers in it.
+static size_t item_timer_offset(uint64_t key_size, uint64_t value_size) {
+  size_t alignment = _Alignof(struct ItemTimer);
+  return (key_size + value_size + alignment - 1) / alignment * alignment;
+}
+
+// Returns the number of bytes of an item with the given key and value sizes,
+// including its ItemTimer if it expires.
+size_t item_size(uint64_t key_size, uint64_t value_size, bool expires) {
+  if (expires) {
+    return sizeof(struct Item) + item_timer_offset(key_size, value_size) +
+           sizeof(struct ItemTimer);
+  }
+  return sizeof(struct Item) + key_size + value_size;
+}
+
+// Returns the number of bytes of memory that the given item takes, which is
+// what it counts towards the memory budget of the hash table.
+uint64_t item_memory(struct Item *item) {
+  return slab_alloc_size(
+      item_size(item->key_size, item->value_size, item->expires));
+}
+
+// Initializes the header of the given item, which must have been allocated with
+// slab_alloc with room for a key and a value of the given sizes, and for an
+// ItemTimer if the given TTL is not 0. The item expires after that many
+// seconds, or never if it's 0.
+// The item starts with a single reference, which belongs to the caller.
+void item_initialize(struct Item *item, uint64_t key_size, uint64_t value_size,
+                     uint32_t ttl) {
+  item->next = 0;
+  item->more_used = NULL;
+  item->less_used = NULL;
+  item->hash = 0;
+  item->key_size = key_size;
+  item->value_size = value_size;
+  item->refcount = 1;
+  item->queue = ITEM_QUEUE_NONE;
+  item->referenced = false;
+  item->expires = ttl != 0;
+  item->compressed = false;
+  item->spilled = false;
+  item->slab_class =
+      slab_class_for(item_size(key_size, value_size, item->expires));
+
+  if (item->expires) {
+    struct ItemTimer *timer = item_timer(item);
+    timer->next = NULL;
+    timer->prev = NULL;
+    uint64_t expiration = (uint64_t)timer_wheel_now() + ttl;
+    timer->expiration = expiration < UINT32_MAX ? expiration : UINT32_MAX;
+  }
+}
+
+// Returns the ItemTimer of the given item, which must expire.
+struct ItemTimer *item_timer(struct Item *item) {
+  return (struct ItemTimer *)(item->data + item_timer_offset(
+                                               item->key_size,
+                                               item->value_size));
+}
+
+// True if the given item has expired, false otherwise.
+bool item_expired(struct Item *item) {
+  return item->expires && item_timer(item)->expiration <= timer_wheel_now();
+}
+
+// Takes a reference to the given item, so that it's not freed until the
+// reference is released with item_release. The caller must already hold a
+// reference, or be inside an epoch critical section in which it found the item
+// in the hash table, whose reference is only released through epoch_retire.
+void item_acquire(struct Item *item) {
+  __atomic_add_fetch(&item->refcount, 1, __ATOMIC_RELAXED);
+}
+
+// Releases a reference to the given item, freeing it if it was the last one.
+void item_release(struct Item *item) {
+  if (__atomic_sub_fetch(&item->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+    item_destroy(item);
+  }
+}
+
+// Returns a pointer to the key bytes of the item.
+char *item_key(struct Item *item) { return item->data; }
+
+// Returns a pointer to the value bytes of the item.
+char *item_value(struct Item *item) { return item->data + item->key_size; }
+
+// True if the key of the item is equal byte-by-byte to the given key, false
+// otherwise.
+bool item_key_equals(struct Item *item, struct BoundedData *key) {
+  if (item->key_size != key->size) {
+    return false;
+  }
+
+  return memcmp(item->data, key->data, key->size) == 0;
+}
+
+// De-allocates memory for the given item, returning it to the slab allocator,
+// regardless of its references.
+void item_destroy(struct Item *item) { slab_free(item); }
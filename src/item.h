@@ -0,0 +1,110 @@
+#ifndef __ITEM_H__
+#define __ITEM_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bounded_data.h"
+
+// Usage queues of its shard that an item can be linked to.
+enum ItemQueue {
+  ITEM_QUEUE_NONE, // Not linked: the item is not in the hash table.
+  ITEM_QUEUE_MAIN,
+  ITEM_QUEUE_WINDOW, // Admission window of the TinyLFU admission policy.
+};
+
+// A key-value pair of the hash table. The header, the key bytes and the value
+// bytes live in a single allocation, in that order, so storing a pair takes one
+// allocation instead of one per node, link and buffer. Lock-free readers might
+// still be looking at an item after it's removed from its segment, so removed
+// items are freed through epoch_retire. The key and the value never change once
+// the item is inserted: overwriting a key replaces the whole item.
+// Items are reference counted, so that responses can be written straight from
+// the value of an item: the hash table holds a reference while the item is
+// stored, and each response that is being written holds another one. The item
+// is freed when the last reference is released.
+struct Item {
+  uintptr_t next;         // Link to the next item of the bucket (chained
+                          // index only).
+  struct Item *more_used; // Neighbours in the usage queue shard.
+  struct Item *less_used;
+  uint64_t hash;          // Hash of the key, set when inserted.
+  uint32_t key_size;
+  uint32_t value_size;
+  uint32_t refcount; // References to the item, see item_acquire.
+  // Usage queue the item is linked to, see enum ItemQueue. Only changes while
+  // holding the mutex of the usage queue shard of the item.
+  uint8_t queue;
+  bool referenced;    // Reference bit of the CLOCK eviction policy.
+  uint8_t slab_class; // Size class of the slab allocator the item comes from.
+  bool expires : 1;   // Has an ItemTimer after the value, see item_timer.
+  // The value holds the original size of the value (four bytes in network byte
+  // order) followed by the value compressed with compression_compress, which
+  // is also how it's sent to binary clients that accept compressed values.
+  bool compressed : 1;
+  // The value was evicted to the extension store, and the value of the item
+  // only holds its ExtStoreLocation.
+  bool spilled : 1;
+  char data[];        // Key bytes followed by value bytes.
+};
+
+// Expiration of an item that expires, stored after its value (see item_timer)
+// so that items that don't expire don't pay for it.
+struct ItemTimer {
+  // Neighbours in the slot of the timer wheel. The previous one is the link
+  // that points to the item, NULL if the item is not in a timer wheel.
+  struct Item *next;
+  struct Item **prev;
+  uint32_t expiration; // Time it expires at, see timer_wheel_now.
+};
+
+// Largest key or value that fits in an item.
+#define ITEM_MAX_DATA_SIZE UINT32_MAX
+
+// Returns the number of bytes of an item with the given key and value sizes,
+// including its ItemTimer if it expires.
+size_t item_size(uint64_t key_size, uint64_t value_size, bool expires);
+
+// Returns the number of bytes of memory that the given item takes, which is
+// what it counts towards the memory budget of the hash table.
+uint64_t item_memory(struct Item *item);
+
+// Initializes the header of the given item, which must have been allocated with
+// slab_alloc with room for a key and a value of the given sizes, and for an
+// ItemTimer if the given TTL is not 0. The item expires after that many
+// seconds, or never if it's 0.
+// The item starts with a single reference, which belongs to the caller.
+void item_initialize(struct Item *item, uint64_t key_size, uint64_t value_size,
+                     uint32_t ttl);
+
+// Returns the ItemTimer of the given item, which must expire.
+struct ItemTimer *item_timer(struct Item *item);
+
+// True if the given item has expired, false otherwise.
+bool item_expired(struct Item *item);
+
+// Takes a reference to the given item, so that it's not freed until the
+// reference is released with item_release. The caller must already hold a
+// reference, or be inside an epoch critical section in which it found the item
+// in the hash table, whose reference is only released through epoch_retire.
+void item_acquire(struct Item *item);
+
+// Releases a reference to the given item, freeing it if it was the last one.
+void item_release(struct Item *item);
+
+// Returns a pointer to the key bytes of the item.
+char *item_key(struct Item *item);
+
+// Returns a pointer to the value bytes of the item.
+char *item_value(struct Item *item);
+
+// True if the key of the item is equal byte-by-byte to the given key, false
+// otherwise.
+bool item_key_equals(struct Item *item, struct BoundedData *key);
+
+// De-allocates memory for the given item, returning it to the slab allocator,
+// regardless of its references.
+void item_destroy(struct Item *item);
+
+#endif
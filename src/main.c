@@ -1,64 +1,82 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/resource.h>
 #include <sys/sysinfo.h>
 
 #include "epoll.h"
 #include "hashtable.h"
+#include "options.h"
 #include "parameters.h"
+#include "slab.h"
+#include "snapshot.h"
 #include "sockets.h"
 #include "worker_state.h"
 #include "worker_thread.h"
 
-void start_server(int text_fd, int binary_fd);
+void start_server(struct Options *options);
 
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    fprintf(stderr, "USAGE: %s TEXT_SOCKET_FD BINARY_SOCKET_FD\n", argv[0]);
+  struct Options options;
+  if (!options_parse(argc, argv, &options)) {
+    options_print_usage(argv[0]);
     return EXIT_FAILURE;
   }
 
-  char *text_fd_arg = argv[1];
-  char *binary_fd_arg = argv[2];
-  int text_fd = atoi(text_fd_arg);
-  int binary_fd = atoi(binary_fd_arg);
-
-  start_server(text_fd, binary_fd);
+  start_server(&options);
 
   return EXIT_SUCCESS;
 }
 
-void set_memory_limit() {
-  struct rlimit memory_limits;
-
-  int rv = getrlimit(RLIMIT_DATA, &memory_limits);
-  if (rv != 0) {
-    perror("set_memory_limit getrlimit");
-    abort();
+void start_server(struct Options *options) {
+  // We'll use as many workers as processors in the computer, or one per pair
+  // of listen sockets when each worker runs its own event loop.
+  int num_workers = options->event_loops == EVENT_LOOPS_PER_WORKER
+                        ? options->num_listen_fds
+                        : get_nprocs();
+
+  // Create epoll instance file descriptor, shared by all the workers unless
+  // each of them gets its own below.
+  int epoll_fd = -1;
+  if (options->event_loops == EVENT_LOOPS_SHARED) {
+    epoll_fd = epoll_initialize(options->text_fds[0], options->binary_fds[0]);
   }
 
-  memory_limits.rlim_cur = MEMORY_LIMIT;
-  rv = setrlimit(RLIMIT_DATA, &memory_limits);
-  if (rv != 0) {
-    perror("set_memory_limit setrlimit");
-    abort();
+  // Reserve the memory for the items and create and initialize the hash table.
+  // The items are kept under their own budget instead of limiting the memory
+  // of the whole process, so that running out of room for items never makes
+  // the allocations of the connections fail.
+  slab_initialize(SLAB_MEMORY);
+  slab_start_release_thread();
+  struct HashTable *hashtable =
+      hashtable_create(HASH_TABLE_INITIAL_CAPACITY, options->eviction_policy,
+                       options->admission_policy, ITEM_MEMORY_BUDGET);
+  printf("Memory budget for items set to %ld bytes\n", ITEM_MEMORY_BUDGET);
+  if (options->extstore_path != NULL) {
+    struct ExtStore *extstore = extstore_open(options->extstore_path);
+    if (extstore == NULL) {
+      fprintf(stderr, "ERROR: couldn't open the extension store '%s'.\n",
+              options->extstore_path);
+      exit(EXIT_FAILURE);
+    }
+    hashtable_set_extstore(hashtable, extstore);
+    printf("Extension store of %ld bytes at %s\n", EXTSTORE_SIZE,
+           options->extstore_path);
+  }
+  hashtable_start_evictor(hashtable);
+  hashtable_start_compactor(hashtable);
+
+  // Warm the cache up with the last snapshot before serving requests, loading
+  // it from as many threads as there are workers.
+  struct Snapshot *snapshot = NULL;
+  if (options->snapshot_path != NULL) {
+    int64_t num_loaded =
+        snapshot_load(options->snapshot_path, hashtable, num_workers);
+    if (num_loaded != -1) {
+      printf("Loaded %ld items from the snapshot at %s\n", num_loaded,
+             options->snapshot_path);
+    }
+    snapshot = snapshot_create(options->snapshot_path, hashtable);
   }
-
-  printf("Memory limit correctly set to %ld bytes\n", MEMORY_LIMIT);
-}
-
-void start_server(int text_fd, int binary_fd) {
-  set_memory_limit();
-
-  // We'll use as many workers as processors in the computer.
-  int num_workers = get_nprocs();
-
-  // Create epoll instance file descriptor.
-  int epoll_fd = epoll_initialize(text_fd, binary_fd);
-
-  // Create and initialize the hash table.
-  struct HashTable *hashtable = hashtable_create(HASH_TABLE_BUCKETS_SIZE);
 
   // Create the array of thread ids.
   pthread_t *thread_ids = malloc(sizeof(pthread_t) * num_workers);
@@ -84,14 +102,24 @@ void start_server(int text_fd, int binary_fd) {
     abort();
   }
   for (int i = 0; i < num_workers; i++) {
-    worker_args[i].text_fd = text_fd;
-    worker_args[i].binary_fd = binary_fd;
-    worker_args[i].epoll_fd = epoll_fd;
+    if (options->event_loops == EVENT_LOOPS_PER_WORKER) {
+      worker_args[i].text_fd = options->text_fds[i];
+      worker_args[i].binary_fd = options->binary_fds[i];
+      worker_args[i].epoll_fd =
+          epoll_initialize(options->text_fds[i], options->binary_fds[i]);
+    } else {
+      worker_args[i].text_fd = options->text_fds[0];
+      worker_args[i].binary_fd = options->binary_fds[0];
+      worker_args[i].epoll_fd = epoll_fd;
+    }
+    worker_args[i].event_loops = options->event_loops;
     worker_args[i].worker_id = i;
     worker_args[i].num_workers = num_workers;
     worker_args[i].thread_ids = thread_ids;
     worker_args[i].hashtable = hashtable;
     worker_args[i].workers_stats = workers_stats;
+    worker_args[i].compression = options->compression;
+    worker_args[i].snapshot = snapshot;
     worker_stats_initialize(&workers_stats[i]);
 
     if (i == 0) {
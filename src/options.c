@@ -0,0 +1,210 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "options.h"
+
+enum OptionId {
+  OPTION_EVICTION = 1000,
+  OPTION_ADMISSION,
+  OPTION_COMPRESSION,
+  OPTION_EXTSTORE,
+  OPTION_SNAPSHOT,
+  OPTION_EVENT_LOOPS,
+};
+
+static struct option long_options[] = {
+    {"eviction", required_argument, NULL, OPTION_EVICTION},
+    {"admission", required_argument, NULL, OPTION_ADMISSION},
+    {"compression", required_argument, NULL, OPTION_COMPRESSION},
+    {"extstore", required_argument, NULL, OPTION_EXTSTORE},
+    {"snapshot", required_argument, NULL, OPTION_SNAPSHOT},
+    {"event-loops", required_argument, NULL, OPTION_EVENT_LOOPS},
+    {NULL, 0, NULL, 0},
+};
+
+// Parses the name of an eviction policy into the given pointer. Returns true
+// if the name is valid, false otherwise.
+static bool parse_eviction_policy(char *name,
+                                  enum EvictionPolicy *eviction_policy) {
+  if (strcmp(name, "lru") == 0) {
+    *eviction_policy = EVICTION_LRU;
+  } else if (strcmp(name, "clock") == 0) {
+    *eviction_policy = EVICTION_CLOCK;
+  } else {
+    fprintf(stderr, "ERROR: unknown eviction policy '%s'.\n", name);
+    return false;
+  }
+  return true;
+}
+
+// Parses the name of an admission policy into the given pointer. Returns true
+// if the name is valid, false otherwise.
+static bool parse_admission_policy(char *name,
+                                   enum AdmissionPolicy *admission_policy) {
+  if (strcmp(name, "all") == 0) {
+    *admission_policy = ADMISSION_ALL;
+  } else if (strcmp(name, "tinylfu") == 0) {
+    *admission_policy = ADMISSION_TINYLFU;
+  } else {
+    fprintf(stderr, "ERROR: unknown admission policy '%s'.\n", name);
+    return false;
+  }
+  return true;
+}
+
+// Parses the name of a compression algorithm into the given pointer. Returns
+// true if the name is valid, false otherwise.
+static bool parse_compression(char *name,
+                              enum CompressionAlgorithm *compression) {
+  if (strcmp(name, "none") == 0) {
+    *compression = COMPRESSION_NONE;
+  } else if (strcmp(name, "lz") == 0) {
+    *compression = COMPRESSION_LZ;
+  } else {
+    fprintf(stderr, "ERROR: unknown compression algorithm '%s'.\n", name);
+    return false;
+  }
+  return true;
+}
+
+// Parses the name of an event loop mode into the given pointer. Returns true if
+// the name is valid, false otherwise.
+static bool parse_event_loops(char *name, enum EventLoopMode *event_loops) {
+  if (strcmp(name, "shared") == 0) {
+    *event_loops = EVENT_LOOPS_SHARED;
+  } else if (strcmp(name, "per-worker") == 0) {
+    *event_loops = EVENT_LOOPS_PER_WORKER;
+  } else {
+    fprintf(stderr, "ERROR: unknown event loop mode '%s'.\n", name);
+    return false;
+  }
+  return true;
+}
+
+// Parses a comma-separated list of file descriptors into a newly allocated
+// array. Returns the number of file descriptors, or -1 if the list is invalid.
+static int parse_fd_list(char *list, int **fds) {
+  int num_fds = 1;
+  for (char *c = list; *c != '\0'; c++) {
+    if (*c == ',') {
+      num_fds++;
+    }
+  }
+  *fds = malloc(sizeof(int) * num_fds);
+  if (*fds == NULL) {
+    perror("parse_fd_list malloc");
+    return -1;
+  }
+
+  char *start = list;
+  for (int i = 0; i < num_fds; i++) {
+    char *end;
+    long fd = strtol(start, &end, 10);
+    if (end == start || fd < 0 || (*end != ',' && *end != '\0')) {
+      fprintf(stderr, "ERROR: invalid file descriptor list '%s'.\n", list);
+      free(*fds);
+      return -1;
+    }
+    (*fds)[i] = fd;
+    start = end + 1;
+  }
+  return num_fds;
+}
+
+// Parses the command line arguments into the given Options struct, using the
+// default values for the options that are not given. Returns true if the
+// arguments are valid, false otherwise.
+bool options_parse(int argc, char *argv[], struct Options *options) {
+  options->eviction_policy = EVICTION_LRU;
+  options->admission_policy = ADMISSION_ALL;
+  options->compression = COMPRESSION_NONE;
+  options->extstore_path = NULL;
+  options->snapshot_path = NULL;
+  options->event_loops = EVENT_LOOPS_SHARED;
+
+  int option;
+  while ((option = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (option) {
+    case OPTION_EVICTION:
+      if (!parse_eviction_policy(optarg, &options->eviction_policy)) {
+        return false;
+      }
+      break;
+    case OPTION_ADMISSION:
+      if (!parse_admission_policy(optarg, &options->admission_policy)) {
+        return false;
+      }
+      break;
+    case OPTION_COMPRESSION:
+      if (!parse_compression(optarg, &options->compression)) {
+        return false;
+      }
+      break;
+    case OPTION_EXTSTORE:
+      options->extstore_path = optarg;
+      break;
+    case OPTION_SNAPSHOT:
+      options->snapshot_path = optarg;
+      break;
+    case OPTION_EVENT_LOOPS:
+      if (!parse_event_loops(optarg, &options->event_loops)) {
+        return false;
+      }
+      break;
+    default:
+      // getopt_long already printed the problem.
+      return false;
+    }
+  }
+
+  // The file descriptors are the only positional arguments.
+  if (argc - optind != 2) {
+    return false;
+  }
+  int num_text_fds = parse_fd_list(argv[optind], &options->text_fds);
+  if (num_text_fds == -1) {
+    return false;
+  }
+  int num_binary_fds = parse_fd_list(argv[optind + 1], &options->binary_fds);
+  if (num_binary_fds == -1) {
+    free(options->text_fds);
+    return false;
+  }
+
+  // A shared event loop listens on a single socket of each protocol, while
+  // each worker of its own needs a socket of each protocol.
+  if (num_text_fds != num_binary_fds ||
+      (options->event_loops == EVENT_LOOPS_SHARED && num_text_fds != 1)) {
+    fprintf(stderr, "ERROR: wrong number of socket file descriptors.\n");
+    free(options->text_fds);
+    free(options->binary_fds);
+    return false;
+  }
+  options->num_listen_fds = num_text_fds;
+
+  return true;
+}
+
+// Prints the usage of the cache executable to standard error.
+void options_print_usage(char *program) {
+  fprintf(stderr,
+          "USAGE: %s TEXT_SOCKET_FDS BINARY_SOCKET_FDS [OPTIONS]\n"
+          "The file descriptors of each protocol are separated by commas.\n"
+          "OPTIONS:\n"
+          "  --eviction=lru|clock     Eviction policy (default: lru).\n"
+          "  --admission=all|tinylfu  Admission policy (default: all).\n"
+          "  --compression=none|lz    Compression of large values (default: "
+          "none).\n"
+          "  --extstore=PATH          File where evicted values are kept "
+          "(default: none).\n"
+          "  --snapshot=PATH          File of the snapshots, loaded at startup "
+          "(default: none).\n"
+          "  --event-loops=shared|per-worker\n"
+          "                           Whether the workers share an event loop, "
+          "or each\n"
+          "                           runs its own on its own sockets "
+          "(default: shared).\n",
+          program);
+}
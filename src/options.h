@@ -0,0 +1,32 @@
+#ifndef __OPTIONS_H__
+#define __OPTIONS_H__
+
+#include <stdbool.h>
+
+#include "compression.h"
+#include "hashtable.h"
+#include "worker_state.h"
+
+// Options of the cache that are selected at startup through the command line,
+// after the file descriptors of the sockets.
+struct Options {
+  int *text_fds;      // File descriptors of the text protocol sockets.
+  int *binary_fds;    // File descriptors of the binary protocol sockets.
+  int num_listen_fds; // Sockets of each protocol.
+  enum EventLoopMode event_loops;        // --event-loops=shared|per-worker
+  enum EvictionPolicy eviction_policy;   // --eviction=lru|clock
+  enum AdmissionPolicy admission_policy; // --admission=all|tinylfu
+  enum CompressionAlgorithm compression; // --compression=none|lz
+  char *extstore_path; // --extstore=PATH, NULL if not given.
+  char *snapshot_path; // --snapshot=PATH, NULL if not given.
+};
+
+// Parses the command line arguments into the given Options struct, using the
+// default values for the options that are not given. Returns true if the
+// arguments are valid, false otherwise.
+bool options_parse(int argc, char *argv[], struct Options *options);
+
+// Prints the usage of the cache executable to standard error.
+void options_print_usage(char *program);
+
+#endif
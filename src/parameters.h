@@ -1,10 +1,46 @@
 #ifndef __PARAMETERS_H__
 #define __PARAMETERS_H__
 
-#define HASH_TABLE_BUCKETS_SIZE 10000
+#define HASH_TABLE_INITIAL_CAPACITY 32768
+#define HASH_TABLE_SEGMENTS 8192
+#define HASH_TABLE_MAX_LOAD_FACTOR 2
+#define HASH_TABLE_REHASH_STEPS 4
+#define HASH_TABLE_READ_ATTEMPTS 4
+#define HASH_TABLE_USAGE_SHARDS 16
+#define HASH_TABLE_COUNTER_SLOTS 64
+#define HASH_TABLE_COUNTER_FLUSH_BYTES (256UL * 1024)
+#define HASH_TABLE_EXPIRATION_BATCH 64
+#define HASH_TABLE_EXPIRATION_INTERVAL_MS 250
+#define HASH_TABLE_EVICTOR_MIN_BYTES (1UL << 20)
+#define HASH_TABLE_EVICTOR_INTERVAL_MS 100
+#define HASH_TABLE_COMPACTION_INTERVAL_MS 1000
+#define HASH_TABLE_COMPACTION_PAGES 8
+#define ADMISSION_SKETCH_COUNTERS (1UL << 20)
+#define ADMISSION_WINDOW_PERCENT 1
+#define EPOCH_MAX_THREADS 1024
+#define EPOCH_RECLAIM_THRESHOLD 64
+#define EPOCH_RETIRE_CAPACITY 4096
 #define ONE_MEGABYTE_IN_BYTES 1000000UL
 #define MEMORY_LIMIT (1000UL * ONE_MEGABYTE_IN_BYTES)
 #define MAX_EVICTIONS_PER_OPERATION 50
 #define MAX_EVICTION_ATTEMPTS 20
+#define ITEM_MEMORY_BUDGET (MEMORY_LIMIT / 10 * 8)
+#define ITEM_MEMORY_HIGH_WATERMARK_PERCENT 95
+#define ITEM_MEMORY_LOW_WATERMARK_PERCENT 90
+#define SLAB_MEMORY (MEMORY_LIMIT / 10 * 9)
+#define SLAB_PAGE_SIZE (1UL << 20)
+#define SLAB_MIN_CHUNK_SIZE 64
+#define SLAB_GROWTH_FACTOR 1.25
+#define SLAB_COMPACTION_MAX_USED_PERCENT 50
+#define COMPRESSION_MIN_VALUE_SIZE 4096
+#define COMPRESSION_MIN_SAVINGS_PERCENT 10
+#define EXTSTORE_SIZE (4096UL * ONE_MEGABYTE_IN_BYTES)
+#define EXTSTORE_SEGMENT_SIZE (8UL << 20)
+#define EXTSTORE_MIN_VALUE_SIZE 1024
+#define EXTSTORE_MIN_FREE_SEGMENTS 2
+#define EXTSTORE_COMPACTION_MAX_LIVE_PERCENT 50
+#define EXTSTORE_READER_THREADS 4
+#define SNAPSHOT_CHUNK_SIZE (1UL << 20)
+#define CONNECTION_BUFFER_SIZE (16UL * 1024)
 
 #endif
@@ -1,11 +1,16 @@
+#include <arpa/inet.h> // for htonl
 #include <errno.h>     // for errno
 #include <stdio.h>     // for perror
 #include <stdlib.h>    // for malloc
 #include <string.h>    // for memcpy
 #include <sys/types.h> // for ssize_t
-#include <unistd.h>    // for write
+#include <sys/uio.h>   // for writev
+#include <unistd.h>    // for read
 
+#include "compression.h"
+#include "parameters.h"
 #include "protocol.h"
+#include "slab.h"
 
 // Adds the given client event back to the epoll interest list. Returns 0 if
 // successful, -1 otherwise.
@@ -21,20 +26,36 @@ int epoll_mod_client(int epoll_fd, struct epoll_event *event,
   return 0;
 }
 
-// Writes the given buffer with the given size into the client socket's file
+// Moves the given buffers past the given number of bytes, dropping the buffers
+// that are left empty.
+static void skip_buffers(struct iovec **buffers, int *num_buffers,
+                         size_t bytes) {
+  while (*num_buffers > 0 && bytes >= (*buffers)->iov_len) {
+    bytes -= (*buffers)->iov_len;
+    (*buffers)++;
+    (*num_buffers)--;
+  }
+  if (*num_buffers > 0) {
+    (*buffers)->iov_base = (char *)(*buffers)->iov_base + bytes;
+    (*buffers)->iov_len -= bytes;
+  }
+}
+
+// Writes the given buffers, one after the other, into the client socket's file
 // descriptor, assuming that the amount of bytes in the value pointed at by
-// `total_bytes_written` were already sent. If the whole buffer is correctly
+// `total_bytes_written` were already sent. They're written together with as
+// few system calls as possible, so that a response goes out in one packet and
+// the buffers are modified to skip what was sent. If all of them are correctly
 // sent then CLIENT_WRITE_SUCCESS is returned and the value pointed at by
 // `total_bytes_written` is updated to reflect this. If it's not possible to
-// write the whole buffer, the value pointed at by `total_bytes_written` is
-// updated to the new amount written and CLIENT_WRITE_INCOMPLETE is returned. If
-// an error happens then CLIENT_WRITE_ERROR is returned.
-int write_buffer(int fd, char *buffer, size_t buffer_size,
-                 size_t *total_bytes_written) {
-  while (*total_bytes_written < buffer_size) {
-    char *remaining_buffer = buffer + *total_bytes_written;
-    size_t remaining_bytes = buffer_size - *total_bytes_written;
-    ssize_t nwritten = write(fd, remaining_buffer, remaining_bytes);
+// write all of them, the value pointed at by `total_bytes_written` is updated
+// to the new amount written and CLIENT_WRITE_INCOMPLETE is returned. If an
+// error happens then CLIENT_WRITE_ERROR is returned.
+int write_buffers(int fd, struct iovec *buffers, int num_buffers,
+                  size_t *total_bytes_written) {
+  skip_buffers(&buffers, &num_buffers, *total_bytes_written);
+  while (num_buffers > 0) {
+    ssize_t nwritten = writev(fd, buffers, num_buffers);
     if (nwritten == -1) {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
         // Client file descriptor is not ready to receive data, we should
@@ -43,31 +64,49 @@ int write_buffer(int fd, char *buffer, size_t buffer_size,
       }
 
       // Another error happened.
-      perror("write_buffer write");
+      perror("write_buffers writev");
       return CLIENT_WRITE_ERROR;
     }
 
     *total_bytes_written += nwritten;
+    skip_buffers(&buffers, &num_buffers, nwritten);
   }
 
   return CLIENT_WRITE_SUCCESS;
 }
 
-// reads from the given file descriptor into the given buffer up to the given
-// size, keeping track of the total bytes read in total_bytes_read. returns
-// CLIENT_READ_ERROR if an error happens, CLIENT_READ_CLOSED if the client
-// closes the connection, CLIENT_READ_INCOMPLETE if the file descriptor is not
-// yet ready to finish reading, or CLIENT_READ_SUCCESS if the read was
-// successfully finished.
-int read_buffer(int fd, char *buffer, size_t buffer_size,
-                size_t *total_bytes_read) {
-  while (*total_bytes_read < buffer_size) {
-    // Remaining amount of bytes to read into the buffer.
+// Reads from the given file descriptor into the given buffer up to the given
+// size, keeping track of the total bytes read in total_bytes_read. The bytes
+// already received are taken out of the given ring buffer first. Once it's
+// empty, what's left to read is read straight into the given buffer if it
+// would fill the whole ring buffer, or into the ring buffer with a read as
+// large as the room left in it otherwise, so that the bytes of the next fields
+// and requests come along. Returns CLIENT_READ_ERROR if an error happens,
+// CLIENT_READ_CLOSED if the client closes the connection,
+// CLIENT_READ_INCOMPLETE if the file descriptor is not yet ready to finish
+// reading, or CLIENT_READ_SUCCESS if the read was successfully finished.
+int read_buffered(int fd, struct RingBuffer *input, char *buffer,
+                  size_t buffer_size, size_t *total_bytes_read) {
+  while (true) {
+    *total_bytes_read +=
+        ring_buffer_take(input, buffer + *total_bytes_read,
+                         buffer_size - *total_bytes_read);
+    if (*total_bytes_read == buffer_size) {
+      return CLIENT_READ_SUCCESS;
+    }
+
+    // The ring buffer is empty if we're here.
     size_t remaining_bytes = buffer_size - *total_bytes_read;
-    // Pointer to the start of the "empty" read buffer.
-    char *remaining_buffer = buffer + *total_bytes_read;
+    ssize_t nread;
+    if (remaining_bytes >= input->capacity) {
+      nread = read(fd, buffer + *total_bytes_read, remaining_bytes);
+      if (nread > 0) {
+        *total_bytes_read += nread;
+      }
+    } else {
+      nread = ring_buffer_fill(input, fd);
+    }
 
-    ssize_t nread = read(fd, remaining_buffer, remaining_bytes);
     if (nread == -1) {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
         // The client is not ready to ready yet.
@@ -75,22 +114,16 @@ int read_buffer(int fd, char *buffer, size_t buffer_size,
       }
 
       // Some other error happened.
-      perror("read_buffer read");
+      perror("read_buffered read");
       return CLIENT_READ_ERROR;
     } else if (nread == 0) {
       // Client disconnected gracefully.
       return CLIENT_READ_CLOSED;
     }
-
-    // Update the counter.
-    *total_bytes_read += nread;
   }
-
-  // We should've finished reading successfully!
-  return CLIENT_READ_SUCCESS;
 }
 
-#define STATS_CONTENT_MAX_SIZE 256
+#define STATS_CONTENT_MAX_SIZE 4096
 
 // Handles the STATS command and mutates the EventData instance accordingly.
 void handle_stats(struct EventData *event_data, struct WorkerArgs *args) {
@@ -101,13 +134,70 @@ void handle_stats(struct EventData *event_data, struct WorkerArgs *args) {
   worker_stats_reduce(args->workers_stats, args->num_workers,
                       &aggregated_stats);
   uint64_t num_keys = hashtable_key_count(args->hashtable);
+  uint64_t stored_bytes = hashtable_stored_bytes(args->hashtable);
+  uint64_t num_expired = hashtable_expired_count(args->hashtable);
+  uint64_t num_foreground_evictions =
+      hashtable_foreground_evictions(args->hashtable);
+  uint64_t num_background_evictions =
+      hashtable_background_evictions(args->hashtable);
+  uint64_t num_spilled = hashtable_spilled_count(args->hashtable);
+  uint64_t num_snapshots =
+      args->snapshot == NULL ? 0 : snapshot_count(args->snapshot);
+  double fragmentation = hashtable_fragmentation_ratio(args->hashtable);
+  double compression_ratio =
+      aggregated_stats.compressed_bytes == 0
+          ? 1
+          : (double)aggregated_stats.uncompressed_bytes /
+                aggregated_stats.compressed_bytes;
 
   int bytes_written =
       snprintf(stats_content, STATS_CONTENT_MAX_SIZE,
-               "PUTS=%ld DELS=%ld GETS=%ld TAKES=%ld STATS=%ld KEYS=%ld",
+               "PUTS=%ld DELS=%ld GETS=%ld TAKES=%ld STATS=%ld KEYS=%ld "
+               "GET_HITS=%ld BYTES=%ld BUDGET=%ld EXPIRED=%ld "
+               "FG_EVICTIONS=%ld BG_EVICTIONS=%ld FRAGMENTATION=%.2f "
+               "COMPRESSION_RATIO=%.2f SPILLED=%ld SNAPSHOTS=%ld",
                aggregated_stats.put_count, aggregated_stats.del_count,
                aggregated_stats.get_count, aggregated_stats.take_count,
-               aggregated_stats.stats_count, num_keys);
+               aggregated_stats.stats_count, num_keys,
+               aggregated_stats.get_hit_count, stored_bytes,
+               args->hashtable->memory_budget, num_expired,
+               num_foreground_evictions, num_background_evictions,
+               fragmentation, compression_ratio, num_spilled, num_snapshots);
+
+  // Append the number of keys in each shard of the usage queue, separated by
+  // commas.
+  uint64_t num_shards = hashtable_num_usage_shards(args->hashtable);
+  for (uint64_t i = 0; i < num_shards; i++) {
+    if (bytes_written >= STATS_CONTENT_MAX_SIZE) {
+      break;
+    }
+    bytes_written += snprintf(
+        stats_content + bytes_written, STATS_CONTENT_MAX_SIZE - bytes_written,
+        "%s%ld", i == 0 ? " LRU_SHARDS=" : ",",
+        hashtable_usage_shard_size(args->hashtable, i));
+  }
+
+  // Append the statistics of the size classes of the slab allocator that own
+  // pages, separated by commas, as CHUNK_SIZE:PAGES:USED_CHUNKS:FREE_CHUNKS.
+  // The chunk size of the class of large items is 0.
+  bool first_class = true;
+  for (uint64_t i = 0; i < slab_num_classes(); i++) {
+    struct SlabClassStats slab_stats;
+    slab_class_stats(i, &slab_stats);
+    if (slab_stats.num_pages == 0 || bytes_written >= STATS_CONTENT_MAX_SIZE) {
+      continue;
+    }
+    bytes_written += snprintf(
+        stats_content + bytes_written, STATS_CONTENT_MAX_SIZE - bytes_written,
+        "%s%ld:%ld:%ld:%ld", first_class ? " SLABS=" : ",",
+        slab_stats.chunk_size, slab_stats.num_pages, slab_stats.used_chunks,
+        slab_stats.free_chunks);
+    first_class = false;
+  }
+  if (bytes_written >= STATS_CONTENT_MAX_SIZE) {
+    // Just in case, the output was truncated.
+    bytes_written = STATS_CONTENT_MAX_SIZE - 1;
+  }
 
   event_data->response_content =
       hashtable_malloc_evict_bounded_data(args->hashtable, bytes_written);
@@ -123,6 +213,27 @@ void handle_stats(struct EventData *event_data, struct WorkerArgs *args) {
   args->workers_stats[args->worker_id].stats_count++;
 }
 
+// Handles the SNAPSHOT command and mutates the EventData instance accordingly.
+// The snapshot is written in the background, so the response doesn't wait for
+// it: BT_OK means that it started, and BT_EINVAL that there is no snapshot file
+// or that a snapshot is already being written.
+void handle_snapshot(struct EventData *event_data, struct WorkerArgs *args) {
+  if (args->snapshot != NULL && snapshot_start(args->snapshot)) {
+    event_data->response_type = BT_OK;
+  } else {
+    event_data->response_type = BT_EINVAL;
+  }
+}
+
+// Handles the ACCEPT_COMPRESSED command and mutates the EventData instance
+// accordingly. From then on GET and TAKE respond to the client with
+// BT_OK_COMPRESSED and the value as it's stored when it's compressed, instead
+// of decompressing it.
+void handle_accept_compressed(struct EventData *event_data) {
+  event_data->accepts_compressed = true;
+  event_data->response_type = BT_OK;
+}
+
 // Handles the DEL command and mutates the EventData instance accordingly.
 // WARNING: does not free the `key` pointer.
 void handle_del(struct EventData *event_data, struct WorkerArgs *args,
@@ -136,19 +247,178 @@ void handle_del(struct EventData *event_data, struct WorkerArgs *args,
   args->workers_stats[args->worker_id].del_count++;
 }
 
+// Decompresses the given value, written by compress_item, into a buffer of its
+// own. Returns NULL if there isn't enough memory for the buffer or the value is
+// corrupt, which can happen to values read back from a file.
+static struct BoundedData *decompress_value(struct WorkerArgs *args,
+                                            const char *data, size_t size) {
+  uint32_t original_size;
+  if (size < sizeof(original_size)) {
+    fprintf(stderr, "decompress_value: corrupt compressed value\n");
+    return NULL;
+  }
+  memcpy(&original_size, data, sizeof(original_size));
+  original_size = ntohl(original_size);
+  size -= sizeof(original_size);
+  // Check the size before allocating it, since it may be corrupt as well.
+  if (original_size > (uint64_t)size * COMPRESSION_MAX_RATIO) {
+    fprintf(stderr, "decompress_value: corrupt compressed value\n");
+    return NULL;
+  }
+  struct BoundedData *value =
+      hashtable_malloc_evict_bounded_data(args->hashtable, original_size);
+  if (value == NULL) {
+    return NULL;
+  }
+  if (!compression_decompress(data + sizeof(original_size), size, value->data,
+                              original_size)) {
+    fprintf(stderr, "decompress_value: corrupt compressed value\n");
+    bounded_data_destroy(value);
+    return NULL;
+  }
+  return value;
+}
+
+// Completes the read of a value from the extension store: sets the value as
+// the response of the client, or BT_ENOTFOUND if the value was gone, and adds
+// the client back to the epoll interest list to write it. Called from a reader
+// thread of the extension store.
+static void pending_read_done(struct ExtStoreRead *read) {
+  struct PendingRead *pending = read->data;
+  struct EventData *event_data = pending->event_data;
+
+  if (!read->success) {
+    // The segment of the value was reused before it could be read.
+    bounded_data_destroy(pending->value);
+    event_data->response_type = BT_ENOTFOUND;
+  } else if (read->location.compressed && event_data->accepts_compressed) {
+    event_data->response_content = pending->value;
+    event_data->response_type = BT_OK_COMPRESSED;
+  } else if (read->location.compressed) {
+    event_data->response_content = decompress_value(
+        pending->args, pending->value->data, pending->value->size);
+    bounded_data_destroy(pending->value);
+    if (event_data->response_content == NULL) {
+      event_data->response_type = BT_EUNK;
+    }
+  } else {
+    event_data->response_content = pending->value;
+  }
+  item_release(pending->item);
+
+  struct epoll_event event;
+  event.data.ptr = event_data;
+  if (pending->args->event_loops == EVENT_LOOPS_PER_WORKER) {
+    // The client was taken out of the epoll instance of its worker while the
+    // value was read, and adding it back reports that it's ready to write.
+    event.events = EPOLL_WORKER_CLIENT_EVENTS;
+    if (epoll_ctl(pending->args->epoll_fd, EPOLL_CTL_ADD, event_data->fd,
+                  &event) == -1) {
+      perror("pending_read_done epoll_ctl");
+    }
+  } else {
+    epoll_mod_client(pending->args->epoll_fd, &event, EPOLLOUT);
+  }
+  free(pending);
+}
+
+// Starts reading the value of the response of the given client back from the
+// extension store, see handle_get. The client must not be touched afterwards:
+// once the value is read, the client is added back to the epoll interest list
+// to write the response.
+void submit_pending_read(struct EventData *event_data) {
+  struct PendingRead *pending = event_data->pending_read;
+  event_data->pending_read = NULL;
+  if (pending->args->event_loops == EVENT_LOOPS_PER_WORKER) {
+    // The client is never disarmed, so take it out of the epoll instance to
+    // keep its worker away from it until the value is read.
+    if (epoll_ctl(pending->args->epoll_fd, EPOLL_CTL_DEL, event_data->fd,
+                  NULL) == -1) {
+      perror("submit_pending_read epoll_ctl");
+    }
+  }
+  extstore_read_async(pending->args->hashtable->extstore, &pending->read);
+}
+
+// Leaves the read of the value of the given item, which is in the extension
+// store, pending in the given client, see submit_pending_read. The reference
+// of the caller to the item is released once the read is done. Returns false
+// if there isn't enough memory for the read.
+static bool set_pending_read(struct EventData *event_data,
+                             struct WorkerArgs *args, struct Item *item) {
+  struct PendingRead *pending =
+      hashtable_malloc_evict(args->hashtable, sizeof(struct PendingRead));
+  if (pending == NULL) {
+    item_release(item);
+    return false;
+  }
+  memcpy(&pending->read.location, item_value(item),
+         sizeof(struct ExtStoreLocation));
+  pending->value = hashtable_malloc_evict_bounded_data(
+      args->hashtable, pending->read.location.value_size);
+  if (pending->value == NULL) {
+    free(pending);
+    item_release(item);
+    return false;
+  }
+  pending->read.key = item_key(item);
+  pending->read.key_size = item->key_size;
+  pending->read.destination = pending->value->data;
+  pending->read.done = pending_read_done;
+  pending->read.data = pending;
+  pending->event_data = event_data;
+  pending->args = args;
+  pending->item = item;
+  event_data->pending_read = pending;
+  return true;
+}
+
+// Sets the value of the given item as the response of the given client,
+// releasing the reference of the caller to the item once it's no longer
+// needed. Uncompressed values are written straight from the item, which stays
+// pinned until the response is cleared, while compressed ones are decompressed
+// into a buffer of their own, and the ones in the extension store are read
+// back into one. Compressed values are written as they're stored to clients
+// that accept them, with BT_OK_COMPRESSED. The response type is BT_EUNK if
+// there isn't enough memory for the buffer or the value can't be decompressed.
+static void set_response_value(struct EventData *event_data,
+                               struct WorkerArgs *args, struct Item *item) {
+  event_data->response_type = BT_OK;
+  if (item->spilled) {
+    if (!set_pending_read(event_data, args, item)) {
+      event_data->response_type = BT_EUNK;
+    }
+    return;
+  }
+  if (!item->compressed) {
+    event_data_set_response_item(event_data, item);
+    return;
+  }
+  if (event_data->accepts_compressed) {
+    event_data_set_response_item(event_data, item);
+    event_data->response_type = BT_OK_COMPRESSED;
+    return;
+  }
+
+  event_data->response_content =
+      decompress_value(args, item_value(item), item->value_size);
+  item_release(item);
+  if (event_data->response_content == NULL) {
+    event_data->response_type = BT_EUNK;
+  }
+}
+
 // Handles the GET command and mutates the EventData instance accordingly.
 // WARNING: does not free the `key` pointer.
 void handle_get(struct EventData *event_data, struct WorkerArgs *args,
                 struct BoundedData *key) {
-  struct BoundedData *value = NULL;
-  int rv = hashtable_get(args->hashtable, key, &value);
+  struct Item *item = NULL;
+  int rv = hashtable_get(args->hashtable, key, &item);
   if (rv == HT_FOUND) {
-    event_data->response_type = BT_OK;
-    event_data->response_content = value;
-  } else if (rv == HT_NOTFOUND) {
-    event_data->response_type = BT_ENOTFOUND;
+    set_response_value(event_data, args, item);
+    args->workers_stats[args->worker_id].get_hit_count++;
   } else {
-    event_data->response_type = BT_EUNK;
+    event_data->response_type = BT_ENOTFOUND;
   }
   args->workers_stats[args->worker_id].get_count++;
 }
@@ -157,27 +427,74 @@ void handle_get(struct EventData *event_data, struct WorkerArgs *args,
 // WARNING: does not free the `key` pointer.
 void handle_take(struct EventData *event_data, struct WorkerArgs *args,
                  struct BoundedData *key) {
-  struct BoundedData *value = NULL;
-  int rv = hashtable_take(args->hashtable, key, &value);
+  struct Item *item = NULL;
+  int rv = hashtable_take(args->hashtable, key, &item);
   if (rv == HT_FOUND) {
-    event_data->response_type = BT_OK;
-    event_data->response_content = value;
+    set_response_value(event_data, args, item);
   } else {
     event_data->response_type = BT_ENOTFOUND;
   }
   args->workers_stats[args->worker_id].take_count++;
 }
 
+// Returns a copy of the given item with its value compressed if compression is
+// enabled, the value takes at least COMPRESSION_MIN_VALUE_SIZE bytes and
+// compressing it saves at least COMPRESSION_MIN_SAVINGS_PERCENT of them, in
+// which case the reference of the caller to the given item is released.
+// Otherwise returns the given item as is.
+static struct Item *compress_item(struct WorkerArgs *args, struct Item *item) {
+  if (args->compression == COMPRESSION_NONE ||
+      item->value_size < COMPRESSION_MIN_VALUE_SIZE) {
+    return item;
+  }
+
+  // Only keep the compressed value if it saves enough, header included.
+  uint32_t original_size = item->value_size;
+  size_t capacity = (uint64_t)original_size *
+                        (100 - COMPRESSION_MIN_SAVINGS_PERCENT) / 100 -
+                    sizeof(original_size);
+  char *buffer = malloc(capacity);
+  if (buffer == NULL) {
+    // Store the value as it comes instead.
+    return item;
+  }
+  size_t compressed_size =
+      compression_compress(item_value(item), original_size, buffer, capacity);
+  if (compressed_size == 0) {
+    free(buffer);
+    return item;
+  }
+
+  struct Item *compressed_item = hashtable_create_item(
+      args->hashtable, item->key_size, sizeof(original_size) + compressed_size,
+      item->expires ? 1 : 0);
+  if (compressed_item == NULL) {
+    free(buffer);
+    return item;
+  }
+  memcpy(item_key(compressed_item), item_key(item), item->key_size);
+  uint32_t header = htonl(original_size);
+  memcpy(item_value(compressed_item), &header, sizeof(header));
+  memcpy(item_value(compressed_item) + sizeof(original_size), buffer,
+         compressed_size);
+  compressed_item->compressed = true;
+  if (item->expires) {
+    item_timer(compressed_item)->expiration = item_timer(item)->expiration;
+  }
+  free(buffer);
+
+  args->workers_stats[args->worker_id].uncompressed_bytes += original_size;
+  args->workers_stats[args->worker_id].compressed_bytes +=
+      compressed_item->value_size;
+  item_release(item);
+  return compressed_item;
+}
+
 // Handles the PUT command and mutates the EventData instance accordingly.
-// WARNING: the key and value pointer are owned by the hash table after the
-// operation.
+// WARNING: the item pointer is owned by the hash table after the operation.
 void handle_put(struct EventData *event_data, struct WorkerArgs *args,
-                struct BoundedData *key, struct BoundedData *value) {
-  int rv = hashtable_insert(args->hashtable, key, value);
-  if (rv == HT_ERROR) {
-    event_data->response_type = BT_EUNK;
-  } else {
-    event_data->response_type = BT_OK;
-    args->workers_stats[args->worker_id].put_count++;
-  }
+                struct Item *item) {
+  hashtable_insert(args->hashtable, compress_item(args, item));
+  event_data->response_type = BT_OK;
+  args->workers_stats[args->worker_id].put_count++;
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include <stddef.h>    // for size_t
 #include <sys/epoll.h> // for struct epoll_event
+#include <sys/uio.h>   // for struct iovec
 
 #include "epoll.h"        // for struct EventData
 #include "worker_state.h" // for struct WorkerArgs
@@ -15,54 +16,95 @@
 #define CLIENT_WRITE_ERROR -2001
 #define CLIENT_WRITE_SUCCESS 2001
 #define CLIENT_WRITE_INCOMPLETE 2002
+#define CLIENT_WRITE_PENDING 2003
+
+// Events that the clients of an epoll instance of a single worker are
+// registered for, see EVENT_LOOPS_PER_WORKER. They're never disarmed.
+#define EPOLL_WORKER_CLIENT_EVENTS (EPOLLIN | EPOLLOUT | EPOLLET)
+
+// A GET or TAKE whose value is being read back from the extension store.
+struct PendingRead {
+  struct ExtStoreRead read;
+  struct EventData *event_data; // Client the value is for.
+  struct WorkerArgs *args;      // Arguments of the worker of the request.
+  // Item with the location of the value, pinned until the read is done.
+  struct Item *item;
+  struct BoundedData *value; // Value as stored, compressed or not.
+};
 
 // Adds the given client event back to the epoll interest list. Returns 0 if
 // successful, -1 otherwise.
 int epoll_mod_client(int epoll_fd, struct epoll_event *event,
                      uint32_t event_flag);
 
-// Writes the given buffer with the given size into the client socket's file
+// Writes the given buffers, one after the other, into the client socket's file
 // descriptor, assuming that the amount of bytes in the value pointed at by
-// `total_bytes_written` were already sent. If the whole buffer is correctly
+// `total_bytes_written` were already sent. They're written together with as
+// few system calls as possible, so that a response goes out in one packet and
+// the buffers are modified to skip what was sent. If all of them are correctly
 // sent then CLIENT_WRITE_SUCCESS is returned and the value pointed at by
 // `total_bytes_written` is updated to reflect this. If it's not possible to
-// write the whole buffer, the value pointed at by `total_bytes_written` is
-// updated to the new amount written and CLIENT_WRITE_INCOMPLETE is
-// returned. If an error happens then CLIENT_WRITE_ERROR is returned.
-int write_buffer(int fd, char *buffer, size_t buffer_length,
-                 size_t *total_bytes_written);
+// write all of them, the value pointed at by `total_bytes_written` is updated
+// to the new amount written and CLIENT_WRITE_INCOMPLETE is returned. If an
+// error happens then CLIENT_WRITE_ERROR is returned.
+int write_buffers(int fd, struct iovec *buffers, int num_buffers,
+                  size_t *total_bytes_written);
 
 // Reads from the given file descriptor into the given buffer up to the given
-// size, keeping track of the total bytes read in total_bytes_read. Returns
-// CLIENT_READ_ERROR if an error happens, CLIENT_READ_CLOSED if the client
-// closes the connection, CLIENT_READ_INCOMPLETE if the file descriptor is not
-// yet ready to finish reading, or CLIENT_READ_SUCCESS if the read was
-// successfully finished.
-int read_buffer(int fd, char *buffer, size_t buffer_size,
-                size_t *total_bytes_read);
+// size, keeping track of the total bytes read in total_bytes_read. The bytes
+// already received are taken out of the given ring buffer first. Once it's
+// empty, what's left to read is read straight into the given buffer if it
+// would fill the whole ring buffer, or into the ring buffer with a read as
+// large as the room left in it otherwise, so that the bytes of the next fields
+// and requests come along. Returns CLIENT_READ_ERROR if an error happens,
+// CLIENT_READ_CLOSED if the client closes the connection,
+// CLIENT_READ_INCOMPLETE if the file descriptor is not yet ready to finish
+// reading, or CLIENT_READ_SUCCESS if the read was successfully finished.
+int read_buffered(int fd, struct RingBuffer *input, char *buffer,
+                  size_t buffer_size, size_t *total_bytes_read);
+
+// Starts reading the value of the response of the given client back from the
+// extension store, see handle_get. The client must not be touched afterwards:
+// once the value is read, the client is added back to the epoll interest list
+// to write the response.
+void submit_pending_read(struct EventData *event_data);
 
 // Handles the STATS command and mutates the EventData instance accordingly.
 void handle_stats(struct EventData *event_data, struct WorkerArgs *args);
 
+// Handles the SNAPSHOT command and mutates the EventData instance accordingly.
+// The snapshot is written in the background, so the response doesn't wait for
+// it: BT_OK means that it started, and BT_EINVAL that there is no snapshot file
+// or that a snapshot is already being written.
+void handle_snapshot(struct EventData *event_data, struct WorkerArgs *args);
+
+// Handles the ACCEPT_COMPRESSED command and mutates the EventData instance
+// accordingly. From then on GET and TAKE respond to the client with
+// BT_OK_COMPRESSED and the value as it's stored when it's compressed, instead
+// of decompressing it.
+void handle_accept_compressed(struct EventData *event_data);
+
 // Handles the DEL command and mutates the EventData instance accordingly.
 // WARNING: does not free the `key` pointer.
 void handle_del(struct EventData *event_data, struct WorkerArgs *args,
                 struct BoundedData *key);
 
-// Handles the GET command and mutates the EventData instance accordingly.
+// Handles the GET command and mutates the EventData instance accordingly. If
+// the value is in the extension store, its read is left pending in the
+// EventData instance, and the request handler returns CLIENT_WRITE_PENDING.
 // WARNING: does not free the `key` pointer.
 void handle_get(struct EventData *event_data, struct WorkerArgs *args,
                 struct BoundedData *key);
 
-// Handles the TAKE command and mutates the EventData instance accordingly.
+// Handles the TAKE command and mutates the EventData instance accordingly,
+// like handle_get.
 // WARNING: does not free the `key` pointer.
 void handle_take(struct EventData *event_data, struct WorkerArgs *args,
                  struct BoundedData *key);
 
 // Handles the PUT command and mutates the EventData instance accordingly.
-// WARNING: the key and value pointer are owned by the hash table after the
-// operation.
+// WARNING: the item pointer is owned by the hash table after the operation.
 void handle_put(struct EventData *event_data, struct WorkerArgs *args,
-                struct BoundedData *key, struct BoundedData *value);
+                struct Item *item);
 
 #endif
\ No newline at end of file
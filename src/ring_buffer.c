@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "ring_buffer.h"
+
+// Allocates an empty ring buffer of the given capacity. Returns NULL if there's
+// not enough memory for it.
+struct RingBuffer *ring_buffer_create(size_t capacity) {
+  struct RingBuffer *ring_buffer = malloc(sizeof(struct RingBuffer));
+  if (ring_buffer == NULL) {
+    return NULL;
+  }
+  ring_buffer->data = malloc(capacity);
+  if (ring_buffer->data == NULL) {
+    free(ring_buffer);
+    return NULL;
+  }
+  ring_buffer->capacity = capacity;
+  ring_buffer->start = 0;
+  ring_buffer->length = 0;
+  return ring_buffer;
+}
+
+// De-allocates memory for the given ring buffer.
+void ring_buffer_destroy(struct RingBuffer *ring_buffer) {
+  free(ring_buffer->data);
+  free(ring_buffer);
+}
+
+// Moves up to the given number of bytes out of the ring buffer into the given
+// destination. Returns the number of bytes moved.
+size_t ring_buffer_take(struct RingBuffer *ring_buffer, char *destination,
+                        size_t size) {
+  if (size > ring_buffer->length) {
+    size = ring_buffer->length;
+  }
+
+  // The bytes might wrap around the end of the buffer.
+  size_t first_size = ring_buffer->capacity - ring_buffer->start;
+  if (first_size > size) {
+    first_size = size;
+  }
+  memcpy(destination, ring_buffer->data + ring_buffer->start, first_size);
+  memcpy(destination + first_size, ring_buffer->data, size - first_size);
+
+  ring_buffer->start = (ring_buffer->start + size) % ring_buffer->capacity;
+  ring_buffer->length -= size;
+  if (ring_buffer->length == 0) {
+    // Start over so that the next fill gets the whole buffer in one piece.
+    ring_buffer->start = 0;
+  }
+  return size;
+}
+
+// Like ring_buffer_take, but stops right after the first newline character.
+size_t ring_buffer_take_line(struct RingBuffer *ring_buffer, char *destination,
+                             size_t size) {
+  if (size > ring_buffer->length) {
+    size = ring_buffer->length;
+  }
+
+  // Look for the newline in the bytes up to the end of the buffer first, and
+  // then in the ones that wrapped around it.
+  size_t first_size = ring_buffer->capacity - ring_buffer->start;
+  if (first_size > size) {
+    first_size = size;
+  }
+  char *newline =
+      memchr(ring_buffer->data + ring_buffer->start, '\n', first_size);
+  if (newline != NULL) {
+    size = newline - (ring_buffer->data + ring_buffer->start) + 1;
+  } else {
+    newline = memchr(ring_buffer->data, '\n', size - first_size);
+    if (newline != NULL) {
+      size = first_size + (newline - ring_buffer->data) + 1;
+    }
+  }
+
+  return ring_buffer_take(ring_buffer, destination, size);
+}
+
+// Reads from the given file descriptor into the room left in the ring buffer
+// with a single system call. Returns what read returns.
+ssize_t ring_buffer_fill(struct RingBuffer *ring_buffer, int fd) {
+  // The room left goes from the end of the bytes to the start of the buffer,
+  // which might wrap around the end of the buffer.
+  size_t end =
+      (ring_buffer->start + ring_buffer->length) % ring_buffer->capacity;
+  size_t room = ring_buffer->capacity - ring_buffer->length;
+  struct iovec spans[2];
+  int num_spans = 1;
+  spans[0].iov_base = ring_buffer->data + end;
+  spans[0].iov_len = ring_buffer->capacity - end;
+  if (spans[0].iov_len >= room) {
+    spans[0].iov_len = room;
+  } else {
+    spans[1].iov_base = ring_buffer->data;
+    spans[1].iov_len = room - spans[0].iov_len;
+    num_spans = 2;
+  }
+
+  ssize_t nread = readv(fd, spans, num_spans);
+  if (nread > 0) {
+    ring_buffer->length += nread;
+  }
+  return nread;
+}
@@ -0,0 +1,38 @@
+#ifndef __RING_BUFFER_H__
+#define __RING_BUFFER_H__
+
+#include <stddef.h>    // for size_t
+#include <sys/types.h> // for ssize_t
+
+// Ring buffer of the bytes received from a connection that weren't parsed yet.
+// It's filled with reads as large as the room left in it, and the bytes are
+// taken out in the order they came, so that small fields don't need a system
+// call each.
+struct RingBuffer {
+  char *data;
+  size_t capacity;
+  size_t start;  // Position of the first byte in the buffer.
+  size_t length; // Bytes in the buffer.
+};
+
+// Allocates an empty ring buffer of the given capacity. Returns NULL if there's
+// not enough memory for it.
+struct RingBuffer *ring_buffer_create(size_t capacity);
+
+// De-allocates memory for the given ring buffer.
+void ring_buffer_destroy(struct RingBuffer *ring_buffer);
+
+// Moves up to the given number of bytes out of the ring buffer into the given
+// destination. Returns the number of bytes moved.
+size_t ring_buffer_take(struct RingBuffer *ring_buffer, char *destination,
+                        size_t size);
+
+// Like ring_buffer_take, but stops right after the first newline character.
+size_t ring_buffer_take_line(struct RingBuffer *ring_buffer, char *destination,
+                             size_t size);
+
+// Reads from the given file descriptor into the room left in the ring buffer
+// with a single system call. Returns what read returns.
+ssize_t ring_buffer_fill(struct RingBuffer *ring_buffer, int fd);
+
+#endif
@@ -0,0 +1,555 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "parameters.h"
+#include "slab.h"
+
+// Upper bound for the number of size classes, the large class included.
+#define SLAB_MAX_CLASSES 64
+
+// Value of the class of the pages that are not owned by any class.
+#define SLAB_PAGE_FREE -1
+
+// Header of a page of the region. Headers are kept apart from the pages, so
+// the whole page is available for chunks.
+struct SlabPage {
+  // Neighbours in the list of pages of the class with free chunks.
+  struct SlabPage *next;
+  struct SlabPage *prev;
+  char *free_chunks;   // Freed chunks, linked through their first bytes.
+  uint64_t num_carved; // Chunks handed out at least once. The rest of the page
+                       // was never touched.
+  uint64_t num_used;   // Chunks in use.
+  uint64_t run_length; // Pages of the run, on the first page of large ones.
+  int64_t slab_class;  // Owner of the page or SLAB_PAGE_FREE.
+  bool committed;      // Readable and writable.
+  // Being compacted: no chunks are allocated from the page, and it goes back
+  // to the region as soon as its last chunk is freed.
+  bool draining;
+};
+
+struct SlabClass {
+  pthread_mutex_t mutex;
+  uint64_t chunk_size;        // 0 for the large class.
+  uint64_t chunks_per_page;   // 0 for the large class.
+  struct SlabPage *free_list; // Pages with free chunks.
+  uint64_t num_pages;
+  uint64_t used_chunks;
+};
+
+static char *slab_memory = NULL;
+static uint64_t slab_num_pages = 0;
+static struct SlabPage *slab_pages = NULL;
+static pthread_mutex_t slab_pages_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct SlabClass slab_classes[SLAB_MAX_CLASSES];
+static uint64_t slab_large_class = 0;
+
+// Runs of pages waiting for the release thread to return their memory to the
+// system, linked through the next field of their first page. They still belong
+// to their class until then, so that no one takes them in the meantime.
+static struct SlabPage *slab_release_list = NULL;
+static bool slab_release_running = false;
+static pthread_t slab_release_thread;
+static pthread_mutex_t slab_release_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slab_release_cond = PTHREAD_COND_INITIALIZER;
+
+// Reserves the given amount of memory (rounded down to whole pages) and sets
+// up the size classes. Must be called once, before any other slab function.
+void slab_initialize(uint64_t memory) {
+  slab_num_pages = memory / SLAB_PAGE_SIZE;
+  if (slab_num_pages == 0) {
+    fprintf(stderr, "slab_initialize: the memory is smaller than a page\n");
+    abort();
+  }
+
+  // Reserve address space only: pages don't count as used memory until
+  // they're committed.
+  slab_memory = mmap(NULL, slab_num_pages * SLAB_PAGE_SIZE, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (slab_memory == MAP_FAILED) {
+    perror("slab_initialize mmap");
+    abort();
+  }
+
+  slab_pages = malloc(sizeof(struct SlabPage) * slab_num_pages);
+  if (slab_pages == NULL) {
+    perror("slab_initialize malloc");
+    abort();
+  }
+  for (uint64_t i = 0; i < slab_num_pages; i++) {
+    slab_pages[i].slab_class = SLAB_PAGE_FREE;
+    slab_pages[i].committed = false;
+  }
+
+  // Chunks are kept 8-byte aligned, and classes stop at half a page so that
+  // every page holds at least two chunks.
+  uint64_t num_classes = 0;
+  uint64_t chunk_size = SLAB_MIN_CHUNK_SIZE;
+  while (chunk_size <= SLAB_PAGE_SIZE / 2 &&
+         num_classes < SLAB_MAX_CLASSES - 1) {
+    slab_classes[num_classes].chunk_size = chunk_size;
+    slab_classes[num_classes].chunks_per_page = SLAB_PAGE_SIZE / chunk_size;
+    num_classes++;
+    uint64_t next_size = (uint64_t)(chunk_size * SLAB_GROWTH_FACTOR);
+    if (next_size <= chunk_size) {
+      next_size = chunk_size + 8;
+    }
+    chunk_size = (next_size + 7) & ~7UL;
+  }
+  slab_large_class = num_classes;
+  slab_classes[slab_large_class].chunk_size = 0;
+  slab_classes[slab_large_class].chunks_per_page = 0;
+
+  for (uint64_t i = 0; i <= slab_large_class; i++) {
+    pthread_mutex_init(&slab_classes[i].mutex, NULL);
+    slab_classes[i].free_list = NULL;
+    slab_classes[i].num_pages = 0;
+    slab_classes[i].used_chunks = 0;
+  }
+}
+
+// Returns the number of size classes, including the large class, which is
+// always the last one.
+uint64_t slab_num_classes() { return slab_large_class + 1; }
+
+// Returns the size class that allocations of the given size come from.
+uint64_t slab_class_for(size_t size) {
+  if (size > slab_classes[slab_large_class - 1].chunk_size) {
+    return slab_large_class;
+  }
+
+  // Binary search for the smallest chunk size that fits.
+  uint64_t low = 0;
+  uint64_t high = slab_large_class - 1;
+  while (low < high) {
+    uint64_t middle = (low + high) / 2;
+    if (slab_classes[middle].chunk_size < size) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+// Returns the number of bytes that an allocation of the given size takes from
+// the slab allocator: the chunk size of its class, or whole pages for the large
+// class.
+uint64_t slab_alloc_size(size_t size) {
+  uint64_t slab_class = slab_class_for(size);
+  if (slab_class == slab_large_class) {
+    return (size + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE * SLAB_PAGE_SIZE;
+  }
+  return slab_classes[slab_class].chunk_size;
+}
+
+// Returns the address of the given page.
+static char *slab_page_address(struct SlabPage *page) {
+  return slab_memory + (page - slab_pages) * SLAB_PAGE_SIZE;
+}
+
+// Returns the page that holds the given pointer.
+static struct SlabPage *slab_page_of(void *ptr) {
+  return &slab_pages[((char *)ptr - slab_memory) / SLAB_PAGE_SIZE];
+}
+
+// Takes a run of the given number of contiguous free pages for the given class
+// and commits their memory. Returns the first page of the run, or NULL if
+// there's no such run or its memory can't be committed.
+static struct SlabPage *slab_acquire_pages(uint64_t num_pages,
+                                           uint64_t slab_class) {
+  pthread_mutex_lock(&slab_pages_mutex);
+
+  // First fit.
+  uint64_t run_start = 0;
+  uint64_t run_length = 0;
+  for (uint64_t i = 0; i < slab_num_pages && run_length < num_pages; i++) {
+    if (slab_pages[i].slab_class != SLAB_PAGE_FREE) {
+      run_length = 0;
+      continue;
+    }
+    if (run_length == 0) {
+      run_start = i;
+    }
+    run_length++;
+  }
+  if (run_length < num_pages) {
+    pthread_mutex_unlock(&slab_pages_mutex);
+    return NULL;
+  }
+
+  struct SlabPage *first_page = &slab_pages[run_start];
+  for (uint64_t i = 0; i < num_pages; i++) {
+    if (!first_page[i].committed) {
+      // The pages are committed only when needed, so that the memory of the
+      // process only grows with the items.
+      int rv = mprotect(slab_page_address(first_page),
+                        num_pages * SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE);
+      if (rv == -1) {
+        pthread_mutex_unlock(&slab_pages_mutex);
+        return NULL;
+      }
+      break;
+    }
+  }
+
+  for (uint64_t i = 0; i < num_pages; i++) {
+    struct SlabPage *page = &first_page[i];
+    page->next = NULL;
+    page->prev = NULL;
+    page->free_chunks = NULL;
+    page->num_carved = 0;
+    page->num_used = 0;
+    page->run_length = i == 0 ? num_pages : 0;
+    page->slab_class = slab_class;
+    page->committed = true;
+    page->draining = false;
+  }
+
+  pthread_mutex_unlock(&slab_pages_mutex);
+  return first_page;
+}
+
+// Returns the memory of the run of the given number of pages that starts at the
+// given page to the system, and gives the pages back to the region.
+static void slab_release_run(struct SlabPage *first_page, uint64_t num_pages) {
+  // Drop the contents and make the pages inaccessible, which stops them from
+  // counting towards the memory limit of the process. The run still belongs to
+  // its class, so the system calls don't need the mutex of the region, however
+  // large the run is.
+  char *address = slab_page_address(first_page);
+  uint64_t length = num_pages * SLAB_PAGE_SIZE;
+  bool released = madvise(address, length, MADV_DONTNEED) == 0 &&
+                  mprotect(address, length, PROT_NONE) == 0;
+
+  pthread_mutex_lock(&slab_pages_mutex);
+  for (uint64_t i = 0; i < num_pages; i++) {
+    first_page[i].slab_class = SLAB_PAGE_FREE;
+    first_page[i].committed = !released;
+  }
+  pthread_mutex_unlock(&slab_pages_mutex);
+}
+
+// Gives the run of the given number of pages that starts at the given page
+// back to the region, returning their memory to the system. If the release
+// thread is running the run is handed over to it, so that the thread freeing
+// the memory doesn't wait for the system calls.
+static void slab_release_pages(struct SlabPage *first_page,
+                               uint64_t num_pages) {
+  pthread_mutex_lock(&slab_release_mutex);
+  if (!slab_release_running) {
+    pthread_mutex_unlock(&slab_release_mutex);
+    slab_release_run(first_page, num_pages);
+    return;
+  }
+  first_page->run_length = num_pages;
+  first_page->next = slab_release_list;
+  slab_release_list = first_page;
+  pthread_cond_signal(&slab_release_cond);
+  pthread_mutex_unlock(&slab_release_mutex);
+}
+
+// Releases the runs of pages that are waiting for the release thread, from the
+// calling thread.
+static void slab_release_waiting_pages() {
+  pthread_mutex_lock(&slab_release_mutex);
+  struct SlabPage *page = slab_release_list;
+  slab_release_list = NULL;
+  pthread_mutex_unlock(&slab_release_mutex);
+
+  while (page != NULL) {
+    struct SlabPage *next = page->next;
+    slab_release_run(page, page->run_length);
+    page = next;
+  }
+}
+
+// Body of the release thread, which returns the memory of the runs of pages
+// that are freed to the system.
+static void *slab_release_loop(void *arg) {
+  pthread_mutex_lock(&slab_release_mutex);
+  while (true) {
+    while (slab_release_list == NULL) {
+      pthread_cond_wait(&slab_release_cond, &slab_release_mutex);
+    }
+    pthread_mutex_unlock(&slab_release_mutex);
+    slab_release_waiting_pages();
+    pthread_mutex_lock(&slab_release_mutex);
+  }
+  return NULL;
+}
+
+// Starts a thread that returns the memory of the pages freed by slab_free to
+// the system, so that freeing large allocations doesn't wait for the system
+// calls. Without it, slab_free makes them itself. The thread runs until the
+// process exits.
+void slab_start_release_thread() {
+  pthread_mutex_lock(&slab_release_mutex);
+  slab_release_running = true;
+  int rv = pthread_create(&slab_release_thread, NULL, slab_release_loop, NULL);
+  if (rv != 0) {
+    perror("slab_start_release_thread pthread_create");
+    abort();
+  }
+  pthread_mutex_unlock(&slab_release_mutex);
+}
+
+// Adds the given page to the list of pages with free chunks of the given
+// class. Assumes that the class mutex is acquired.
+static void slab_free_list_push(struct SlabClass *class,
+                                struct SlabPage *page) {
+  page->prev = NULL;
+  page->next = class->free_list;
+  if (class->free_list != NULL) {
+    class->free_list->prev = page;
+  }
+  class->free_list = page;
+}
+
+// Removes the given page from the list of pages with free chunks of the given
+// class. Assumes that the class mutex is acquired.
+static void slab_free_list_remove(struct SlabClass *class,
+                                  struct SlabPage *page) {
+  if (page->prev != NULL) {
+    page->prev->next = page->next;
+  } else {
+    class->free_list = page->next;
+  }
+  if (page->next != NULL) {
+    page->next->prev = page->prev;
+  }
+  page->next = NULL;
+  page->prev = NULL;
+}
+
+// Takes a run of the given number of contiguous free pages for the given class
+// like slab_acquire_pages, but if there's no such run it releases the pages
+// that are waiting for the release thread and tries again. Must be called
+// without the mutex of any class, since it may make system calls.
+static struct SlabPage *slab_acquire_pages_now(uint64_t num_pages,
+                                               uint64_t slab_class) {
+  struct SlabPage *first_page = slab_acquire_pages(num_pages, slab_class);
+  if (first_page == NULL) {
+    slab_release_waiting_pages();
+    first_page = slab_acquire_pages(num_pages, slab_class);
+  }
+  return first_page;
+}
+
+// Allocates memory of the given size from a run of pages of the large class.
+static void *slab_alloc_large(size_t size) {
+  uint64_t num_pages = (size + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE;
+  struct SlabPage *first_page =
+      slab_acquire_pages_now(num_pages, slab_large_class);
+  if (first_page == NULL) {
+    return NULL;
+  }
+
+  struct SlabClass *class = &slab_classes[slab_large_class];
+  pthread_mutex_lock(&class->mutex);
+  class->num_pages += num_pages;
+  class->used_chunks++;
+  pthread_mutex_unlock(&class->mutex);
+
+  return slab_page_address(first_page);
+}
+
+// Allocates memory of the given size from its size class. Returns NULL if the
+// class has no free chunks and no pages are left.
+void *slab_alloc(size_t size) {
+  uint64_t slab_class = slab_class_for(size);
+  if (slab_class == slab_large_class) {
+    return slab_alloc_large(size);
+  }
+
+  struct SlabClass *class = &slab_classes[slab_class];
+  pthread_mutex_lock(&class->mutex);
+
+  struct SlabPage *page = class->free_list;
+  if (page == NULL) {
+    // Every page of the class is full, take a new one. That may release the
+    // pages waiting for the release thread first, so the mutex of the class
+    // isn't held during the system calls. The page belongs to the class once
+    // taken, and other threads might add pages of their own in the meantime.
+    pthread_mutex_unlock(&class->mutex);
+    page = slab_acquire_pages_now(1, slab_class);
+    if (page == NULL) {
+      return NULL;
+    }
+    pthread_mutex_lock(&class->mutex);
+    slab_free_list_push(class, page);
+    class->num_pages++;
+  }
+
+  // Reuse freed chunks first, so that untouched memory stays untouched.
+  char *chunk;
+  if (page->free_chunks != NULL) {
+    chunk = page->free_chunks;
+    page->free_chunks = *(char **)chunk;
+  } else {
+    chunk = slab_page_address(page) + page->num_carved * class->chunk_size;
+    page->num_carved++;
+  }
+  page->num_used++;
+  class->used_chunks++;
+
+  if (page->num_used == class->chunks_per_page) {
+    slab_free_list_remove(class, page);
+  }
+
+  pthread_mutex_unlock(&class->mutex);
+  return chunk;
+}
+
+// De-allocates memory that was allocated with slab_alloc.
+void slab_free(void *ptr) {
+  struct SlabPage *page = slab_page_of(ptr);
+  struct SlabClass *class = &slab_classes[page->slab_class];
+
+  if (page->slab_class == (int64_t)slab_large_class) {
+    uint64_t num_pages = page->run_length;
+    pthread_mutex_lock(&class->mutex);
+    class->num_pages -= num_pages;
+    class->used_chunks--;
+    pthread_mutex_unlock(&class->mutex);
+    slab_release_pages(page, num_pages);
+    return;
+  }
+
+  pthread_mutex_lock(&class->mutex);
+
+  *(char **)ptr = page->free_chunks;
+  page->free_chunks = ptr;
+  if (page->num_used == class->chunks_per_page && !page->draining) {
+    // The page was full, so it wasn't in the list.
+    slab_free_list_push(class, page);
+  }
+  page->num_used--;
+  class->used_chunks--;
+
+  // Give empty pages back so that other classes can use them, but keep the
+  // last one with free chunks, so that a class that keeps allocating and
+  // freeing a single chunk doesn't take and release a page every time. Pages
+  // being compacted are not in the list, and always go back.
+  if (page->num_used == 0 && page->draining) {
+    page->draining = false;
+    class->num_pages--;
+    pthread_mutex_unlock(&class->mutex);
+    slab_release_pages(page, 1);
+    return;
+  }
+  if (page->num_used == 0 && (page->next != NULL || page->prev != NULL)) {
+    slab_free_list_remove(class, page);
+    class->num_pages--;
+    pthread_mutex_unlock(&class->mutex);
+    slab_release_pages(page, 1);
+    return;
+  }
+
+  pthread_mutex_unlock(&class->mutex);
+}
+
+// Picks the pages of the given size class that are worth compacting, up to the
+// given number of them, and stores their addresses in the given array. Returns
+// the number of pages picked. The pages with the fewest chunks in use are
+// picked first, as long as the rest of the pages of the class have room for
+// the chunks in use of the picked ones, so that moving them never takes new
+// pages. Until slab_compaction_end is called no chunks are allocated from the
+// picked pages, and they go back to the region once their last chunk is freed.
+uint64_t slab_compaction_begin(uint64_t slab_class, void **pages,
+                               uint64_t max_pages) {
+  if (slab_class == slab_large_class) {
+    // Runs of pages of the large class have no room to spare.
+    return 0;
+  }
+
+  struct SlabClass *class = &slab_classes[slab_class];
+  pthread_mutex_lock(&class->mutex);
+
+  // Every page that goes needs a page worth of free chunks in the others.
+  uint64_t free_chunks =
+      class->num_pages * class->chunks_per_page - class->used_chunks;
+  uint64_t num_pages = 0;
+  while (num_pages < max_pages &&
+         free_chunks >= (num_pages + 1) * class->chunks_per_page) {
+    struct SlabPage *sparsest = NULL;
+    for (struct SlabPage *page = class->free_list; page != NULL;
+         page = page->next) {
+      if (sparsest == NULL || page->num_used < sparsest->num_used) {
+        sparsest = page;
+      }
+    }
+    if (sparsest == NULL || sparsest->num_used * 100 >
+                                class->chunks_per_page *
+                                    SLAB_COMPACTION_MAX_USED_PERCENT) {
+      break;
+    }
+    slab_free_list_remove(class, sparsest);
+    sparsest->draining = true;
+    pages[num_pages++] = slab_page_address(sparsest);
+  }
+
+  pthread_mutex_unlock(&class->mutex);
+  return num_pages;
+}
+
+// Ends the compaction of the given pages of the given size class, picked by
+// slab_compaction_begin: the pages that still have chunks in use take
+// allocations again.
+void slab_compaction_end(uint64_t slab_class, void **pages,
+                         uint64_t num_pages) {
+  struct SlabClass *class = &slab_classes[slab_class];
+  pthread_mutex_lock(&class->mutex);
+  for (uint64_t i = 0; i < num_pages; i++) {
+    // Pages that were emptied might belong to another class by now, but then
+    // they are not draining anymore.
+    struct SlabPage *page = slab_page_of(pages[i]);
+    if (page->slab_class == (int64_t)slab_class && page->draining) {
+      page->draining = false;
+      slab_free_list_push(class, page);
+    }
+  }
+  pthread_mutex_unlock(&class->mutex);
+}
+
+// Returns true if the given chunk, allocated with slab_alloc, is in one of the
+// given pages.
+bool slab_in_pages(void *ptr, void **pages, uint64_t num_pages) {
+  for (uint64_t i = 0; i < num_pages; i++) {
+    if ((char *)ptr >= (char *)pages[i] &&
+        (char *)ptr < (char *)pages[i] + SLAB_PAGE_SIZE) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Returns the number of bytes of the pages owned by the size classes, which is
+// the memory of the items as far as the system is concerned.
+uint64_t slab_page_bytes() {
+  uint64_t num_pages = 0;
+  for (uint64_t i = 0; i <= slab_large_class; i++) {
+    pthread_mutex_lock(&slab_classes[i].mutex);
+    num_pages += slab_classes[i].num_pages;
+    pthread_mutex_unlock(&slab_classes[i].mutex);
+  }
+  return num_pages * SLAB_PAGE_SIZE;
+}
+
+// Fills the given struct with the statistics of the given size class.
+void slab_class_stats(uint64_t slab_class, struct SlabClassStats *stats) {
+  struct SlabClass *class = &slab_classes[slab_class];
+  pthread_mutex_lock(&class->mutex);
+  stats->chunk_size = class->chunk_size;
+  stats->num_pages = class->num_pages;
+  stats->used_chunks = class->used_chunks;
+  stats->free_chunks = class->chunks_per_page == 0
+                           ? 0
+                           : class->num_pages * class->chunks_per_page -
+                                 class->used_chunks;
+  pthread_mutex_unlock(&class->mutex);
+}
@@ -0,0 +1,84 @@
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Slab allocator for the items of the hash table.
+//////////////////////////////////////
+// Memory is reserved up front as a single region of address space, split into
+// pages of SLAB_PAGE_SIZE bytes that are only committed when first used. Each
+// size class carves chunks of a fixed size out of its own pages, with chunk
+// sizes growing geometrically by SLAB_GROWTH_FACTOR, and keeps the pages that
+// have free chunks in its own list. Allocations that are too large for every
+// class (the large class) take a run of contiguous pages instead. Pages left
+// without chunks in use go back to the region for any class to take, and
+// their memory is returned to the system, by a thread of its own if it was
+// started.
+
+// Statistics of a size class.
+struct SlabClassStats {
+  uint64_t chunk_size;  // Size of the chunks, 0 for the large class.
+  uint64_t num_pages;   // Pages owned by the class.
+  uint64_t used_chunks; // Chunks in use (allocations for the large class).
+  uint64_t free_chunks; // Chunks available in the pages of the class.
+};
+
+// Reserves the given amount of memory (rounded down to whole pages) and sets
+// up the size classes. Must be called once, before any other slab function.
+void slab_initialize(uint64_t memory);
+
+// Returns the number of size classes, including the large class, which is
+// always the last one.
+uint64_t slab_num_classes();
+
+// Returns the size class that allocations of the given size come from.
+uint64_t slab_class_for(size_t size);
+
+// Returns the number of bytes that an allocation of the given size takes from
+// the slab allocator: the chunk size of its class, or whole pages for the large
+// class.
+uint64_t slab_alloc_size(size_t size);
+
+// Allocates memory of the given size from its size class. Returns NULL if the
+// class has no free chunks and no pages are left.
+void *slab_alloc(size_t size);
+
+// De-allocates memory that was allocated with slab_alloc.
+void slab_free(void *ptr);
+
+// Starts a thread that returns the memory of the pages freed by slab_free to
+// the system, so that freeing large allocations doesn't wait for the system
+// calls. Without it, slab_free makes them itself. The thread runs until the
+// process exits.
+void slab_start_release_thread();
+
+// Picks the pages of the given size class that are worth compacting, up to the
+// given number of them, and stores their addresses in the given array. Returns
+// the number of pages picked. The pages with the fewest chunks in use are
+// picked first, as long as the rest of the pages of the class have room for
+// the chunks in use of the picked ones, so that moving them never takes new
+// pages. Until slab_compaction_end is called no chunks are allocated from the
+// picked pages, and they go back to the region once their last chunk is freed.
+uint64_t slab_compaction_begin(uint64_t slab_class, void **pages,
+                               uint64_t max_pages);
+
+// Ends the compaction of the given pages of the given size class, picked by
+// slab_compaction_begin: the pages that still have chunks in use take
+// allocations again.
+void slab_compaction_end(uint64_t slab_class, void **pages,
+                         uint64_t num_pages);
+
+// Returns true if the given chunk, allocated with slab_alloc, is in one of the
+// given pages.
+bool slab_in_pages(void *ptr, void **pages, uint64_t num_pages);
+
+// Returns the number of bytes of the pages owned by the size classes, which is
+// the memory of the items as far as the system is concerned.
+uint64_t slab_page_bytes();
+
+// Fills the given struct with the statistics of the given size class.
+void slab_class_stats(uint64_t slab_class, struct SlabClassStats *stats);
+
+#endif
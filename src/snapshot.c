@@ -0,0 +1,466 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compression.h"
+#include "epoch.h"
+#include "parameters.h"
+#include "snapshot.h"
+#include "timer_wheel.h"
+
+#define SNAPSHOT_TEMPORARY_SUFFIX ".tmp"
+
+// State of a snapshot being written, see snapshot_write_file.
+struct SnapshotWriter {
+  struct HashTable *hashtable;
+  FILE *file;
+  uint32_t now;     // Time of the timer wheels when the snapshot started.
+  uint64_t offset;  // Bytes written so far.
+  uint64_t *chunks; // Offsets of the chunks.
+  uint64_t num_chunks;
+  uint64_t chunks_capacity;
+  uint64_t num_records;
+  bool failed; // Writing the file failed, so the rest is skipped.
+};
+
+// Appends the given bytes to the file of the given writer.
+static void snapshot_write(struct SnapshotWriter *writer, const void *data,
+                           size_t size) {
+  if (size > 0 && fwrite(data, size, 1, writer->file) != 1) {
+    perror("snapshot_write fwrite");
+    writer->failed = true;
+  }
+  writer->offset += size;
+}
+
+// Starts a chunk at the current end of the file of the given writer.
+static void snapshot_begin_chunk(struct SnapshotWriter *writer) {
+  if (writer->num_chunks == writer->chunks_capacity) {
+    uint64_t capacity =
+        writer->chunks_capacity == 0 ? 64 : writer->chunks_capacity * 2;
+    uint64_t *chunks = realloc(writer->chunks, sizeof(uint64_t) * capacity);
+    if (chunks == NULL) {
+      perror("snapshot_begin_chunk realloc");
+      writer->failed = true;
+      return;
+    }
+    writer->chunks = chunks;
+    writer->chunks_capacity = capacity;
+  }
+  writer->chunks[writer->num_chunks++] = writer->offset;
+}
+
+// Appends a record of the given item to the file of the given writer, unless
+// the item expired or its value can't be read back from the extension store.
+static void snapshot_write_item(struct Item *item, void *arg) {
+  struct SnapshotWriter *writer = arg;
+  if (writer->failed) {
+    return;
+  }
+
+  struct SnapshotRecord record = {item->key_size, item->value_size, 0,
+                                  item->compressed};
+  if (item->expires) {
+    uint32_t expiration = item_timer(item)->expiration;
+    if (expiration <= writer->now) {
+      return;
+    }
+    record.ttl = expiration - writer->now;
+  }
+
+  // The extension store starts empty, so the values in it are read back.
+  const char *value = item_value(item);
+  char *buffer = NULL;
+  if (item->spilled) {
+    struct ExtStoreRead read;
+    memcpy(&read.location, item_value(item), sizeof(read.location));
+    buffer = malloc(read.location.value_size);
+    if (buffer == NULL) {
+      return;
+    }
+    read.key = item_key(item);
+    read.key_size = item->key_size;
+    read.destination = buffer;
+    if (!extstore_read(writer->hashtable->extstore, &read)) {
+      free(buffer);
+      return;
+    }
+    value = buffer;
+    record.value_size = read.location.value_size;
+    record.compressed = read.location.compressed;
+  }
+
+  if (writer->num_chunks == 0 ||
+      writer->offset - writer->chunks[writer->num_chunks - 1] >=
+          SNAPSHOT_CHUNK_SIZE) {
+    snapshot_begin_chunk(writer);
+  }
+  snapshot_write(writer, &record, sizeof(record));
+  snapshot_write(writer, item_key(item), item->key_size);
+  snapshot_write(writer, value, record.value_size);
+  writer->num_records++;
+  free(buffer);
+}
+
+// Writes a snapshot of the hash table to a temporary file, which replaces the
+// file of the snapshot once it's complete. Returns the number of items written,
+// or -1 if writing the file failed.
+static int64_t snapshot_write_file(struct Snapshot *snapshot) {
+  size_t path_size =
+      strlen(snapshot->path) + sizeof(SNAPSHOT_TEMPORARY_SUFFIX);
+  char *temporary_path = malloc(path_size);
+  if (temporary_path == NULL) {
+    perror("snapshot_write_file malloc");
+    return -1;
+  }
+  snprintf(temporary_path, path_size, "%s" SNAPSHOT_TEMPORARY_SUFFIX,
+           snapshot->path);
+
+  struct SnapshotWriter writer = {
+      .hashtable = snapshot->hashtable,
+      .file = fopen(temporary_path, "w"),
+      .now = timer_wheel_now(),
+  };
+  if (writer.file == NULL) {
+    perror("snapshot_write_file fopen");
+    free(temporary_path);
+    return -1;
+  }
+  // Write to the file a chunk at a time.
+  setvbuf(writer.file, NULL, _IOFBF, SNAPSHOT_CHUNK_SIZE);
+
+  // The header is written again once the records are counted.
+  struct SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  header.created_at = time(NULL);
+  snapshot_write(&writer, &header, sizeof(header));
+  if (!hashtable_visit(snapshot->hashtable, snapshot_write_item, &writer)) {
+    writer.failed = true;
+  }
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.num_records = writer.num_records;
+  header.num_chunks = writer.num_chunks;
+  header.chunks_offset = writer.offset;
+  snapshot_write(&writer, writer.chunks, sizeof(uint64_t) * writer.num_chunks);
+  if (fseek(writer.file, 0, SEEK_SET) != 0) {
+    perror("snapshot_write_file fseek");
+    writer.failed = true;
+  }
+  snapshot_write(&writer, &header, sizeof(header));
+
+  if (fflush(writer.file) != 0 || fsync(fileno(writer.file)) != 0) {
+    perror("snapshot_write_file fsync");
+    writer.failed = true;
+  }
+  if (fclose(writer.file) != 0) {
+    perror("snapshot_write_file fclose");
+    writer.failed = true;
+  }
+  if (!writer.failed && rename(temporary_path, snapshot->path) != 0) {
+    perror("snapshot_write_file rename");
+    writer.failed = true;
+  }
+  if (writer.failed) {
+    unlink(temporary_path);
+  }
+  free(temporary_path);
+  free(writer.chunks);
+
+  return writer.failed ? -1 : (int64_t)writer.num_records;
+}
+
+// Body of the thread that writes a snapshot, see snapshot_start.
+static void *snapshot_thread(void *arg) {
+  struct Snapshot *snapshot = arg;
+
+  int64_t num_records = snapshot_write_file(snapshot);
+  if (num_records == -1) {
+    fprintf(stderr, "Couldn't write the snapshot to %s\n", snapshot->path);
+  } else {
+    printf("Snapshot of %ld items written to %s\n", num_records,
+           snapshot->path);
+  }
+
+  pthread_mutex_lock(&snapshot->mutex);
+  snapshot->running = false;
+  if (num_records != -1) {
+    snapshot->num_written++;
+  }
+  pthread_mutex_unlock(&snapshot->mutex);
+  epoch_unregister();
+  return NULL;
+}
+
+// Allocates memory for the snapshots of the given hash table, which are written
+// to the file at the given path.
+struct Snapshot *snapshot_create(const char *path,
+                                 struct HashTable *hashtable) {
+  struct Snapshot *snapshot = malloc(sizeof(struct Snapshot));
+  if (snapshot == NULL) {
+    perror("snapshot_create malloc");
+    abort();
+  }
+  snapshot->path = strdup(path);
+  if (snapshot->path == NULL) {
+    perror("snapshot_create strdup");
+    abort();
+  }
+  snapshot->hashtable = hashtable;
+  pthread_mutex_init(&snapshot->mutex, NULL);
+  snapshot->running = false;
+  snapshot->num_written = 0;
+  return snapshot;
+}
+
+// Starts writing a snapshot of the hash table from a thread of its own, which
+// walks the hash table one segment at a time without pausing it. Returns false
+// if a snapshot is already being written.
+bool snapshot_start(struct Snapshot *snapshot) {
+  pthread_mutex_lock(&snapshot->mutex);
+  if (snapshot->running) {
+    pthread_mutex_unlock(&snapshot->mutex);
+    return false;
+  }
+  snapshot->running = true;
+  pthread_mutex_unlock(&snapshot->mutex);
+
+  pthread_t thread;
+  int rv = pthread_create(&thread, NULL, snapshot_thread, snapshot);
+  if (rv != 0) {
+    perror("snapshot_start pthread_create");
+    abort();
+  }
+  pthread_detach(thread);
+  return true;
+}
+
+// Returns the number of snapshots written completely.
+uint64_t snapshot_count(struct Snapshot *snapshot) {
+  pthread_mutex_lock(&snapshot->mutex);
+  uint64_t num_written = snapshot->num_written;
+  pthread_mutex_unlock(&snapshot->mutex);
+  return num_written;
+}
+
+// State of a snapshot being loaded, shared by the threads that load it.
+struct SnapshotLoader {
+  const char *data; // The file, mapped into memory.
+  struct SnapshotHeader header;
+  struct HashTable *hashtable;
+  uint64_t elapsed;    // Seconds since the snapshot was written.
+  uint64_t next_chunk; // Next chunk left to be loaded.
+  uint64_t num_loaded;
+  bool full; // The items reached the low watermark of the memory budget.
+};
+
+// Returns the offset of the given chunk of the snapshot, or the offset where
+// the last one ends if it's the number of chunks.
+static uint64_t snapshot_chunk_offset(struct SnapshotLoader *loader,
+                                      uint64_t chunk) {
+  if (chunk == loader->header.num_chunks) {
+    return loader->header.chunks_offset;
+  }
+  uint64_t offset;
+  memcpy(&offset,
+         loader->data + loader->header.chunks_offset + chunk * sizeof(offset),
+         sizeof(offset));
+  return offset;
+}
+
+// Returns true if the given value of a compressed record holds the original
+// size of the value followed by data that decompresses to that size, see
+// Item::compressed.
+static bool snapshot_compressed_value_valid(const char *value,
+                                            uint32_t value_size) {
+  uint32_t original_size;
+  if (value_size < sizeof(original_size)) {
+    return false;
+  }
+  memcpy(&original_size, value, sizeof(original_size));
+  return compression_check(value + sizeof(original_size),
+                           value_size - sizeof(original_size),
+                           ntohl(original_size));
+}
+
+// Inserts the items of the records of the given chunk of the snapshot into the
+// hash table, skipping the compressed ones that don't decompress. Returns the
+// number of items inserted.
+static uint64_t snapshot_load_chunk(struct SnapshotLoader *loader,
+                                    uint64_t chunk) {
+  struct HashTable *hashtable = loader->hashtable;
+  uint64_t position = snapshot_chunk_offset(loader, chunk);
+  uint64_t end = snapshot_chunk_offset(loader, chunk + 1);
+  if (position < sizeof(struct SnapshotHeader) || position > end ||
+      end > loader->header.chunks_offset) {
+    fprintf(stderr, "snapshot_load_chunk: chunk %ld is corrupt\n", chunk);
+    return 0;
+  }
+
+  // Stop once the items take as much memory as the eviction thread lets them,
+  // instead of evicting the items that were just loaded.
+  if (hashtable_stored_bytes(hashtable) >= hashtable->low_watermark) {
+    __atomic_store_n(&loader->full, true, __ATOMIC_RELAXED);
+    return 0;
+  }
+
+  uint64_t num_loaded = 0;
+  while (position < end) {
+    struct SnapshotRecord record;
+    if (end - position < sizeof(record)) {
+      fprintf(stderr, "snapshot_load_chunk: chunk %ld is corrupt\n", chunk);
+      break;
+    }
+    memcpy(&record, loader->data + position, sizeof(record));
+    position += sizeof(record);
+    if ((uint64_t)record.key_size + record.value_size > end - position) {
+      fprintf(stderr, "snapshot_load_chunk: chunk %ld is corrupt\n", chunk);
+      break;
+    }
+    const char *key = loader->data + position;
+    const char *value = key + record.key_size;
+    position += (uint64_t)record.key_size + record.value_size;
+
+    if (record.compressed != 0 &&
+        !snapshot_compressed_value_valid(value, record.value_size)) {
+      fprintf(stderr, "snapshot_load_chunk: corrupt compressed value\n");
+      continue;
+    }
+
+    // The TTL counts the time the cache was down.
+    uint32_t ttl = record.ttl;
+    if (ttl != 0) {
+      if (ttl <= loader->elapsed) {
+        continue;
+      }
+      ttl -= loader->elapsed;
+    }
+
+    struct Item *item = hashtable_create_item(hashtable, record.key_size,
+                                              record.value_size, ttl);
+    if (item == NULL) {
+      // Only stop if the items are out of memory. Otherwise it's this record
+      // that doesn't fit, like one larger than the memory budget.
+      if (hashtable_stored_bytes(hashtable) >= hashtable->low_watermark) {
+        __atomic_store_n(&loader->full, true, __ATOMIC_RELAXED);
+        break;
+      }
+      fprintf(stderr, "snapshot_load_chunk: skipping a record of %lu bytes\n",
+              (uint64_t)record.key_size + record.value_size);
+      continue;
+    }
+    memcpy(item_key(item), key, record.key_size);
+    memcpy(item_value(item), value, record.value_size);
+    item->compressed = record.compressed != 0;
+    hashtable_insert(hashtable, item);
+    num_loaded++;
+  }
+  return num_loaded;
+}
+
+// Body of the threads that load a snapshot, which take the chunks left in
+// turns.
+static void *snapshot_loader(void *arg) {
+  struct SnapshotLoader *loader = arg;
+  uint64_t num_loaded = 0;
+
+  epoch_register();
+
+  while (!__atomic_load_n(&loader->full, __ATOMIC_RELAXED)) {
+    uint64_t chunk =
+        __atomic_fetch_add(&loader->next_chunk, 1, __ATOMIC_RELAXED);
+    if (chunk >= loader->header.num_chunks) {
+      break;
+    }
+    num_loaded += snapshot_load_chunk(loader, chunk);
+    epoch_reclaim();
+  }
+
+  __atomic_add_fetch(&loader->num_loaded, num_loaded, __ATOMIC_RELAXED);
+  // Free the items replaced while loading before the thread goes away.
+  epoch_unregister();
+  return NULL;
+}
+
+// Loads the snapshot in the file at the given path into the given hash table,
+// mapping the file into memory and inserting its items from the given number
+// of threads at once. Items that expired in the meantime, corrupt ones and ones
+// that don't fit are skipped, and loading stops once the items reach the low
+// watermark of the memory budget.
+// Returns the number of items loaded, or -1 if the file can't be loaded.
+int64_t snapshot_load(const char *path, struct HashTable *hashtable,
+                      int num_threads) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    // There is no snapshot before the first one is written.
+    if (errno != ENOENT) {
+      perror("snapshot_load open");
+    }
+    return -1;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1) {
+    perror("snapshot_load fstat");
+    close(fd);
+    return -1;
+  }
+  uint64_t size = file_stat.st_size;
+  if (size < sizeof(struct SnapshotHeader)) {
+    fprintf(stderr, "snapshot_load: %s is not a snapshot\n", path);
+    close(fd);
+    return -1;
+  }
+  void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("snapshot_load mmap");
+    return -1;
+  }
+  // The whole file is going to be read, so start reading it ahead.
+  madvise(data, size, MADV_WILLNEED);
+
+  struct SnapshotLoader loader = {
+      .data = data,
+      .hashtable = hashtable,
+      .next_chunk = 0,
+      .num_loaded = 0,
+      .full = false,
+  };
+  memcpy(&loader.header, data, sizeof(loader.header));
+  struct SnapshotHeader *header = &loader.header;
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+      header->chunks_offset > size ||
+      header->num_chunks > (size - header->chunks_offset) / sizeof(uint64_t)) {
+    fprintf(stderr, "snapshot_load: %s is not a snapshot\n", path);
+    munmap(data, size);
+    return -1;
+  }
+  uint64_t now = time(NULL);
+  loader.elapsed = now > header->created_at ? now - header->created_at : 0;
+
+  pthread_t *threads = malloc(sizeof(pthread_t) * num_threads);
+  if (threads == NULL) {
+    perror("snapshot_load malloc");
+    abort();
+  }
+  for (int i = 0; i < num_threads; i++) {
+    int rv = pthread_create(&threads[i], NULL, snapshot_loader, &loader);
+    if (rv != 0) {
+      perror("snapshot_load pthread_create");
+      abort();
+    }
+  }
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  munmap(data, size);
+
+  return loader.num_loaded;
+}
@@ -0,0 +1,70 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hashtable.h"
+
+// Snapshots: the items of the hash table are written to a file from a thread of
+// their own, so that a restarted cache can load them back instead of starting
+// empty.
+//////////////////////////////////////
+// The file starts with a SnapshotHeader, followed by the records of the items
+// and by the offsets of the chunks the records are grouped in. Each record is a
+// SnapshotRecord followed by the key and the value of the item, as it's stored
+// (compressed or not). Chunks take about SNAPSHOT_CHUNK_SIZE bytes, so that
+// several threads can load a file at once, each of them taking the next chunk
+// left. Snapshots are written to a temporary file that only replaces the file
+// once it's complete, so the file always holds a whole snapshot.
+
+#define SNAPSHOT_MAGIC "MCSNAP01"
+
+struct SnapshotHeader {
+  char magic[8];       // SNAPSHOT_MAGIC, without the terminating null byte.
+  uint64_t created_at; // Wall clock time it was written at, in seconds.
+  uint64_t num_records;
+  uint64_t num_chunks;
+  uint64_t chunks_offset; // Offset of the offsets of the chunks.
+};
+
+struct SnapshotRecord {
+  uint32_t key_size;
+  uint32_t value_size;
+  uint32_t ttl;        // Seconds left before it expires, 0 if it never does.
+  uint32_t compressed; // The value is compressed, see Item.
+};
+
+// Snapshots of a hash table that are written to a file, see snapshot_start.
+struct Snapshot {
+  char *path;
+  struct HashTable *hashtable;
+  pthread_mutex_t mutex; // Protects the fields below.
+  bool running;          // A snapshot is being written.
+  uint64_t num_written;  // Snapshots written completely.
+};
+
+// Allocates memory for the snapshots of the given hash table, which are written
+// to the file at the given path.
+struct Snapshot *snapshot_create(const char *path,
+                                 struct HashTable *hashtable);
+
+// Starts writing a snapshot of the hash table from a thread of its own, which
+// walks the hash table one segment at a time without pausing it. Returns false
+// if a snapshot is already being written.
+bool snapshot_start(struct Snapshot *snapshot);
+
+// Returns the number of snapshots written completely.
+uint64_t snapshot_count(struct Snapshot *snapshot);
+
+// Loads the snapshot in the file at the given path into the given hash table,
+// mapping the file into memory and inserting its items from the given number
+// of threads at once. Items that expired in the meantime, corrupt ones and ones
+// that don't fit are skipped, and loading stops once the items reach the low
+// watermark of the memory budget.
+// Returns the number of items loaded, or -1 if the file can't be loaded.
+int64_t snapshot_load(const char *path, struct HashTable *hashtable,
+                      int num_threads);
+
+#endif
@@ -13,9 +13,10 @@
  * This is a portable way of getting an IPv4 or IPv6 socket. `getaddrinfo`
  * returns a bunch of `addrinfo` structures in the last argument which are
  * compatible with the hints passed in the first argument.
+ * The socket is bound with SO_REUSEPORT if reuse_port is true.
  * Returns the socket file descriptor if successful, -1 otherwise.
  */
-static int create_and_bind(char *port) {
+static int create_and_bind(char *port, bool reuse_port) {
   struct addrinfo hints;
   struct addrinfo *results, *rp;
   int status;
@@ -44,6 +45,17 @@ static int create_and_bind(char *port) {
       continue;
     }
 
+    if (reuse_port) {
+      int option_value = 1;
+      status = setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &option_value,
+                          sizeof(option_value));
+      if (status == -1) {
+        perror("create_and_bind setsockopt");
+        close(server_fd);
+        continue;
+      }
+    }
+
     status = bind(server_fd, rp->ai_addr, rp->ai_addrlen);
     if (status == 0) {
       // Bind successful
@@ -91,13 +103,14 @@ int make_socket_non_blocking(int socket_fd) {
 }
 
 /* Creates a listening non-blocking socket on the given port and returns its
- * file descriptor. Aborts execution if anything bad happens.
+ * file descriptor, bound with SO_REUSEPORT if reuse_port is true. Aborts
+ * execution if anything bad happens.
  */
-int create_listen_socket(char *port) {
+int create_listen_socket(char *port, bool reuse_port) {
   int fd;
   int status;
 
-  fd = create_and_bind(port);
+  fd = create_and_bind(port, reuse_port);
   if (fd == -1) {
     abort();
   }
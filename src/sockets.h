@@ -1,14 +1,18 @@
 #ifndef __SOCKETS_H__
 #define __SOCKETS_H__
 
+#include <stdbool.h>
+
 /* Makes the given socket non-blocking.
  * Returns 0 if successful, -1 otherwise.
  */
 int make_socket_non_blocking(int socket_fd);
 
-/* Creates a non-blocking socket to listen on the given port.
+/* Creates a non-blocking socket to listen on the given port. If reuse_port is
+ * true the socket is bound with SO_REUSEPORT, so that several sockets can
+ * listen on the same port and the kernel spreads the connections among them.
  * Returns its file descriptor is successful, aborts the program otherwise.
  */
-int create_listen_socket(char *port);
+int create_listen_socket(char *port, bool reuse_port);
 
 #endif
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/epoll.h>
@@ -18,24 +19,40 @@
 // Buffer size for the text protocol.
 #define TEXT_REQUEST_BUFFER_SIZE (MAX_TEXT_REQUEST_SIZE + 5)
 
-// Reads from the current client until a newline is found or until the maximum
-// request size (which should be smaller than the size of the given buffer). If
-// a newline character is found then it's replaced by a null character and
-// CLIENT_READ_SUCCESS is returned. If the client closes the connection then
-// CLIENT_READ_CLOSED is returned. If the client's read buffer has some space in
-// it and the client is not ready for reading then CLIENT_READ_INCOMPLETE is
-// returned. If an error happens then CLIENT_READ_ERROR is returned.
-static int read_until_newline(int incoming_fd, char *buffer, size_t buffer_size,
-                              size_t *total_bytes_read, size_t read_limit) {
-  ssize_t nread = 0;
-
-  while (*total_bytes_read < buffer_size) {
-    // Remaining amount of bytes to read into the buffer.
-    size_t remaining_bytes = buffer_size - *total_bytes_read;
-    // Pointer to the start of the "empty" read buffer.
-    char *remaining_buffer = buffer + *total_bytes_read;
-
-    nread = read(incoming_fd, remaining_buffer, remaining_bytes);
+// Reads a request from the current client into the given buffer, up to and
+// including its newline or up to the given limit of bytes (which should be
+// smaller than the size of the given buffer), and places a null character
+// after it. The bytes already received are taken out of the given ring buffer
+// first, and the bytes after the newline are left there for the requests that
+// follow. Returns CLIENT_READ_SUCCESS once the request is read, even without a
+// newline if it reached the limit: the given flag is set then, and the rest of
+// the line is dropped before the next request is read, so that it's never
+// taken for requests of its own. If the client closes the connection then
+// CLIENT_READ_CLOSED is returned. If the client is not ready for reading then
+// CLIENT_READ_INCOMPLETE is returned. If an error happens then
+// CLIENT_READ_ERROR is returned.
+static int read_line(int incoming_fd, struct RingBuffer *input, char *buffer,
+                     size_t *total_bytes_read, size_t read_limit,
+                     bool *skipping_line) {
+  while (true) {
+    *total_bytes_read += ring_buffer_take_line(
+        input, buffer + *total_bytes_read, read_limit - *total_bytes_read);
+    bool newline =
+        *total_bytes_read > 0 && buffer[*total_bytes_read - 1] == '\n';
+    if (*skipping_line) {
+      // Drop the rest of the previous request, which went over the limit.
+      *skipping_line = !newline;
+      *total_bytes_read = 0;
+    } else if (newline || *total_bytes_read == read_limit) {
+      buffer[*total_bytes_read] = '\0';
+      *skipping_line = !newline;
+      return CLIENT_READ_SUCCESS;
+    }
+    if (input->length > 0) {
+      continue;
+    }
+
+    ssize_t nread = ring_buffer_fill(input, incoming_fd);
     if (nread == -1) {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
         // The client is not ready to ready yet.
@@ -43,31 +60,13 @@ static int read_until_newline(int incoming_fd, char *buffer, size_t buffer_size,
       }
 
       // Some other error happened.
-      perror("read_until_newline read");
+      perror("read_line read");
       return CLIENT_READ_ERROR;
     } else if (nread == 0) {
       // Client disconnected gracefully.
       return CLIENT_READ_CLOSED;
     }
-
-    // Try to find a newline in the bytes we just read and see if it's within
-    // the read limit.
-    char *newline = memchr(remaining_buffer, '\n', nread);
-    if (newline != NULL && (newline - buffer) < read_limit) {
-      // Replace the character after the newline with a null char so that we can
-      // manipulate the string up until that point.
-      *(newline + 1) = '\0';
-      return CLIENT_READ_SUCCESS;
-    }
-
-    // We didn't a newline in the bytes we just read, update the total bytes
-    // read and keep reading if possible.
-    *total_bytes_read += nread;
   }
-
-  // We read all the bytes we are allowed for the buffer but we didn't find a
-  // newline. We still return success because no error was found.
-  return CLIENT_READ_SUCCESS;
 }
 
 // Mutates the given EventData struct when the contents are not appropriate for
@@ -108,6 +107,26 @@ static bool remove_newline_if_found(char *token) {
   return false;
 }
 
+// Parses the given TTL of a PUT, a number of seconds, into the given pointer.
+// Returns true if it's a valid TTL, false otherwise.
+static bool parse_ttl(char *token, uint32_t *ttl) {
+  uint64_t value = 0;
+  if (*token == '\0') {
+    return false;
+  }
+  for (; *token != '\0'; token++) {
+    if (*token < '0' || *token > '9') {
+      return false;
+    }
+    value = value * 10 + (*token - '0');
+    if (value > UINT32_MAX) {
+      return false;
+    }
+  }
+  *ttl = value;
+  return true;
+}
+
 // Parses the well-formed text request from the client state and mutates the
 // EventData struct inside the epoll event with the appropriate data for the
 // response.
@@ -129,6 +148,10 @@ static void parse_text_request(struct WorkerArgs *args,
   if (second_arg != NULL && remove_newline_if_found(second_arg)) {
     argument_count = 2;
   }
+  char *third_arg = strsep(&token, " ");
+  if (third_arg != NULL && remove_newline_if_found(third_arg)) {
+    argument_count = 3;
+  }
 
   // By the default the response is BT_EINVAL.
   event_data->response_type = BT_EINVAL;
@@ -138,6 +161,12 @@ static void parse_text_request(struct WorkerArgs *args,
     return;
   }
 
+  if (argument_count == 0 &&
+      !strcmp(command, binary_type_str(BT_SNAPSHOT))) {
+    handle_snapshot(event_data, args);
+    return;
+  }
+
   if (argument_count == 1 && !strcmp(command, binary_type_str(BT_DEL))) {
     size_t key_len = strlen(first_arg);
     if (key_len <= 0) {
@@ -161,7 +190,7 @@ static void parse_text_request(struct WorkerArgs *args,
     // The `key->data` pointer is not freeable through `free` because it points
     // to the middle of a pointer allocated with `malloc`. So we destroy the
     // `key` pointer now, but first we have to clear `key->data`, and the
-    // original pointer will be cleared when the client state is reset.
+    // original pointer will be freed when the client is closed.
     key->data = NULL;
     bounded_data_destroy(key);
     return;
@@ -186,14 +215,14 @@ static void parse_text_request(struct WorkerArgs *args,
     key->size = key_len;
     key->data = first_arg;
 
+    event_data->command_type = BT_GET;
     handle_get(event_data, args, key);
     // The `key->data` pointer is not freeable through `free` because it points
     // to the middle of a pointer allocated with `malloc`. So we destroy the
     // `key` pointer now, but first we have to clear `key->data`, and the
-    // original pointer will be cleared when the client state is reset.
+    // original pointer will be freed when the client is closed.
     key->data = NULL;
     bounded_data_destroy(key);
-    enforce_text_protocol_limitations(event_data);
     return;
   }
 
@@ -216,53 +245,67 @@ static void parse_text_request(struct WorkerArgs *args,
     key->size = key_len;
     key->data = first_arg;
 
+    event_data->command_type = BT_TAKE;
     handle_take(event_data, args, key);
     // The `key->data` pointer is not freeable through `free` because it points
     // to the middle of a pointer allocated with `malloc`. So we destroy the
     // `key` pointer now, but first we have to clear `key->data`, and the
-    // original pointer will be cleared when the client state is reset.
+    // original pointer will be freed when the client is closed.
     key->data = NULL;
     bounded_data_destroy(key);
-    enforce_text_protocol_limitations(event_data);
     return;
   }
 
-  if (argument_count == 2 && !strcmp(command, binary_type_str(BT_PUT))) {
+  // PUT takes an optional third argument, the number of seconds after which the
+  // key expires.
+  if ((argument_count == 2 || argument_count == 3) &&
+      !strcmp(command, binary_type_str(BT_PUT))) {
     size_t key_len = strlen(first_arg);
     size_t value_len = strlen(second_arg);
-    if (key_len <= 0 || value_len <= 0) {
+    uint32_t ttl = 0;
+    if (key_len <= 0 || value_len <= 0 ||
+        (argument_count == 3 && !parse_ttl(third_arg, &ttl))) {
       // Invalid insert.
       return;
     }
-    // The BoundedData instances below will be "owned" by the hash table.
-    struct BoundedData *key =
-        hashtable_malloc_evict_bounded_data(args->hashtable, key_len);
-    if (key == NULL) {
-      // Respond with BT_EUNK if the request can't be properly fulfilled due to
-      // lack of memory.
-      event_data->response_type = BT_EUNK;
-      return;
-    }
-    struct BoundedData *value =
-        hashtable_malloc_evict_bounded_data(args->hashtable, value_len);
-    if (value == NULL) {
+    // The item below will be "owned" by the hash table.
+    struct Item *item =
+        hashtable_create_item(args->hashtable, key_len, value_len, ttl);
+    if (item == NULL) {
       // Respond with BT_EUNK if the request can't be properly fulfilled due to
       // lack of memory.
-      bounded_data_destroy(key);
       event_data->response_type = BT_EUNK;
       return;
     }
-    memcpy(key->data, first_arg, key_len);
-    memcpy(value->data, second_arg, value_len);
+    memcpy(item_key(item), first_arg, key_len);
+    memcpy(item_value(item), second_arg, value_len);
 
-    handle_put(event_data, args, key, value);
+    handle_put(event_data, args, item);
     return;
   }
 }
 
-// Writes or resumes the writing of a command of a text response. Returns
+// Handles writing the response for a text client, or resumes it, and returns
 // CLIENT_WRITE_ERROR, CLIENT_WRITE_SUCCESS or CLIENT_WRITE_INCOMPLETE.
-static int write_command(struct EventData *event_data) {
+int handle_text_client_response(struct WorkerArgs *args,
+                                struct epoll_event *event) {
+  struct EventData *event_data = event->data.ptr;
+
+  if (event_data->client_state != TEXT_WRITING_RESPONSE) {
+    worker_log(args, "Invalid state reached in handle_text_client_response");
+    return CLIENT_WRITE_ERROR;
+  }
+
+  if (event_data->total_bytes_written == 0 &&
+      (event_data->command_type == BT_GET ||
+       event_data->command_type == BT_TAKE)) {
+    // Checked right before writing, since values read back from the
+    // extension store only get here.
+    enforce_text_protocol_limitations(event_data);
+  }
+
+  // The response is the command, followed by a space and the content if
+  // there's any, and by the trailing newline, and it's written all at once.
   char command_buf[COMMAND_BUFFER_SIZE];
   char *maybe_content_separator =
       event_data->response_content != NULL ? " " : "";
@@ -270,73 +313,38 @@ static int write_command(struct EventData *event_data) {
                     binary_type_str(event_data->response_type),
                     maybe_content_separator);
   if (rv < 0) {
-    perror("write_command snprintf");
+    perror("handle_text_client_response snprintf");
     return CLIENT_WRITE_ERROR;
   }
 
+  struct iovec buffers[3];
+  int num_buffers = 0;
   // Make sure we don't write the trailing '\0', hence the strnlen.
-  size_t command_len = strnlen(command_buf, COMMAND_BUFFER_SIZE);
-  return write_buffer(event_data->fd, command_buf, command_len,
-                      &(event_data->total_bytes_written));
-}
-
-// Writes or resumes the writing of a response's content. Returns
-// CLIENT_WRITE_ERROR, CLIENT_WRITE_SUCCESS or CLIENT_WRITE_INCOMPLETE.
-static int write_content(struct EventData *event_data) {
-  return write_buffer(event_data->fd, event_data->response_content->data,
-                      event_data->response_content->size,
-                      &(event_data->total_bytes_written));
-}
-
-// Writes or resumes the writing of the ending newline character of a response.
-// Returns CLIENT_WRITE_ERROR, CLIENT_WRITE_SUCCESS or CLIENT_WRITE_INCOMPLETE.
-static int write_newline(struct EventData *event_data) {
-  return write_buffer(event_data->fd, "\n", 1,
-                      &(event_data->total_bytes_written));
-}
-
-int handle_text_client_response(struct WorkerArgs *args,
-                                struct epoll_event *event) {
-  struct EventData *event_data = event->data.ptr;
-  int rv;
-
-  if (event_data->client_state == TEXT_WRITING_COMMAND) {
-    rv = write_command(event_data);
-    if (rv != CLIENT_WRITE_SUCCESS) {
-      return rv;
-    }
-
-    // Close the connection after sending BT_EUNK.
-    if (event_data->response_type == BT_EUNK) {
-      // TODO: maybe change the return value?
-      return CLIENT_READ_CLOSED;
-    }
-
-    event_data->total_bytes_written = 0;
-    if (event_data->response_content != NULL) {
-      // Transition to writing the content if there is something.
-      event_data->client_state = TEXT_WRITING_CONTENT;
-    } else {
-      // Otherwise transition to writing the trailing newline.
-      event_data->client_state = TEXT_WRITING_NEWLINE;
-    }
+  buffers[num_buffers].iov_base = command_buf;
+  buffers[num_buffers].iov_len = strnlen(command_buf, COMMAND_BUFFER_SIZE);
+  num_buffers++;
+  if (event_data->response_content != NULL) {
+    buffers[num_buffers].iov_base = event_data->response_content->data;
+    buffers[num_buffers].iov_len = event_data->response_content->size;
+    num_buffers++;
   }
-
-  if (event_data->client_state == TEXT_WRITING_CONTENT) {
-    rv = write_content(event_data);
-    if (rv != CLIENT_WRITE_SUCCESS) {
-      return rv;
-    }
-    event_data->total_bytes_written = 0;
-    event_data->client_state = TEXT_WRITING_NEWLINE;
+  buffers[num_buffers].iov_base = "\n";
+  buffers[num_buffers].iov_len = 1;
+  num_buffers++;
+
+  rv = write_buffers(event_data->fd, buffers, num_buffers,
+                     &(event_data->total_bytes_written));
+  if (rv != CLIENT_WRITE_SUCCESS) {
+    return rv;
   }
 
-  if (event_data->client_state == TEXT_WRITING_NEWLINE) {
-    return write_newline(event_data);
+  // Close the connection after sending BT_EUNK.
+  if (event_data->response_type == BT_EUNK) {
+    // TODO: maybe change the return value?
+    return CLIENT_READ_CLOSED;
   }
 
-  worker_log(args, "Invalid state reached in handle_text_client_response");
-  return CLIENT_WRITE_ERROR;
+  return CLIENT_WRITE_SUCCESS;
 }
 
 int handle_text_client_request(struct WorkerArgs *args,
@@ -355,15 +363,18 @@ int handle_text_client_request(struct WorkerArgs *args,
   }
 
   // If we didn't start reading from the client yet, prepare everything and
-  // begin.
+  // begin. The request buffer is allocated for the first request and reused
+  // for the following ones.
   if (event_data->client_state == TEXT_READY) {
-    event_data->read_buffer = hashtable_malloc_evict_bounded_data(
-        args->hashtable, TEXT_REQUEST_BUFFER_SIZE);
+    if (event_data->read_buffer == NULL) {
+      event_data->read_buffer = hashtable_malloc_evict_bounded_data(
+          args->hashtable, TEXT_REQUEST_BUFFER_SIZE);
+    }
     if (event_data->read_buffer == NULL) {
       // Respond with BT_EUNK if the request can't be properly fulfilled due to
       // lack of memory.
       event_data->response_type = BT_EUNK;
-      event_data->client_state = TEXT_WRITING_COMMAND;
+      event_data->client_state = TEXT_WRITING_RESPONSE;
     } else {
       event_data->total_bytes_read = 0;
       event_data->client_state = TEXT_READING_INPUT;
@@ -372,12 +383,12 @@ int handle_text_client_request(struct WorkerArgs *args,
 
   if (event_data->client_state == TEXT_READING_INPUT) {
     // Read from the client until a newline is found within the request size
-    // limit and place a null character after it, or read until the buffer is
-    // full but without a newline. Otherwise, return an error.
-    int rv = read_until_newline(event_data->fd, event_data->read_buffer->data,
-                                event_data->read_buffer->size,
-                                &(event_data->total_bytes_read),
-                                MAX_TEXT_REQUEST_SIZE);
+    // limit and place a null character after it, or read up to the limit but
+    // without a newline. Otherwise, return an error.
+    int rv = read_line(event_data->fd, event_data->input,
+                       event_data->read_buffer->data,
+                       &(event_data->total_bytes_read), MAX_TEXT_REQUEST_SIZE,
+                       &(event_data->skipping_line));
     if (rv != CLIENT_READ_SUCCESS) {
       return rv;
     }
@@ -386,9 +397,13 @@ int handle_text_client_request(struct WorkerArgs *args,
     // contents and whether it adheres to the protocol or not.
     parse_text_request(args, event);
 
-    // Transition to writing the command.
+    // Transition to writing the command, unless the content of the response
+    // has to be read from the extension store first.
     event_data->total_bytes_written = 0;
-    event_data->client_state = TEXT_WRITING_COMMAND;
+    event_data->client_state = TEXT_WRITING_RESPONSE;
+    if (event_data->pending_read != NULL) {
+      return CLIENT_WRITE_PENDING;
+    }
     return handle_text_client_response(args, event);
   }
 
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "timer_wheel.h"
+
+// Returns the current time of the clock of the timer wheels, in seconds. The
+// clock is monotonic, and never returns 0.
+uint32_t timer_wheel_now() {
+  struct timespec ts;
+  // The coarse clock doesn't need a system call, and its resolution is much
+  // finer than a second anyway.
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint32_t)ts.tv_sec + 1;
+}
+
+// Initializes the given timer wheel (including its mutex), starting at the
+// current time.
+void timer_wheel_initialize(struct TimerWheel *wheel) {
+  pthread_mutex_init(&wheel->mutex, NULL);
+  wheel->current_tick = timer_wheel_now();
+  for (uint64_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (uint64_t slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      wheel->slots[level][slot] = NULL;
+    }
+  }
+  wheel->size = 0;
+}
+
+// Destroys the mutex of the given timer wheel. The items in it are left alone.
+void timer_wheel_destroy(struct TimerWheel *wheel) {
+  int rv = pthread_mutex_destroy(&wheel->mutex);
+  if (rv != 0) {
+    perror("timer_wheel_destroy pthread_mutex_destroy");
+    abort();
+  }
+}
+
+// Returns the slot of the given timer wheel for an item that expires at the
+// given tick. Items that are already due go to the slot of the current tick,
+// and items due after the last turn of the last level go to the slot of the
+// last tick it covers, from which they are cascaded again.
+static struct Item **timer_wheel_slot(struct TimerWheel *wheel,
+                                      uint64_t expiration) {
+  uint64_t tick =
+      expiration > wheel->current_tick ? expiration : wheel->current_tick;
+  uint64_t delta = tick - wheel->current_tick;
+
+  uint64_t level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         delta >= (1UL << ((level + 1) * TIMER_WHEEL_SLOT_BITS))) {
+    level++;
+  }
+  uint64_t span = 1UL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS);
+  if (delta >= span) {
+    tick = wheel->current_tick + span - 1;
+  }
+
+  uint64_t shift = level * TIMER_WHEEL_SLOT_BITS;
+  return &wheel->slots[level][(tick >> shift) & (TIMER_WHEEL_SLOTS - 1)];
+}
+
+// Adds the given item, which must have an expiration and not be in any timer
+// wheel, to the given timer wheel.
+void timer_wheel_add(struct TimerWheel *wheel, struct Item *item) {
+  struct ItemTimer *timer = item_timer(item);
+  struct Item **slot = timer_wheel_slot(wheel, timer->expiration);
+  timer->next = *slot;
+  if (*slot != NULL) {
+    item_timer(*slot)->prev = &timer->next;
+  }
+  *slot = item;
+  timer->prev = slot;
+  __atomic_store_n(&wheel->size, wheel->size + 1, __ATOMIC_RELAXED);
+}
+
+// Removes the given item from the given timer wheel if it's in it.
+void timer_wheel_remove(struct TimerWheel *wheel, struct Item *item) {
+  struct ItemTimer *timer = item_timer(item);
+  if (timer->prev == NULL) {
+    return;
+  }
+  *timer->prev = timer->next;
+  if (timer->next != NULL) {
+    item_timer(timer->next)->prev = timer->prev;
+  }
+  timer->next = NULL;
+  timer->prev = NULL;
+  __atomic_store_n(&wheel->size, wheel->size - 1, __ATOMIC_RELAXED);
+}
+
+// Moves the items of the given slot of an upper level of the timer wheel to
+// the slots where they belong now that the wheel turned.
+static void timer_wheel_cascade(struct TimerWheel *wheel, struct Item **slot) {
+  struct Item *item = *slot;
+  *slot = NULL;
+  while (item != NULL) {
+    struct ItemTimer *timer = item_timer(item);
+    struct Item *next = timer->next;
+    timer->prev = NULL;
+    __atomic_store_n(&wheel->size, wheel->size - 1, __ATOMIC_RELAXED);
+    timer_wheel_add(wheel, item);
+    item = next;
+  }
+}
+
+// Returns true if some item of the given timer wheel might be due at the given
+// time. Can be called without the mutex of the wheel.
+bool timer_wheel_due(struct TimerWheel *wheel, uint32_t now) {
+  return __atomic_load_n(&wheel->size, __ATOMIC_RELAXED) > 0 &&
+         __atomic_load_n(&wheel->current_tick, __ATOMIC_RELAXED) <= now;
+}
+
+// Turns the given timer wheel up to the given time, removing the items that
+// expired by then and storing them in the given array, up to the given number
+// of them. Returns the number of items removed. If there are more expired items
+// than that, the wheel stops turning and the rest are returned by the next
+// call.
+uint64_t timer_wheel_expire(struct TimerWheel *wheel, uint32_t now,
+                            struct Item **items, uint64_t max_items) {
+  uint64_t num_items = 0;
+  while (wheel->current_tick <= now) {
+    uint64_t tick = wheel->current_tick;
+
+    // A slot of an upper level is cascaded when the levels below it complete a
+    // turn. The wheel might stop at this tick and come back to it later, but
+    // cascading the same slot twice is harmless: nothing is added to it after
+    // the first time until the whole level turns.
+    for (uint64_t level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+      uint64_t shift = level * TIMER_WHEEL_SLOT_BITS;
+      if ((tick & ((1UL << shift) - 1)) == 0) {
+        timer_wheel_cascade(
+            wheel,
+            &wheel->slots[level][(tick >> shift) & (TIMER_WHEEL_SLOTS - 1)]);
+      }
+    }
+
+    struct Item **slot = &wheel->slots[0][tick & (TIMER_WHEEL_SLOTS - 1)];
+    while (*slot != NULL) {
+      if (num_items == max_items) {
+        return num_items;
+      }
+      struct Item *item = *slot;
+      timer_wheel_remove(wheel, item);
+      items[num_items++] = item;
+    }
+
+    __atomic_store_n(&wheel->current_tick, tick + 1, __ATOMIC_RELAXED);
+  }
+  return num_items;
+}
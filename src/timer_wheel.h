@@ -0,0 +1,61 @@
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "item.h"
+
+// Levels of a timer wheel, and slots of each level (a power of two). Each slot
+// of a level spans as many ticks as a whole turn of the level below, so four
+// levels of 64 one-second slots cover more than six months.
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1UL << TIMER_WHEEL_SLOT_BITS)
+
+// Hierarchical timer wheel of the items that expire. Ticks are seconds of the
+// clock returned by timer_wheel_now. Items due within a turn of the first level
+// are in the slot of the tick they expire at, and the rest in a slot of the
+// level whose turn covers their expiration. The slots of the upper levels are
+// cascaded into the lower ones as the wheel turns, so adding and removing items
+// takes constant time and only the items that are due are ever looked at. The
+// slots are lists made of the links embedded in the items, and every function
+// but timer_wheel_now assumes that the mutex of the wheel is acquired.
+struct TimerWheel {
+  pthread_mutex_t mutex;
+  uint64_t current_tick; // Next tick to be processed.
+  struct Item *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  uint64_t size; // Number of items in the wheel.
+};
+
+// Returns the current time of the clock of the timer wheels, in seconds. The
+// clock is monotonic, and never returns 0.
+uint32_t timer_wheel_now();
+
+// Initializes the given timer wheel (including its mutex), starting at the
+// current time.
+void timer_wheel_initialize(struct TimerWheel *wheel);
+
+// Destroys the mutex of the given timer wheel. The items in it are left alone.
+void timer_wheel_destroy(struct TimerWheel *wheel);
+
+// Adds the given item, which must have an expiration and not be in any timer
+// wheel, to the given timer wheel.
+void timer_wheel_add(struct TimerWheel *wheel, struct Item *item);
+
+// Removes the given item from the given timer wheel if it's in it.
+void timer_wheel_remove(struct TimerWheel *wheel, struct Item *item);
+
+// Returns true if some item of the given timer wheel might be due at the given
+// time. Can be called without the mutex of the wheel.
+bool timer_wheel_due(struct TimerWheel *wheel, uint32_t now);
+
+// Turns the given timer wheel up to the given time, removing the items that
+// expired by then and storing them in the given array, up to the given number
+// of them. Returns the number of items removed. If there are more expired items
+// than that, the wheel stops turning and the rest are returned by the next
+// call.
+uint64_t timer_wheel_expire(struct TimerWheel *wheel, uint32_t now,
+                            struct Item **items, uint64_t max_items);
+
+#endif
@@ -11,4 +11,14 @@ bool is_text_representable(char *arr, uint64_t arr_size) {
     }
   }
   return true;
+}
+
+// Returns the smallest power of two that is greater than or equal to the given
+// number.
+uint64_t next_power_of_two(uint64_t number) {
+  uint64_t power = 1;
+  while (power < number) {
+    power <<= 1;
+  }
+  return power;
 }
\ No newline at end of file
@@ -8,4 +8,8 @@
 // otherwise.
 bool is_text_representable(char *arr, uint64_t arr_size);
 
+// Returns the smallest power of two that is greater than or equal to the given
+// number.
+uint64_t next_power_of_two(uint64_t number);
+
 #endif
\ No newline at end of file
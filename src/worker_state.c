@@ -8,8 +8,11 @@ void worker_stats_initialize(struct WorkerStats *worker_stats) {
   worker_stats->put_count = 0;
   worker_stats->del_count = 0;
   worker_stats->get_count = 0;
+  worker_stats->get_hit_count = 0;
   worker_stats->take_count = 0;
   worker_stats->stats_count = 0;
+  worker_stats->uncompressed_bytes = 0;
+  worker_stats->compressed_bytes = 0;
 }
 
 // Reduces the given array of WorkerStats structs into a single one, adding the
@@ -22,8 +25,11 @@ void worker_stats_reduce(struct WorkerStats *workers_stats,
     destination->put_count += workers_stats[i].put_count;
     destination->del_count += workers_stats[i].del_count;
     destination->get_count += workers_stats[i].get_count;
+    destination->get_hit_count += workers_stats[i].get_hit_count;
     destination->take_count += workers_stats[i].take_count;
     destination->stats_count += workers_stats[i].stats_count;
+    destination->uncompressed_bytes += workers_stats[i].uncompressed_bytes;
+    destination->compressed_bytes += workers_stats[i].compressed_bytes;
   }
 }
 
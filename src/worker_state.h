@@ -3,25 +3,48 @@
 
 #include <pthread.h>
 
+#include "compression.h"
 #include "hashtable.h"
+#include "snapshot.h"
+
+// How the connections are spread among the workers.
+enum EventLoopMode {
+  // Every worker waits on the same epoll instance, which holds the listen
+  // sockets and every client. Clients are armed for a single event, so that
+  // only one worker handles each of them at a time, and they're armed again
+  // after every request.
+  EVENT_LOOPS_SHARED,
+  // Every worker has an epoll instance of its own with listen sockets of its
+  // own (see binder), so clients stay with the worker that accepted them.
+  // Clients are registered for edge-triggered events once, and the worker
+  // handles their requests until their socket runs out of data or room.
+  EVENT_LOOPS_PER_WORKER,
+};
 
 struct WorkerStats {
-  uint64_t put_count;   // Number of PUT requests.
-  uint64_t del_count;   // Number of DEL requests.
-  uint64_t get_count;   // Number of GET requests.
-  uint64_t take_count;  // Number of TAKE requests.
-  uint64_t stats_count; // Number of STATS requests.
+  uint64_t put_count;     // Number of PUT requests.
+  uint64_t del_count;     // Number of DEL requests.
+  uint64_t get_count;     // Number of GET requests.
+  uint64_t get_hit_count; // Number of GET requests that found their key.
+  uint64_t take_count;    // Number of TAKE requests.
+  uint64_t stats_count;   // Number of STATS requests.
+  // Original and compressed sizes of the values compressed by PUT requests.
+  uint64_t uncompressed_bytes;
+  uint64_t compressed_bytes;
 };
 
 struct WorkerArgs {
   int text_fd;                 // File descriptor of the text protocol socket.
   int binary_fd;               // File descriptor of the binary protocol socket.
-  int epoll_fd;                // File descriptor of the shared epoll instance.
+  int epoll_fd;                // File descriptor of the epoll instance.
   unsigned worker_id;          // Worker id.
   unsigned num_workers;        // Number of workers.
   pthread_t *thread_ids;       // Pthread ids of the workers.
   struct HashTable *hashtable; // Shared hash table instance.
   struct WorkerStats *workers_stats; // Usage statistics of the workers.
+  enum CompressionAlgorithm compression; // Compression of large values.
+  struct Snapshot *snapshot; // Snapshots of the hash table, NULL if disabled.
+  enum EventLoopMode event_loops; // Whether the epoll instance is shared.
 };
 
 // Initializes the given WorkerStats struct.
@@ -9,7 +9,9 @@
 #include <unistd.h>
 
 #include "binary_protocol.h"
+#include "epoch.h"
 #include "epoll.h"
+#include "parameters.h"
 #include "protocol.h"
 #include "sockets.h"
 #include "text_protocol.h"
@@ -54,6 +56,14 @@ static void accept_connections(struct WorkerArgs *args, int incoming_fd) {
     }
     event_data_initialize(event_data, client_fd,
                           incoming_fd == args->binary_fd ? BINARY : TEXT);
+    event_data->input = ring_buffer_create(CONNECTION_BUFFER_SIZE);
+    if (event_data->input == NULL) {
+      printf("Couldn't accept incoming connection because we ran out of "
+             "memory...\n");
+      close(client_fd);
+      free(event_data);
+      return;
+    }
 
     // Get the IP address and port of the client and store it in the struct.
     status = getnameinfo(&incoming_addr, incoming_addr_len, event_data->host,
@@ -79,7 +89,13 @@ static void accept_connections(struct WorkerArgs *args, int incoming_fd) {
     }
 
     event.data.ptr = (void *)event_data;
-    event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    if (args->event_loops == EVENT_LOOPS_PER_WORKER) {
+      // Nobody else waits on this epoll instance, so the client doesn't have
+      // to be disarmed between events.
+      event.events = EPOLL_WORKER_CLIENT_EVENTS;
+    } else {
+      event.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
+    }
 
 #if SOCKET_SEND_BUFFER_SIZE
     // Make sure the write buffer is small
@@ -120,13 +136,18 @@ static void handle_client_outcome(int rv, struct WorkerArgs *args,
     // worker_log(args, "Read incomplete while in state <%s>, waiting for
     // more.",
     //            client_state_str(event_data->client_state));
-    epoll_mod_client(args->epoll_fd, event, EPOLLIN);
+    // Clients of an epoll instance of a single worker are never disarmed.
+    if (args->event_loops == EVENT_LOOPS_SHARED) {
+      epoll_mod_client(args->epoll_fd, event, EPOLLIN);
+    }
     break;
   case CLIENT_WRITE_INCOMPLETE:
     // worker_log(args, "Write incomplete while in state <%s>, waiting for
     // more.",
     //            client_state_str(event_data->client_state));
-    epoll_mod_client(args->epoll_fd, event, EPOLLOUT);
+    if (args->event_loops == EVENT_LOOPS_SHARED) {
+      epoll_mod_client(args->epoll_fd, event, EPOLLOUT);
+    }
     break;
   case CLIENT_READ_ERROR:
     worker_log(args, "Read error while in state <%s>, killing connection.",
@@ -143,13 +164,13 @@ static void handle_client_outcome(int rv, struct WorkerArgs *args,
                client_state_str(event_data->client_state));
     event_data_close_client(event_data);
     break;
-  case CLIENT_WRITE_SUCCESS:
-    // worker_log(args, "Request successfully handled");
-    // Read next request.
-    event_data_reset(event_data);
-    epoll_mod_client(args->epoll_fd, event, EPOLLIN);
+  case CLIENT_WRITE_PENDING:
+    // The client is added back to epoll once the content of the response is
+    // read from the extension store.
+    submit_pending_read(event_data);
     break;
   case CLIENT_READ_SUCCESS:
+  case CLIENT_WRITE_SUCCESS:
   // Fall-through!
   default:
     worker_log(args, "Invalid outcome received, probably an error");
@@ -158,51 +179,50 @@ static void handle_client_outcome(int rv, struct WorkerArgs *args,
   }
 }
 
+// Handles an event of a client. Responses are written right after their
+// request is read, and the client goes on with the next request as soon as a
+// response is written, so it's only added back to epoll once reading or
+// writing would block. Requests and responses are handled depending on the
+// state of the client rather than on the event, since clients of an epoll
+// instance of a single worker get both kinds of events at any time.
 static void handle_client(struct WorkerArgs *args, struct epoll_event *event) {
   struct EventData *event_data = event->data.ptr;
   int rv;
 
-  if (event->events & EPOLLIN) {
-    // worker_log(args, "fd %d (%s) is ready to read (state %s)...",
-    //            event_data->fd,
-    //            connection_type_str(event_data->connection_type),
-    //            client_state_str(event_data->client_state));
-
+  while (true) {
+    bool writing = event_data_writing(event_data);
     if (event_data->connection_type == TEXT) {
-      rv = handle_text_client_request(args, event);
+      rv = writing ? handle_text_client_response(args, event)
+                   : handle_text_client_request(args, event);
     } else {
-      rv = handle_binary_client_request(args, event);
+      rv = writing ? handle_binary_client_response(args, event)
+                   : handle_binary_client_request(args, event);
     }
 
-    handle_client_outcome(rv, args, event);
-    return;
-  } else if (event->events & EPOLLOUT) {
-    // worker_log(args, "fd %d (%s) is ready to write (state %s)...",
-    //            event_data->fd,
-    //            connection_type_str(event_data->connection_type),
-    //            client_state_str(event_data->client_state));
-
-    if (event_data->connection_type == TEXT) {
-      rv = handle_text_client_response(args, event);
-    } else {
-      rv = handle_binary_client_response(args, event);
+    if (rv != CLIENT_WRITE_SUCCESS) {
+      break;
     }
 
-    handle_client_outcome(rv, args, event);
-    return;
+    // worker_log(args, "Request successfully handled");
+    // Read next request.
+    event_data_reset(event_data);
   }
 
-  worker_log(args, "Never should reach here...");
+  handle_client_outcome(rv, args, event);
 }
 
 // Worker thread function.
 void *worker(void *_args) {
   struct WorkerArgs *args = (struct WorkerArgs *)_args;
   struct epoll_event events[MAX_EPOLL_EVENTS];
+  // Time to wait for events before going through the expired keys.
+  int timeout = HASH_TABLE_EXPIRATION_INTERVAL_MS;
+
+  epoch_register();
 
   while (true) {
     int num_events =
-        epoll_wait(args->epoll_fd, &events[0], MAX_EPOLL_EVENTS, -1);
+        epoll_wait(args->epoll_fd, &events[0], MAX_EPOLL_EVENTS, timeout);
     if (num_events == -1) {
       perror("worker epoll_wait");
       abort();
@@ -237,5 +257,16 @@ void *worker(void *_args) {
 
       handle_client(args, &events[i]);
     }
+
+    // Remove a batch of expired keys. If there might be more of them, handle
+    // the events that are already waiting and come back for the next batch
+    // right away, so that a lot of keys expiring at once don't stall clients.
+    timeout = hashtable_expire(args->hashtable)
+                  ? 0
+                  : HASH_TABLE_EXPIRATION_INTERVAL_MS;
+
+    // Free the memory this thread retired if no lock-free lookup can be
+    // reading it anymore, the thread might block for a while on epoll_wait.
+    epoch_reclaim();
   }
 }
\ No newline at end of file